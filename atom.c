@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "atom.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "log.h"
+#include "pool.h"
+#include "str.h"
+
+#define UNCONST(op) ((void*)(uintptr_t)(op))
+
+// mburakov: Atoms are interned path segments. Topics usually share most of
+// their segments, i.e. every sensor reports the same few metrics, so each
+// distinct segment is stored only once and shared by all the nodes using it.
+
+static int AtomCompare(const void* key, const void* item) {
+  _Static_assert(!offsetof(struct Atom, str),
+                 "Something is wrong with your compiler");
+  return StrCompare(key, item);
+}
+
+const struct Atom* AtomFind(const struct Hash* atoms, const struct Str* str) {
+  void** atomp = HashFind(atoms, str, HashBytes(str->data, str->size),
+                          AtomCompare);
+  return atomp ? *atomp : NULL;
+}
+
+const struct Atom* AtomAcquire(struct Hash* atoms, const struct Str* str) {
+  size_t hash = HashBytes(str->data, str->size);
+  void** atomp = HashSearch(atoms, str, hash, AtomCompare);
+  if (!atomp) {
+    LOG(ERR, "failed to search atom: %s", strerror(errno));
+    return NULL;
+  }
+
+  if (*atomp != str) {
+    struct Atom* atom = *atomp;
+    atom->refs++;
+    return atom;
+  }
+
+  // mburakov: Characters are stored right after the atom itself, followed by a
+  // terminating zero. This allows to pass atoms as plain C strings.
+  struct Atom* atom = PoolAlloc(sizeof(struct Atom) + str->size + 1, NULL);
+  if (!atom) {
+    LOG(ERR, "failed to allocate atom: %s", strerror(errno));
+    HashDelete(atoms, str, hash);
+    return NULL;
+  }
+  char* data = (char*)(atom + 1);
+  memcpy(data, str->data, str->size);
+  data[str->size] = 0;
+  atom->str.size = str->size;
+  atom->str.data = data;
+  atom->hash = hash;
+  atom->refs = 1;
+  *atomp = atom;
+  return atom;
+}
+
+void AtomRelease(struct Hash* atoms, const struct Atom* atom) {
+  struct Atom* mutable_atom = UNCONST(atom);
+  if (--mutable_atom->refs) return;
+  HashDelete(atoms, atom, atom->hash);
+  PoolFree(mutable_atom, sizeof(struct Atom) + atom->str.size + 1);
+}
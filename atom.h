@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_ATOM_H_
+#define MQTTFS_ATOM_H_
+
+#include <stddef.h>
+
+#include "str.h"
+
+struct Hash;
+
+struct Atom {
+  struct Str str;
+  size_t hash;
+  size_t refs;
+};
+
+const struct Atom* AtomFind(const struct Hash* atoms, const struct Str* str);
+const struct Atom* AtomAcquire(struct Hash* atoms, const struct Str* str);
+void AtomRelease(struct Hash* atoms, const struct Atom* atom);
+
+#endif  // MQTTFS_ATOM_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_BENCH_BENCH_H_
+#define MQTTFS_BENCH_BENCH_H_
+
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define BENCH_BUFFER_SIZE 65536
+
+struct Broker;
+struct Str;
+
+// mburakov: Benchmark links mqttfs with its own replacement of libfuse. There
+// is no kernel, requests are issued by calling the operations directly, and
+// every reply is recorded into the request. Error is -1 until replied to.
+struct fuse_req {
+  void* userdata;
+  int error;
+  struct fuse_entry_param entry;
+  struct stat attr;
+  struct fuse_file_info fi;
+  size_t size;
+  char buf[BENCH_BUFFER_SIZE];
+};
+
+struct fuse_session {
+  struct fuse_lowlevel_ops ops;
+  void* userdata;
+};
+
+// mburakov: Directory entries are laid out the same way as by libfuse.
+struct BenchDirent {
+  uint64_t ino;
+  uint64_t off;
+  uint32_t namelen;
+  uint32_t type;
+  char name[];
+};
+
+// mburakov: Session callback is called right after the filesystem is
+// initialized, in place of the FUSE loop. Filesystem is destroyed after it
+// returns.
+typedef void (*BenchSessionCallback)(struct fuse_session* session, void* user);
+
+int MqttfsMain(int argc, char* argv[]);
+int BenchRunSession(BenchSessionCallback callback, void* user);
+void BenchInitReq(struct fuse_req* req, struct fuse_session* session);
+
+// mburakov: Broker accepts a single client, grants whatever it subscribes to,
+// and responds to all the topics with retained messages. Publishes from the
+// client are counted and timestamped in microseconds. Wait returns the number
+// of publishes received, once there are count of those, or after timeout
+// milliseconds, and the timestamp of the last one.
+struct Broker* BrokerCreate(const struct Str* topics, size_t topics_count,
+                            size_t payload_size);
+uint16_t BrokerPort(const struct Broker* broker);
+_Bool BrokerSend(struct Broker* broker, size_t count);
+size_t BrokerWait(struct Broker* broker, size_t count, int timeout,
+                  int64_t* timestamp);
+void BrokerDestroy(struct Broker* broker);
+
+int64_t BenchMicrosNow(void);
+
+#endif  // MQTTFS_BENCH_BENCH_H_
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "str.h"
+
+// mburakov: Broker speaks just enough MQTT 3.1.1 to keep mqttfs going. Client
+// is read by the broker thread, and messages are written to it by whoever
+// calls send, so writes are serialized with the mutex.
+
+struct Broker {
+  const struct Str* topics;
+  size_t topics_count;
+  size_t cursor;
+  uint8_t* payload;
+  size_t payload_size;
+  size_t sequence;
+  int listen_fd;
+  uint16_t port;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int client_fd;
+  _Bool running;
+  size_t received;
+  int64_t received_timestamp;
+  pthread_t thread;
+};
+
+static _Bool WriteAll(int fd, const void* data, size_t size) {
+  for (const uint8_t* ptr = data; size;) {
+    ssize_t result = write(fd, ptr, size);
+    if (result == -1 && errno == EINTR) continue;
+    if (result <= 0) return 0;
+    ptr += result;
+    size -= (size_t)result;
+  }
+  return 1;
+}
+
+static size_t EncodePublish(struct Broker* broker, uint8_t* buffer,
+                            uint8_t flags) {
+  // mburakov: Payload changes with every message, so that nothing could
+  // tell repeated publishes apart from actual updates.
+  const struct Str* topic = broker->topics + broker->cursor;
+  broker->cursor = (broker->cursor + 1) % broker->topics_count;
+  broker->payload[0] = (uint8_t)('a' + broker->sequence++ % 26);
+  size_t size = 2 + topic->size + broker->payload_size;
+  uint8_t* ptr = buffer;
+  *ptr++ = 0x30 | flags;
+  do {
+    *ptr++ = (uint8_t)((size & 0x7f) | (size > 0x7f ? 0x80 : 0));
+    size >>= 7;
+  } while (size);
+  *ptr++ = (uint8_t)(topic->size >> 8);
+  *ptr++ = (uint8_t)topic->size;
+  memcpy(ptr, topic->data, topic->size);
+  ptr += topic->size;
+  memcpy(ptr, broker->payload, broker->payload_size);
+  ptr += broker->payload_size;
+  return (size_t)(ptr - buffer);
+}
+
+static _Bool SendPublishes(struct Broker* broker, int fd, size_t count,
+                           uint8_t flags) {
+  // mburakov: Publishes are written in large chunks, so that the broker is
+  // never the bottleneck.
+  size_t max_size = 5 + 2 + UINT16_MAX + broker->payload_size;
+  size_t alloc = max_size < BENCH_BUFFER_SIZE ? BENCH_BUFFER_SIZE : max_size;
+  uint8_t* buffer = malloc(alloc);
+  if (!buffer) {
+    fprintf(stderr, "failed to allocate publishes: %s\n", strerror(errno));
+    return 0;
+  }
+  size_t used = 0;
+  for (size_t index = 0; index < count; index++) {
+    if (alloc - used < max_size) {
+      if (!WriteAll(fd, buffer, used)) goto rollback_malloc;
+      used = 0;
+    }
+    used += EncodePublish(broker, buffer + used, flags);
+  }
+  if (!WriteAll(fd, buffer, used)) goto rollback_malloc;
+  free(buffer);
+  return 1;
+
+rollback_malloc:
+  fprintf(stderr, "failed to write publishes: %s\n", strerror(errno));
+  free(buffer);
+  return 0;
+}
+
+static _Bool HandlePacket(struct Broker* broker, int fd, uint8_t type,
+                          const uint8_t* data, size_t size) {
+  static const uint8_t kConnectAck[] = {0x20, 0x02, 0x00, 0x00};
+  static const uint8_t kPingResponse[] = {0xd0, 0x00};
+  switch (type & 0xf0) {
+    case 0x10:
+      return WriteAll(fd, kConnectAck, sizeof(kConnectAck));
+    case 0x30: {
+      // mburakov: Publishes with QoS one are acknowledged right away.
+      if (size < 2) return 0;
+      size_t topic_size = (size_t)data[0] << 8 | data[1];
+      if ((type & 0x06) && size >= 4 + topic_size) {
+        uint8_t ack[] = {0x40, 0x02, data[2 + topic_size],
+                         data[3 + topic_size]};
+        if (!WriteAll(fd, ack, sizeof(ack))) return 0;
+      }
+      broker->received++;
+      broker->received_timestamp = BenchMicrosNow();
+      pthread_cond_broadcast(&broker->cond);
+      return 1;
+    }
+    case 0x80: {
+      // mburakov: Every filter is granted QoS zero, and every subscribe gets
+      // all the topics in response, the same way a broker with all of those
+      // retained would respond to a catch-all filter.
+      if (size < 2) return 0;
+      size_t filters = 0;
+      for (size_t offset = 2; offset + 2 <= size; filters++)
+        offset += 2 + ((size_t)data[offset] << 8 | data[offset + 1]) + 1;
+      uint8_t ack[4 + 64] = {0x90, (uint8_t)(2 + filters), data[0], data[1]};
+      if (filters > 64) return 0;
+      if (!WriteAll(fd, ack, 4 + filters)) return 0;
+      if (!broker->topics_count) return 1;
+      return SendPublishes(broker, fd, broker->topics_count, 0x01);
+    }
+    case 0xa0: {
+      if (size < 2) return 0;
+      uint8_t ack[] = {0xb0, 0x02, data[0], data[1]};
+      return WriteAll(fd, ack, sizeof(ack));
+    }
+    case 0xc0:
+      return WriteAll(fd, kPingResponse, sizeof(kPingResponse));
+    case 0xe0:
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+static void ServeClient(struct Broker* broker, int fd) {
+  size_t alloc = BENCH_BUFFER_SIZE;
+  size_t used = 0;
+  uint8_t* buffer = malloc(alloc);
+  if (!buffer) {
+    fprintf(stderr, "failed to allocate buffer: %s\n", strerror(errno));
+    return;
+  }
+  for (;;) {
+    if (used == alloc) {
+      uint8_t* new_buffer = realloc(buffer, alloc * 2);
+      if (!new_buffer) break;
+      buffer = new_buffer;
+      alloc *= 2;
+    }
+    ssize_t result = read(fd, buffer + used, alloc - used);
+    if (result == -1 && errno == EINTR) continue;
+    if (result <= 0) break;
+    used += (size_t)result;
+
+    size_t offset = 0;
+    for (;;) {
+      size_t size = 0;
+      size_t header = 1;
+      for (int shift = 0; offset + header < used; shift += 7) {
+        uint8_t byte = buffer[offset + header++];
+        size |= (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) goto complete_length;
+      }
+      break;
+    complete_length:
+      if (used - offset - header < size) break;
+      pthread_mutex_lock(&broker->mutex);
+      _Bool handled = HandlePacket(broker, fd, buffer[offset],
+                                   buffer + offset + header, size);
+      pthread_mutex_unlock(&broker->mutex);
+      if (!handled) goto leave;
+      offset += header + size;
+    }
+    memmove(buffer, buffer + offset, used - offset);
+    used -= offset;
+  }
+
+leave:
+  free(buffer);
+}
+
+static void* BrokerThread(void* user) {
+  struct Broker* broker = user;
+  for (;;) {
+    int fd = accept(broker->listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    pthread_mutex_lock(&broker->mutex);
+    if (!broker->running) {
+      pthread_mutex_unlock(&broker->mutex);
+      close(fd);
+      break;
+    }
+    broker->client_fd = fd;
+    pthread_mutex_unlock(&broker->mutex);
+    ServeClient(broker, fd);
+    pthread_mutex_lock(&broker->mutex);
+    broker->client_fd = -1;
+    pthread_mutex_unlock(&broker->mutex);
+    close(fd);
+  }
+  return NULL;
+}
+
+struct Broker* BrokerCreate(const struct Str* topics, size_t topics_count,
+                            size_t payload_size) {
+  struct Broker* broker = calloc(1, sizeof(struct Broker));
+  if (!broker) {
+    fprintf(stderr, "failed to allocate broker: %s\n", strerror(errno));
+    return NULL;
+  }
+  broker->topics = topics;
+  broker->topics_count = topics_count;
+  broker->payload = malloc(payload_size + 1);
+  if (!broker->payload) {
+    fprintf(stderr, "failed to allocate payload: %s\n", strerror(errno));
+    goto rollback_calloc;
+  }
+  memset(broker->payload, 'x', payload_size + 1);
+  broker->payload_size = payload_size;
+  broker->client_fd = -1;
+  broker->running = 1;
+
+  broker->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (broker->listen_fd == -1) {
+    fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+    goto rollback_malloc;
+  }
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t addr_size = sizeof(addr);
+  if (bind(broker->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(broker->listen_fd, 1) ||
+      getsockname(broker->listen_fd, (struct sockaddr*)&addr, &addr_size)) {
+    fprintf(stderr, "failed to listen: %s\n", strerror(errno));
+    goto rollback_socket;
+  }
+  broker->port = ntohs(addr.sin_port);
+  pthread_mutex_init(&broker->mutex, NULL);
+  pthread_cond_init(&broker->cond, NULL);
+  if (pthread_create(&broker->thread, NULL, BrokerThread, broker)) {
+    fprintf(stderr, "failed to create broker thread\n");
+    goto rollback_mutex;
+  }
+  return broker;
+
+rollback_mutex:
+  pthread_cond_destroy(&broker->cond);
+  pthread_mutex_destroy(&broker->mutex);
+rollback_socket:
+  close(broker->listen_fd);
+rollback_malloc:
+  free(broker->payload);
+rollback_calloc:
+  free(broker);
+  return NULL;
+}
+
+uint16_t BrokerPort(const struct Broker* broker) { return broker->port; }
+
+_Bool BrokerSend(struct Broker* broker, size_t count) {
+  pthread_mutex_lock(&broker->mutex);
+  _Bool result = broker->client_fd != -1 && broker->topics_count &&
+                 SendPublishes(broker, broker->client_fd, count, 0);
+  pthread_mutex_unlock(&broker->mutex);
+  return result;
+}
+
+size_t BrokerWait(struct Broker* broker, size_t count, int timeout,
+                  int64_t* timestamp) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&broker->mutex);
+  while (broker->received < count &&
+         !pthread_cond_timedwait(&broker->cond, &broker->mutex, &deadline)) {
+  }
+  size_t result = broker->received;
+  if (timestamp) *timestamp = broker->received_timestamp;
+  pthread_mutex_unlock(&broker->mutex);
+  return result;
+}
+
+void BrokerDestroy(struct Broker* broker) {
+  // mburakov: Shutting the listening socket down wakes the broker thread
+  // up, unless it is still serving a client, which is gone by now.
+  pthread_mutex_lock(&broker->mutex);
+  broker->running = 0;
+  if (broker->client_fd != -1) shutdown(broker->client_fd, SHUT_RDWR);
+  pthread_mutex_unlock(&broker->mutex);
+  shutdown(broker->listen_fd, SHUT_RDWR);
+  pthread_join(broker->thread, NULL);
+  pthread_cond_destroy(&broker->cond);
+  pthread_mutex_destroy(&broker->mutex);
+  close(broker->listen_fd);
+  free(broker->payload);
+  free(broker);
+}
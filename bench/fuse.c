@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+#if defined(FUSE_VERSION) && defined(FUSE_MAKE_VERSION)
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 17)
+#define BENCH_FUSE_SESSION_VERSIONED
+#endif  // FUSE_VERSION >= FUSE_MAKE_VERSION(3, 17)
+#endif  // defined(FUSE_VERSION) && defined(FUSE_MAKE_VERSION)
+
+// mburakov: Only the parts of libfuse that mqttfs uses are replaced. Pollers
+// and interrupts are never exercised, and the cache is never invalidated,
+// because there is no kernel to talk to. Versioned symbols are taken care of
+// by the macros in libfuse headers, which rename these definitions as well.
+
+static BenchSessionCallback g_callback;
+static void* g_user;
+static struct fuse_session g_session;
+
+int64_t BenchMicrosNow(void) {
+  struct timespec result = {.tv_sec = 0, .tv_nsec = 0};
+  clock_gettime(CLOCK_MONOTONIC, &result);
+  return result.tv_sec * 1000000 + result.tv_nsec / 1000;
+}
+
+int BenchRunSession(BenchSessionCallback callback, void* user) {
+  static char arg0[] = "bench_mqttfs";
+  static char arg1[] = "/nonexistent";
+  char* argv[] = {arg0, arg1, NULL};
+  g_callback = callback;
+  g_user = user;
+  return MqttfsMain(2, argv);
+}
+
+void BenchInitReq(struct fuse_req* req, struct fuse_session* session) {
+  req->userdata = session->userdata;
+  req->error = -1;
+  req->size = 0;
+}
+
+void fuse_log(enum fuse_log_level level, const char* fmt, ...) {
+  if (level > FUSE_LOG_WARNING) return;
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+}
+
+void* fuse_req_userdata(fuse_req_t req) { return req->userdata; }
+
+int fuse_reply_err(fuse_req_t req, int err) {
+  req->error = err;
+  return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) { req->error = 0; }
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param* e) {
+  req->error = 0;
+  req->entry = *e;
+  return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param* e,
+                      const struct fuse_file_info* fi) {
+  req->error = 0;
+  req->entry = *e;
+  req->fi = *fi;
+  return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat* attr,
+                    double attr_timeout) {
+  (void)attr_timeout;
+  req->error = 0;
+  req->attr = *attr;
+  return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info* fi) {
+  req->error = 0;
+  req->fi = *fi;
+  return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+  req->error = 0;
+  req->size = count;
+  return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char* buf, size_t size) {
+  req->error = 0;
+  req->size = size < sizeof(req->buf) ? size : sizeof(req->buf);
+  if (req->size) memcpy(req->buf, buf, req->size);
+  return 0;
+}
+
+int fuse_reply_iov(fuse_req_t req, const struct iovec* iov, int count) {
+  req->error = 0;
+  req->size = 0;
+  for (int index = 0; index < count; index++) {
+    size_t size = iov[index].iov_len;
+    size_t room = sizeof(req->buf) - req->size;
+    if (size > room) size = room;
+    memcpy(req->buf + req->size, iov[index].iov_base, size);
+    req->size += size;
+  }
+  return 0;
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec* bufv,
+                    enum fuse_buf_copy_flags flags) {
+  (void)flags;
+  req->error = 0;
+  req->size = 0;
+  for (size_t index = bufv->idx; index < bufv->count; index++) {
+    size_t offset = index == bufv->idx ? bufv->off : 0;
+    size_t size = bufv->buf[index].size - offset;
+    size_t room = sizeof(req->buf) - req->size;
+    if (size > room) size = room;
+    memcpy(req->buf + req->size, (char*)bufv->buf[index].mem + offset, size);
+    req->size += size;
+  }
+  return 0;
+}
+
+int fuse_reply_poll(fuse_req_t req, unsigned revents) {
+  req->error = 0;
+  req->size = revents;
+  return 0;
+}
+
+int fuse_reply_xattr(fuse_req_t req, size_t count) {
+  req->error = 0;
+  req->size = count;
+  return 0;
+}
+
+size_t fuse_add_direntry(fuse_req_t req, char* buf, size_t bufsize,
+                         const char* name, const struct stat* stbuf,
+                         off_t off) {
+  (void)req;
+  size_t namelen = strlen(name);
+  size_t size = (sizeof(struct BenchDirent) + namelen + 7) & ~(size_t)7;
+  if (size > bufsize) return size;
+  struct BenchDirent* dirent = (struct BenchDirent*)(void*)buf;
+  memset(buf, 0, size);
+  dirent->ino = (uint64_t)stbuf->st_ino;
+  dirent->off = (uint64_t)off;
+  dirent->namelen = (uint32_t)namelen;
+  dirent->type = (uint32_t)(stbuf->st_mode & S_IFMT) >> 12;
+  memcpy(dirent->name, name, namelen);
+  return size;
+}
+
+int fuse_lowlevel_notify_poll(struct fuse_pollhandle* ph) {
+  (void)ph;
+  return 0;
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_session* se,
+                                     fuse_ino_t parent, const char* name,
+                                     size_t namelen) {
+  (void)se;
+  (void)parent;
+  (void)name;
+  (void)namelen;
+  return 0;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_session* se, fuse_ino_t ino,
+                                     off_t off, off_t len) {
+  (void)se;
+  (void)ino;
+  (void)off;
+  (void)len;
+  return 0;
+}
+
+void fuse_pollhandle_destroy(struct fuse_pollhandle* ph) { (void)ph; }
+
+void fuse_req_interrupt_func(fuse_req_t req, fuse_interrupt_func_t func,
+                             void* data) {
+  (void)req;
+  (void)func;
+  (void)data;
+}
+
+int fuse_req_interrupted(fuse_req_t req) {
+  (void)req;
+  return 0;
+}
+
+int fuse_parse_cmdline(struct fuse_args* args,
+                       struct fuse_cmdline_opts* opts) {
+  memset(opts, 0, sizeof(struct fuse_cmdline_opts));
+  opts->mountpoint = args->argc > 1 ? strdup(args->argv[1]) : NULL;
+  opts->foreground = 1;
+  opts->singlethread = 1;
+  return 0;
+}
+
+void fuse_cmdline_help(void) {}
+void fuse_lowlevel_help(void) {}
+void fuse_lowlevel_version(void) {}
+const char* fuse_pkgversion(void) { return "bench"; }
+
+// mburakov: Since libfuse 3.17 the public function is an inline wrapper,
+// and the library symbol takes the version of the headers in addition.
+#ifdef BENCH_FUSE_SESSION_VERSIONED
+struct fuse_session* _fuse_session_new(struct fuse_args* args,
+                                       const struct fuse_lowlevel_ops* op,
+                                       size_t op_size,
+                                       struct libfuse_version* version,
+                                       void* userdata) {
+  (void)version;
+#else   // BENCH_FUSE_SESSION_VERSIONED
+struct fuse_session* fuse_session_new(struct fuse_args* args,
+                                      const struct fuse_lowlevel_ops* op,
+                                      size_t op_size, void* userdata) {
+#endif  // BENCH_FUSE_SESSION_VERSIONED
+  (void)args;
+  memset(&g_session.ops, 0, sizeof(g_session.ops));
+  memcpy(&g_session.ops, op,
+         op_size < sizeof(g_session.ops) ? op_size : sizeof(g_session.ops));
+  g_session.userdata = userdata;
+  return &g_session;
+}
+
+int fuse_set_signal_handlers(struct fuse_session* se) {
+  (void)se;
+  return 0;
+}
+
+void fuse_remove_signal_handlers(struct fuse_session* se) { (void)se; }
+
+int fuse_session_mount(struct fuse_session* se, const char* mountpoint) {
+  (void)se;
+  (void)mountpoint;
+  return 0;
+}
+
+int fuse_daemonize(int foreground) {
+  (void)foreground;
+  return 0;
+}
+
+int fuse_session_loop(struct fuse_session* se) {
+  struct fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  if (se->ops.init) se->ops.init(se->userdata, &conn);
+  g_callback(se, g_user);
+  return 0;
+}
+
+int fuse_session_loop_mt(struct fuse_session* se, int clone_fd) {
+  (void)clone_fd;
+  return fuse_session_loop(se);
+}
+
+void fuse_session_unmount(struct fuse_session* se) { (void)se; }
+
+void fuse_session_destroy(struct fuse_session* se) {
+  if (se->ops.destroy) se->ops.destroy(se->userdata);
+}
+
+void fuse_opt_free_args(struct fuse_args* args) { (void)args; }
@@ -0,0 +1,590 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "mqttfs.h"
+#include "str.h"
+
+// mburakov: Every scenario prints a single json line to stdout, so that runs
+// could be compared by a script. Latencies are in microseconds. Filesystem is
+// set up from scratch for every topic count, with the broker responding to
+// its subscription with all the topics, the same way retained messages do.
+
+static const size_t kReaddirSize = 4096;
+static const size_t kMaxSamples = 1 << 20;
+
+struct Samples {
+  int64_t* data;
+  size_t size;
+  size_t alloc;
+};
+
+struct Bench {
+  size_t fanout;
+  size_t payload_size;
+  int duration;
+  int holdback;
+  struct Str* topics;
+  size_t topics_count;
+  struct Broker* broker;
+  int64_t started;
+  fuse_ino_t* leaves;
+  size_t leaves_count;
+  size_t leaves_alloc;
+};
+
+struct Feeder {
+  struct Broker* broker;
+  atomic_bool stop;
+};
+
+static void SamplesAdd(struct Samples* samples, int64_t value) {
+  if (samples->size == samples->alloc) {
+    size_t alloc = samples->alloc ? samples->alloc * 2 : 1024;
+    if (alloc > kMaxSamples) return;
+    int64_t* data = realloc(samples->data, alloc * sizeof(int64_t));
+    if (!data) return;
+    samples->data = data;
+    samples->alloc = alloc;
+  }
+  samples->data[samples->size++] = value;
+}
+
+static int CompareSamples(const void* a, const void* b) {
+  int64_t value_a = *(const int64_t*)a;
+  int64_t value_b = *(const int64_t*)b;
+  return (value_a > value_b) - (value_a < value_b);
+}
+
+static int64_t Percentile(struct Samples* samples, double percentile) {
+  if (!samples->size) return 0;
+  qsort(samples->data, samples->size, sizeof(int64_t), CompareSamples);
+  size_t index = (size_t)(percentile * (double)(samples->size - 1));
+  return samples->data[index];
+}
+
+static struct Str* MakeTopics(size_t count, size_t fanout, char** storage) {
+  // mburakov: Topics form a tree with fanout children in every directory, or
+  // a single flat directory when fanout is zero.
+  size_t depth = 1;
+  for (size_t capacity = fanout; fanout && capacity < count; depth++) {
+    if (capacity > SIZE_MAX / fanout) break;
+    capacity *= fanout;
+  }
+  size_t stride = sizeof("bench") + depth * (2 + 20);
+  struct Str* topics = malloc(count * sizeof(struct Str));
+  *storage = malloc(count * stride);
+  if (!topics || !*storage) {
+    fprintf(stderr, "failed to allocate topics: %s\n", strerror(errno));
+    free(topics);
+    free(*storage);
+    return NULL;
+  }
+  for (size_t index = 0; index < count; index++) {
+    char* data = *storage + index * stride;
+    int size = snprintf(data, stride, "bench");
+    if (!fanout) {
+      size += snprintf(data + size, stride - (size_t)size, "/t%zu", index);
+    } else {
+      size_t divisor = 1;
+      for (size_t level = 1; level < depth; level++) divisor *= fanout;
+      for (; divisor > 1; divisor /= fanout) {
+        size += snprintf(data + size, stride - (size_t)size, "/d%zu",
+                         index / divisor % fanout);
+      }
+      size += snprintf(data + size, stride - (size_t)size, "/t%zu",
+                       index % fanout);
+    }
+    topics[index].size = (size_t)size;
+    topics[index].data = data;
+  }
+  return topics;
+}
+
+static size_t Applied(struct fuse_session* session) {
+  struct Context* context = session->userdata;
+  pthread_rwlock_rdlock(&context->root_lock);
+  size_t result = context->messages;
+  pthread_rwlock_unlock(&context->root_lock);
+  return result;
+}
+
+static _Bool WaitApplied(struct fuse_session* session, size_t target) {
+  // mburakov: Gives up once nothing was applied for a few seconds.
+  static const int64_t kStallTimeout = 5000000;
+  size_t applied = Applied(session);
+  for (int64_t progress = BenchMicrosNow(); applied < target;) {
+    usleep(100);
+    size_t current = Applied(session);
+    int64_t now = BenchMicrosNow();
+    if (current != applied) progress = now;
+    if (now - progress > kStallTimeout) {
+      fprintf(stderr, "stalled at %zu of %zu messages\n", current, target);
+      return 0;
+    }
+    applied = current;
+  }
+  return 1;
+}
+
+static void Forget(struct fuse_session* session, fuse_ino_t ino) {
+  struct fuse_req* req = malloc(sizeof(struct fuse_req));
+  if (!req) return;
+  BenchInitReq(req, session);
+  session->ops.forget(req, ino, 1);
+  free(req);
+}
+
+static _Bool AddLeaf(struct Bench* bench, fuse_ino_t ino) {
+  if (bench->leaves_count == bench->leaves_alloc) {
+    size_t alloc = bench->leaves_alloc ? bench->leaves_alloc * 2 : 1024;
+    fuse_ino_t* leaves = realloc(bench->leaves, alloc * sizeof(fuse_ino_t));
+    if (!leaves) return 0;
+    bench->leaves = leaves;
+    bench->leaves_alloc = alloc;
+  }
+  bench->leaves[bench->leaves_count++] = ino;
+  return 1;
+}
+
+static _Bool Walk(struct Bench* bench, struct fuse_session* session,
+                  fuse_ino_t ino, struct Samples* samples, size_t* entries) {
+  // mburakov: This is what the kernel does for find or ls -R, every entry is
+  // looked up after being listed. Leaves are kept looked up for later.
+  _Bool result = 0;
+  struct fuse_req* req = malloc(sizeof(struct fuse_req));
+  struct fuse_req* lookup = malloc(sizeof(struct fuse_req));
+  if (!req || !lookup) {
+    fprintf(stderr, "failed to allocate requests: %s\n", strerror(errno));
+    goto leave;
+  }
+  BenchInitReq(req, session);
+  struct fuse_file_info fi = {.flags = O_RDONLY};
+  session->ops.opendir(req, ino, &fi);
+  if (req->error) {
+    fprintf(stderr, "failed to open directory: %s\n", strerror(req->error));
+    goto leave;
+  }
+  fi = req->fi;
+  for (off_t off = 0;;) {
+    BenchInitReq(req, session);
+    int64_t start = BenchMicrosNow();
+    session->ops.readdir(req, ino, kReaddirSize, off, &fi);
+    SamplesAdd(samples, BenchMicrosNow() - start);
+    if (req->error) {
+      fprintf(stderr, "failed to read directory: %s\n", strerror(req->error));
+      goto leave;
+    }
+    if (!req->size) break;
+    for (size_t offset = 0; offset < req->size;) {
+      const struct BenchDirent* dirent = (void*)(req->buf + offset);
+      offset += (sizeof(struct BenchDirent) + dirent->namelen + 7) & ~7ul;
+      off = (off_t)dirent->off;
+      char name[256];
+      if (dirent->namelen >= sizeof(name)) continue;
+      memcpy(name, dirent->name, dirent->namelen);
+      name[dirent->namelen] = 0;
+      if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+      BenchInitReq(lookup, session);
+      session->ops.lookup(lookup, ino, name);
+      if (lookup->error) {
+        fprintf(stderr, "failed to lookup %s: %s\n", name,
+                strerror(lookup->error));
+        goto leave;
+      }
+      ++*entries;
+      fuse_ino_t child = lookup->entry.ino;
+      if (S_ISDIR(lookup->entry.attr.st_mode)) {
+        _Bool walked = Walk(bench, session, child, samples, entries);
+        Forget(session, child);
+        if (!walked) goto leave;
+      } else if (!AddLeaf(bench, child)) {
+        Forget(session, child);
+      }
+    }
+  }
+  result = 1;
+
+leave:
+  free(lookup);
+  free(req);
+  return result;
+}
+
+static void ColdStart(struct Bench* bench, struct fuse_session* session) {
+  if (!WaitApplied(session, bench->topics_count)) return;
+  double elapsed = (double)(BenchMicrosNow() - bench->started) / 1e6;
+  printf("{\"scenario\":\"cold_start\",\"topics\":%zu,\"seconds\":%.3f,"
+         "\"messages_per_s\":%.0f}\n",
+         bench->topics_count, elapsed, (double)bench->topics_count / elapsed);
+}
+
+static void Ingest(struct Bench* bench, struct fuse_session* session) {
+  // mburakov: Every topic is updated at least once, and small trees are
+  // updated several times, so that the figure is not dominated by noise.
+  static const size_t kMinMessages = 1 << 18;
+  size_t count = bench->topics_count;
+  while (count < kMinMessages) count += bench->topics_count;
+  size_t target = Applied(session) + count;
+  int64_t started = BenchMicrosNow();
+  if (!BrokerSend(bench->broker, count) || !WaitApplied(session, target))
+    return;
+  double elapsed = (double)(BenchMicrosNow() - started) / 1e6;
+  printf("{\"scenario\":\"ingest\",\"topics\":%zu,\"payload\":%zu,"
+         "\"messages\":%zu,\"seconds\":%.3f,\"messages_per_s\":%.0f,"
+         "\"mib_per_s\":%.1f}\n",
+         bench->topics_count, bench->payload_size, count, elapsed,
+         (double)count / elapsed,
+         (double)(count * bench->payload_size) / elapsed / (1 << 20));
+}
+
+static void Readdir(struct Bench* bench, struct fuse_session* session) {
+  struct Samples samples = {.data = NULL};
+  size_t entries = 0;
+  int64_t started = BenchMicrosNow();
+  _Bool walked = Walk(bench, session, FUSE_ROOT_ID, &samples, &entries);
+  int64_t elapsed = BenchMicrosNow() - started;
+  if (walked) {
+    printf("{\"scenario\":\"readdir\",\"topics\":%zu,\"fanout\":%zu,"
+           "\"entries\":%zu,\"walk_us\":%lld,\"readdir_calls\":%zu,"
+           "\"readdir_p50_us\":%lld,\"readdir_p99_us\":%lld,"
+           "\"readdir_max_us\":%lld}\n",
+           bench->topics_count, bench->fanout, entries, (long long)elapsed,
+           samples.size, (long long)Percentile(&samples, 0.5),
+           (long long)Percentile(&samples, 0.99),
+           (long long)Percentile(&samples, 1.0));
+  }
+  free(samples.data);
+}
+
+static size_t ReadAll(struct fuse_session* session, struct fuse_req* req,
+                      fuse_ino_t ino, size_t* reads) {
+  size_t total = 0;
+  struct fuse_file_info fi = {.flags = O_RDONLY};
+  BenchInitReq(req, session);
+  session->ops.open(req, ino, &fi);
+  if (req->error) return 0;
+  fi = req->fi;
+  for (;; ++*reads) {
+    BenchInitReq(req, session);
+    session->ops.read(req, ino, BENCH_BUFFER_SIZE, (off_t)total, &fi);
+    if (req->error || !req->size) break;
+    total += req->size;
+  }
+  BenchInitReq(req, session);
+  session->ops.release(req, ino, &fi);
+  return total;
+}
+
+static void Scrape(struct Bench* bench, struct fuse_session* session) {
+  // mburakov: Every file is read separately first, the way a scraper walking
+  // the tree does, and then the whole tree is read through the all file.
+  struct fuse_req* req = malloc(sizeof(struct fuse_req));
+  if (!req) {
+    fprintf(stderr, "failed to allocate request: %s\n", strerror(errno));
+    return;
+  }
+  size_t files_bytes = 0;
+  size_t files_reads = 0;
+  int64_t started = BenchMicrosNow();
+  for (size_t index = 0; index < bench->leaves_count; index++)
+    files_bytes += ReadAll(session, req, bench->leaves[index], &files_reads);
+  int64_t files_elapsed = BenchMicrosNow() - started;
+
+  size_t all_bytes = 0;
+  size_t all_reads = 0;
+  started = BenchMicrosNow();
+  BenchInitReq(req, session);
+  session->ops.lookup(req, FUSE_ROOT_ID, MQTTFS_ALL_NAME);
+  if (req->error) {
+    fprintf(stderr, "failed to lookup all: %s\n", strerror(req->error));
+    free(req);
+    return;
+  }
+  fuse_ino_t ino = req->entry.ino;
+  all_bytes = ReadAll(session, req, ino, &all_reads);
+  int64_t all_elapsed = BenchMicrosNow() - started;
+  Forget(session, ino);
+
+  printf("{\"scenario\":\"scrape\",\"topics\":%zu,\"files\":%zu,"
+         "\"files_us\":%lld,\"files_reads\":%zu,\"files_bytes\":%zu,"
+         "\"all_us\":%lld,\"all_reads\":%zu,\"all_bytes\":%zu}\n",
+         bench->topics_count, bench->leaves_count, (long long)files_elapsed,
+         files_reads, files_bytes, (long long)all_elapsed, all_reads,
+         all_bytes);
+  free(req);
+}
+
+static void* FeederThread(void* user) {
+  struct Feeder* feeder = user;
+  while (!atomic_load(&feeder->stop)) {
+    if (!BrokerSend(feeder->broker, 1024)) break;
+  }
+  return NULL;
+}
+
+static void ReadUnderIngest(struct Bench* bench,
+                            struct fuse_session* session) {
+  // mburakov: Random leaves are queried while the broker keeps updating all
+  // the topics as fast as mqttfs takes those.
+  if (!bench->leaves_count) return;
+  struct fuse_req* req = malloc(sizeof(struct fuse_req));
+  if (!req) {
+    fprintf(stderr, "failed to allocate request: %s\n", strerror(errno));
+    return;
+  }
+  struct Feeder feeder = {.broker = bench->broker};
+  atomic_init(&feeder.stop, 0);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, FeederThread, &feeder)) {
+    fprintf(stderr, "failed to create feeder thread\n");
+    free(req);
+    return;
+  }
+
+  struct Samples getattr_samples = {.data = NULL};
+  struct Samples read_samples = {.data = NULL};
+  size_t applied = Applied(session);
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  int64_t started = BenchMicrosNow();
+  int64_t deadline = started + bench->duration * 1000000ll;
+  for (int64_t now = started; now < deadline;) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    fuse_ino_t ino = bench->leaves[state % bench->leaves_count];
+
+    BenchInitReq(req, session);
+    session->ops.getattr(req, ino, NULL);
+    int64_t getattr_done = BenchMicrosNow();
+    SamplesAdd(&getattr_samples, getattr_done - now);
+
+    struct fuse_file_info fi = {.flags = O_RDONLY};
+    BenchInitReq(req, session);
+    session->ops.open(req, ino, &fi);
+    if (!req->error) {
+      fi = req->fi;
+      BenchInitReq(req, session);
+      session->ops.read(req, ino, kReaddirSize, 0, &fi);
+      BenchInitReq(req, session);
+      session->ops.release(req, ino, &fi);
+    }
+    now = BenchMicrosNow();
+    SamplesAdd(&read_samples, now - getattr_done);
+  }
+  double elapsed = (double)(BenchMicrosNow() - started) / 1e6;
+  applied = Applied(session) - applied;
+  atomic_store(&feeder.stop, 1);
+  pthread_join(thread, NULL);
+
+  printf("{\"scenario\":\"read_under_ingest\",\"topics\":%zu,"
+         "\"seconds\":%.3f,\"ingest_messages_per_s\":%.0f,"
+         "\"getattr_calls\":%zu,\"getattr_p50_us\":%lld,"
+         "\"getattr_p99_us\":%lld,\"read_calls\":%zu,\"read_p50_us\":%lld,"
+         "\"read_p99_us\":%lld}\n",
+         bench->topics_count, elapsed, (double)applied / elapsed,
+         getattr_samples.size, (long long)Percentile(&getattr_samples, 0.5),
+         (long long)Percentile(&getattr_samples, 0.99), read_samples.size,
+         (long long)Percentile(&read_samples, 0.5),
+         (long long)Percentile(&read_samples, 0.99));
+  free(read_samples.data);
+  free(getattr_samples.data);
+  free(req);
+}
+
+static void RunTopics(struct fuse_session* session, void* user) {
+  struct Bench* bench = user;
+  ColdStart(bench, session);
+  Ingest(bench, session);
+  Readdir(bench, session);
+  Scrape(bench, session);
+  ReadUnderIngest(bench, session);
+  for (size_t index = 0; index < bench->leaves_count; index++)
+    Forget(session, bench->leaves[index]);
+  bench->leaves_count = 0;
+}
+
+static void RunPublish(struct fuse_session* session, void* user) {
+  // mburakov: Latency is measured from issuing a write until the broker
+  // receives the publish. The first write waits for the connection.
+  static const char kName[] = "bench_publish";
+  struct Bench* bench = user;
+  char* payload = malloc(bench->payload_size + 1);
+  struct fuse_req* req = malloc(sizeof(struct fuse_req));
+  if (!payload || !req) {
+    fprintf(stderr, "failed to allocate publish: %s\n", strerror(errno));
+    goto leave;
+  }
+  memset(payload, 'x', bench->payload_size + 1);
+  BenchInitReq(req, session);
+  struct fuse_file_info fi = {.flags = O_WRONLY | O_CREAT};
+  session->ops.create(req, FUSE_ROOT_ID, kName, S_IFREG | 0644, &fi);
+  if (req->error) {
+    fprintf(stderr, "failed to create file: %s\n", strerror(req->error));
+    goto leave;
+  }
+  fuse_ino_t ino = req->entry.ino;
+  fi = req->fi;
+
+  BenchInitReq(req, session);
+  session->ops.write(req, ino, payload, bench->payload_size, 0, &fi);
+  if (!BrokerWait(bench->broker, 1, 10000, NULL)) {
+    fprintf(stderr, "failed to connect to broker\n");
+    goto rollback_create;
+  }
+  usleep((useconds_t)(bench->holdback + 100) * 1000);
+
+  struct Samples samples = {.data = NULL};
+  int64_t started = BenchMicrosNow();
+  int64_t deadline = started + bench->duration * 1000000ll;
+  for (int64_t now = started; now < deadline && samples.size < 10000;) {
+    size_t received = BrokerWait(bench->broker, 0, 0, NULL);
+    payload[0] = (char)('a' + samples.size % 26);
+    BenchInitReq(req, session);
+    session->ops.write(req, ino, payload, bench->payload_size, 0, &fi);
+    int64_t timestamp;
+    if (BrokerWait(bench->broker, received + 1, 5000, &timestamp) ==
+        received) {
+      fprintf(stderr, "publish never reached the broker\n");
+      break;
+    }
+    SamplesAdd(&samples, timestamp - now);
+    now = BenchMicrosNow();
+  }
+  printf("{\"scenario\":\"publish\",\"holdback_ms\":%d,\"payload\":%zu,"
+         "\"publishes\":%zu,\"latency_p50_us\":%lld,"
+         "\"latency_p99_us\":%lld,\"latency_max_us\":%lld}\n",
+         bench->holdback, bench->payload_size, samples.size,
+         (long long)Percentile(&samples, 0.5),
+         (long long)Percentile(&samples, 0.99),
+         (long long)Percentile(&samples, 1.0));
+  free(samples.data);
+
+rollback_create:
+  BenchInitReq(req, session);
+  session->ops.release(req, ino, &fi);
+  BenchInitReq(req, session);
+  session->ops.unlink(req, FUSE_ROOT_ID, kName);
+  Forget(session, ino);
+leave:
+  free(req);
+  free(payload);
+}
+
+static int RunSession(struct Bench* bench, BenchSessionCallback callback) {
+  char port[8];
+  char holdback[16];
+  snprintf(port, sizeof(port), "%u", BrokerPort(bench->broker));
+  snprintf(holdback, sizeof(holdback), "%d", bench->holdback);
+  setenv("MQTT_HOST", "127.0.0.1", 1);
+  setenv("MQTT_PORT", port, 1);
+  setenv("MQTT_HOLDBACK", holdback, 1);
+  bench->started = BenchMicrosNow();
+  int result = BenchRunSession(callback, bench);
+  fflush(stdout);
+  return result;
+}
+
+static int Usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [-t topics[,topics...]] [-f fanout] [-p payload]\n"
+          "       [-d seconds] [-H holdback]\n",
+          name);
+  return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+  // mburakov: Other MQTT_* variables are honoured, so the same scenarios could
+  // be run with, say, MQTT_CORK=1 or MQTT_MEMORY set. Broker only accepts a
+  // single connection though.
+  const char* topics_list = "10000,100000,1000000";
+  struct Bench bench = {
+      .fanout = 100,
+      .payload_size = 64,
+      .duration = 1,
+      .holdback = 10,
+  };
+  for (int opt; (opt = getopt(argc, argv, "t:f:p:d:H:")) != -1;) {
+    switch (opt) {
+      case 't':
+        topics_list = optarg;
+        break;
+      case 'f':
+        bench.fanout = (size_t)atol(optarg);
+        break;
+      case 'p':
+        bench.payload_size = (size_t)atol(optarg);
+        break;
+      case 'd':
+        bench.duration = atoi(optarg);
+        break;
+      case 'H':
+        bench.holdback = atoi(optarg);
+        break;
+      default:
+        return Usage(argv[0]);
+    }
+  }
+  if (optind != argc || bench.fanout == 1 || bench.duration <= 0 ||
+      bench.holdback < 0 || bench.payload_size > (1 << 20))
+    return Usage(argv[0]);
+
+  int holdback = bench.holdback;
+  bench.holdback = 0;
+  for (const char* ptr = topics_list; *ptr;) {
+    char* end;
+    bench.topics_count = (size_t)strtoul(ptr, &end, 10);
+    if (end == ptr || !bench.topics_count) return Usage(argv[0]);
+    ptr = *end == ',' ? end + 1 : end;
+
+    char* storage;
+    bench.topics = MakeTopics(bench.topics_count, bench.fanout, &storage);
+    if (!bench.topics) return EXIT_FAILURE;
+    bench.broker =
+        BrokerCreate(bench.topics, bench.topics_count, bench.payload_size);
+    if (!bench.broker) return EXIT_FAILURE;
+    int result = RunSession(&bench, RunTopics);
+    BrokerDestroy(bench.broker);
+    free(bench.topics);
+    free(storage);
+    if (result) return EXIT_FAILURE;
+  }
+  free(bench.leaves);
+
+  bench.topics_count = 0;
+  for (int index = 0; index < 2; index++) {
+    bench.holdback = index ? holdback : 0;
+    bench.broker = BrokerCreate(NULL, 0, 0);
+    if (!bench.broker) return EXIT_FAILURE;
+    int result = RunSession(&bench, RunPublish);
+    BrokerDestroy(bench.broker);
+    if (result) return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt_parser.h"
+#include "str.h"
+
+#ifndef LENGTH
+#define LENGTH(op) (sizeof(op) / sizeof *(op))
+#endif  // LENGTH
+
+// mburakov: Capture is a raw server-to-client byte stream, i.e. what ends up
+// in the receive ring. Something like socat -r capture.bin can record one.
+static void* ReadCapture(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  size_t alloc = 1 << 16;
+  uint8_t* result = malloc(alloc);
+  if (!result) {
+    fprintf(stderr, "failed to allocate buffer: %s\n", strerror(errno));
+    goto rollback_fopen;
+  }
+  *size = 0;
+  for (;;) {
+    *size += fread(result + *size, 1, alloc - *size, file);
+    if (*size < alloc) break;
+    uint8_t* new_result = realloc(result, alloc * 2);
+    if (!new_result) {
+      fprintf(stderr, "failed to grow buffer: %s\n", strerror(errno));
+      goto rollback_malloc;
+    }
+    result = new_result;
+    alloc *= 2;
+  }
+  if (ferror(file)) {
+    fprintf(stderr, "failed to read %s\n", path);
+    goto rollback_malloc;
+  }
+  fclose(file);
+  return result;
+
+rollback_malloc:
+  free(result);
+rollback_fopen:
+  fclose(file);
+  return NULL;
+}
+
+// mburakov: Synthetic traffic resembles what zigbee2mqtt and friends produce,
+// short topics with small json payloads, and an occasional non-publish packet.
+static void* SynthesizeCapture(size_t count, size_t* size) {
+  static const char kPayload[] =
+      "{\"battery\":100,\"humidity\":41.2,\"linkquality\":120,"
+      "\"temperature\":22.5,\"voltage\":3000}";
+  uint8_t* result = malloc(count * 128);
+  if (!result) {
+    fprintf(stderr, "failed to allocate buffer: %s\n", strerror(errno));
+    return NULL;
+  }
+  uint8_t* ptr = result;
+  for (size_t index = 0; index < count; index++) {
+    if (index % 64 == 63) {
+      // mburakov: Ping response.
+      *ptr++ = 0xd0;
+      *ptr++ = 0x00;
+      continue;
+    }
+    char topic[32];
+    int topic_len =
+        snprintf(topic, sizeof(topic), "zigbee2mqtt/sensor_%zu", index % 100);
+    size_t remaining_length = 2 + (size_t)topic_len + sizeof(kPayload) - 1;
+    *ptr++ = 0x30;
+    *ptr++ = (uint8_t)remaining_length;
+    *ptr++ = (uint8_t)(topic_len >> 8);
+    *ptr++ = (uint8_t)topic_len;
+    memcpy(ptr, topic, (size_t)topic_len);
+    ptr += topic_len;
+    memcpy(ptr, kPayload, sizeof(kPayload) - 1);
+    ptr += sizeof(kPayload) - 1;
+  }
+  *size = (size_t)(ptr - result);
+  return result;
+}
+
+static double SecondsNow(void) {
+  struct timespec result = {.tv_sec = 0, .tv_nsec = 0};
+  clock_gettime(CLOCK_MONOTONIC, &result);
+  return (double)result.tv_sec + (double)result.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t size;
+  void* capture = argc == 2 ? ReadCapture(argv[1], &size)
+                             : SynthesizeCapture(1 << 16, &size);
+  if (!capture) return EXIT_FAILURE;
+
+  // mburakov: Keep parsing the same capture over and over for about a second,
+  // so that short captures still produce a meaningful figure.
+  size_t passes = 0;
+  size_t packets = 0;
+  size_t checksum = 0;
+  double started = SecondsNow();
+  double elapsed = 0;
+  for (; elapsed < 1.0; elapsed = SecondsNow() - started) {
+    const void* tail = capture;
+    size_t tail_size = size;
+    for (enum MqttParseStatus status = kMqttParseStatusSuccess;
+         status == kMqttParseStatusSuccess;) {
+      struct MqttPacketView views[64];
+      size_t count =
+          MqttParseMessages(&tail, &tail_size, kMqttProtocolLevel311, views,
+                            LENGTH(views), &status);
+      for (size_t index = 0; index < count; index++)
+        checksum += views[index].topic.size + views[index].payload_len;
+      packets += count;
+      if (status == kMqttParseStatusError) {
+        fprintf(stderr, "failed to parse capture at offset %zu\n",
+                size - tail_size);
+        free(capture);
+        return EXIT_FAILURE;
+      }
+    }
+    passes++;
+  }
+
+  printf("%zu bytes, %zu passes, %zu publish packets (checksum %zu)\n", size,
+         passes, packets, checksum);
+  printf("%.0f packets/s, %.1f MiB/s\n", (double)packets / elapsed,
+         (double)(size * passes) / elapsed / (1 << 20));
+  free(capture);
+  return EXIT_SUCCESS;
+}
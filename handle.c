@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "handle.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// mburakov: Handles keep the state of an open file. Those assemble everything
+// written through the file, so that it could be published as a single message
+// when the file is flushed. Remaining length of an MQTT message is limited, and
+// so is the size of a handle. Handles also remember which node version was last
+// reported to pollers of the file.
+
+struct Handle* HandleCreate(_Bool loaded, uint64_t seen) {
+  struct Handle* result = calloc(1, sizeof(struct Handle));
+  if (!result) {
+    LOG(ERR, "failed to allocate handle: %s", strerror(errno));
+    return NULL;
+  }
+  int error = pthread_mutex_init(&result->mutex, NULL);
+  if (error) {
+    LOG(ERR, "failed to init handle mutex: %s", strerror(error));
+    free(result);
+    return NULL;
+  }
+  result->loaded = loaded;
+  result->seen = seen;
+  return result;
+}
+
+_Bool HandleWrite(struct Handle* handle, const void* data, size_t size,
+                  off_t offset) {
+  static const size_t kMaxSize = 268435455;
+  if (offset < 0 || (size_t)offset > kMaxSize ||
+      size > kMaxSize - (size_t)offset) {
+    LOG(ERR, "handle size limit exceeded");
+    errno = EFBIG;
+    return 0;
+  }
+
+  size_t end = (size_t)offset + size;
+  if (end > handle->alloc) {
+    size_t alloc = handle->alloc ? handle->alloc : 4096;
+    while (alloc < end) alloc *= 2;
+    char* buffer = realloc(handle->data, alloc);
+    if (!buffer) {
+      LOG(ERR, "failed to reallocate handle: %s", strerror(errno));
+      return 0;
+    }
+    handle->data = buffer;
+    handle->alloc = alloc;
+  }
+
+  // mburakov: Writing past the end leaves a hole, which reads as zeroes.
+  if ((size_t)offset > handle->size)
+    memset(handle->data + handle->size, 0, (size_t)offset - handle->size);
+  if (size) memcpy(handle->data + offset, data, size);
+  if (end > handle->size) handle->size = end;
+  return 1;
+}
+
+_Bool HandleTruncate(struct Handle* handle, off_t size) {
+  // mburakov: Extending is the same as writing nothing at the new end.
+  if (size < 0 || (size_t)size > handle->size)
+    return HandleWrite(handle, NULL, 0, size);
+  handle->size = (size_t)size;
+  return 1;
+}
+
+void HandleDestroy(struct Handle* handle) {
+  if (handle->ph) fuse_pollhandle_destroy(handle->ph);
+  pthread_mutex_destroy(&handle->mutex);
+  free(handle->data);
+  free(handle);
+}
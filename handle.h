@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_HANDLE_H_
+#define MQTTFS_HANDLE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct fuse_pollhandle;
+struct Stream;
+
+struct Handle {
+  // mburakov: Write buffer is protected by the handle mutex.
+  pthread_mutex_t mutex;
+  _Bool loaded;
+  _Bool dirty;
+  size_t size;
+  size_t alloc;
+  char* data;
+  // mburakov: Poll state is protected by the root lock.
+  uint64_t seen;
+  struct fuse_pollhandle* ph;
+  struct Handle* prev;
+  struct Handle* next;
+  // mburakov: Files opened as streams queue updates there, under the root lock.
+  struct Stream* stream;
+};
+
+struct Handle* HandleCreate(_Bool loaded, uint64_t seen);
+_Bool HandleWrite(struct Handle* handle, const void* data, size_t size,
+                  off_t offset);
+_Bool HandleTruncate(struct Handle* handle, off_t size);
+void HandleDestroy(struct Handle* handle);
+
+#endif  // MQTTFS_HANDLE_H_
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hash.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// mburakov: This is an open addressing hash table with linear probing. It
+// mimics tsearch interface, so searching for a missing key inserts the key
+// itself, and the caller is supposed to replace it with an actual item. Slots
+// returned from lookups are only valid until the next insertion or deletion.
+
+size_t HashBytes(const void* data, size_t size) {
+  // mburakov: This is 64-bit FNV-1a.
+  uint64_t result = 0xcbf29ce484222325ull;
+  for (const uint8_t* ptr = data; ptr < (const uint8_t*)data + size; ptr++)
+    result = (result ^ *ptr) * 0x100000001b3ull;
+  return (size_t)result;
+}
+
+size_t HashCombine(size_t a, size_t b) {
+  uint64_t result = (a ^ (b + 0x9e3779b97f4a7c15ull + (a << 6) + (a >> 2)));
+  result = (result ^ (result >> 31)) * 0x7fb5d329728ea185ull;
+  return (size_t)(result ^ (result >> 27));
+}
+
+static struct HashSlot* Probe(const struct Hash* hash, const void* key,
+                              size_t key_hash, HashCompare compare) {
+  size_t mask = hash->alloc - 1;
+  for (size_t index = key_hash & mask;; index = (index + 1) & mask) {
+    struct HashSlot* slot = hash->slots + index;
+    if (!slot->item) return slot;
+    if (slot->hash == key_hash && !compare(key, slot->item)) return slot;
+  }
+}
+
+static _Bool Grow(struct Hash* hash) {
+  size_t alloc = hash->alloc ? hash->alloc * 2 : 16;
+  struct HashSlot* slots = calloc(alloc, sizeof(struct HashSlot));
+  if (!slots) return 0;
+  for (size_t index = 0; index < hash->alloc; index++) {
+    const struct HashSlot* slot = hash->slots + index;
+    if (!slot->item) continue;
+    size_t new_index = slot->hash & (alloc - 1);
+    while (slots[new_index].item) new_index = (new_index + 1) & (alloc - 1);
+    slots[new_index] = *slot;
+  }
+  free(hash->slots);
+  hash->slots = slots;
+  hash->alloc = alloc;
+  return 1;
+}
+
+void** HashFind(const struct Hash* hash, const void* key, size_t key_hash,
+                HashCompare compare) {
+  if (!hash->size) return NULL;
+  struct HashSlot* slot = Probe(hash, key, key_hash, compare);
+  return slot->item ? &slot->item : NULL;
+}
+
+void** HashSearch(struct Hash* hash, const void* key, size_t key_hash,
+                  HashCompare compare) {
+  // mburakov: Load factor is kept below one half, so probing stays short.
+  if ((hash->size + 1) * 2 > hash->alloc && !Grow(hash)) return NULL;
+  struct HashSlot* slot = Probe(hash, key, key_hash, compare);
+  if (!slot->item) {
+    slot->hash = key_hash;
+    slot->item = (void*)(uintptr_t)key;
+    hash->size++;
+  }
+  return &slot->item;
+}
+
+void HashDelete(struct Hash* hash, const void* item, size_t item_hash) {
+  if (!hash->size) return;
+  size_t mask = hash->alloc - 1;
+  size_t index = item_hash & mask;
+  for (; hash->slots[index].item != item; index = (index + 1) & mask) {
+    if (!hash->slots[index].item) return;
+  }
+
+  // mburakov: Shift subsequent items of the same cluster back, so that lookups
+  // never run into a hole before reaching the item they are looking for.
+  for (size_t next = (index + 1) & mask;; next = (next + 1) & mask) {
+    struct HashSlot* slot = hash->slots + next;
+    if (!slot->item) break;
+    size_t home = slot->hash & mask;
+    if (((next - home) & mask) < ((next - index) & mask)) continue;
+    hash->slots[index] = *slot;
+    index = next;
+  }
+  hash->slots[index].item = NULL;
+  hash->size--;
+  hash->deletions++;
+}
+
+void HashDestroy(struct Hash* hash) {
+  free(hash->slots);
+  hash->slots = NULL;
+  hash->alloc = 0;
+  hash->size = 0;
+}
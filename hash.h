@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_HASH_H_
+#define MQTTFS_HASH_H_
+
+#include <stddef.h>
+
+struct HashSlot {
+  size_t hash;
+  void* item;
+};
+
+struct Hash {
+  struct HashSlot* slots;
+  size_t alloc;
+  size_t size;
+  // mburakov: Deletions shift other items back, so those are counted for the
+  // walks over the slots that release the lock in between.
+  size_t deletions;
+};
+
+typedef int (*HashCompare)(const void* key, const void* item);
+
+size_t HashBytes(const void* data, size_t size);
+size_t HashCombine(size_t a, size_t b);
+
+void** HashFind(const struct Hash* hash, const void* key, size_t key_hash,
+                HashCompare compare);
+void** HashSearch(struct Hash* hash, const void* key, size_t key_hash,
+                  HashCompare compare);
+void HashDelete(struct Hash* hash, const void* item, size_t item_hash);
+void HashDestroy(struct Hash* hash);
+
+#endif  // MQTTFS_HASH_H_
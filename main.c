@@ -17,19 +17,40 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
 #include <netinet/in.h>
-#include <search.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqtt.h"
 #include "mqttfs.h"
 #include "node.h"
+#include "payload.h"
+#include "pool.h"
 #include "str.h"
+#include "tree.h"
+
+#ifndef LENGTH
+#define LENGTH(op) (sizeof(op) / sizeof *(op))
+#endif  // LENGTH
+
+static _Bool IsSpreadable(const char* filters) {
+  // mburakov: Topics are spread across connections by their top-level segment,
+  // and a filter starting with a wildcard would match topics of all of those.
+  for (const char* ptr = filters;;) {
+    size_t length = strcspn(ptr, ",/");
+    if (length == 1 && (*ptr == '+' || *ptr == '#')) return 0;
+    ptr = strchr(ptr, ',');
+    if (!ptr) return 1;
+    ptr++;
+  }
+}
 
 static struct Options ParseOptions() {
   struct Options options = {
@@ -37,6 +58,27 @@ static struct Options ParseOptions() {
       .port = 1883,
       .keepalive = 60,
       .holdback = 0,
+      .queue = 16,
+      .coalesce = 0,
+      .nodelay = 0,
+      .cork = 0,
+      .cache = 0,
+      .buffer = 0,
+      .entry_timeout = 1.0,
+      .attr_timeout = 1.0,
+      .subscribe = "+/#",
+      .lazy = 0,
+      .connections = 1,
+      .version = 4,
+      .qos = 0,
+      .inflight = 16,
+      .sync = 0,
+      .memory = 0,
+      .snapshot = NULL,
+      .snapshot_interval = 60,
+      .stream = 64,
+      .dedup = 0,
+      .notify = 0,
   };
   const char* maybe_host = getenv("MQTT_HOST");
   if (maybe_host) {
@@ -73,184 +115,474 @@ static struct Options ParseOptions() {
     }
     options.holdback = holdback;
   }
-  return options;
-}
-
-static void* CreateRootNode() {
-  struct Str path = StrView("");
-  struct Node* node = NodeCreate(&path, 1);
-  if (!node) {
-    LOG(ERR, "failed to create root node");
-    return NULL;
+  const char* maybe_queue = getenv("MQTT_QUEUE");
+  if (maybe_queue) {
+    int queue = atoi(maybe_queue);
+    if (queue <= 0) {
+      LOG(ERR, "invalid queue value provided");
+      exit(EINVAL);
+    }
+    options.queue = (size_t)queue;
   }
-
-  void* root_node = NULL;
-  if (!tsearch(node, &root_node, NodeCompare)) {
-    LOG(ERR, "failed to search root node: %s", strerror(errno));
-    goto rollback_node_create;
+  const char* maybe_coalesce = getenv("MQTT_COALESCE");
+  if (maybe_coalesce) {
+    int coalesce = atoi(maybe_coalesce);
+    if (coalesce < 0 || 1 < coalesce) {
+      LOG(ERR, "invalid coalesce value provided");
+      exit(EINVAL);
+    }
+    options.coalesce = (_Bool)coalesce;
   }
-  return root_node;
-
-rollback_node_create:
-  NodeDestroy(node);
-  return NULL;
-}
-
-static void OnMqttMessage(void* user, const struct Str* topic,
-                          const void* payload, size_t payload_len) {
-  // TODO(mburakov): Check that topic is in canonical form.
-
-  struct Context* context = user;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return;
+  const char* maybe_nodelay = getenv("MQTT_NODELAY");
+  if (maybe_nodelay) {
+    int nodelay = atoi(maybe_nodelay);
+    if (nodelay < 0 || 1 < nodelay) {
+      LOG(ERR, "invalid nodelay value provided");
+      exit(EINVAL);
+    }
+    options.nodelay = (_Bool)nodelay;
   }
-
-  // mburakov: Either search, or create a node.
-  void** nodep = tsearch(topic, &context->root_node, NodeCompare);
-  if (!nodep) {
-    LOG(ERR, "failed to search node: %s", strerror(errno));
-    goto rollback_mtx_lock;
+  const char* maybe_cork = getenv("MQTT_CORK");
+  if (maybe_cork) {
+    int cork = atoi(maybe_cork);
+    if (cork < 0 || 1 < cork) {
+      LOG(ERR, "invalid cork value provided");
+      exit(EINVAL);
+    }
+    options.cork = (_Bool)cork;
   }
-
-  if (*nodep != topic) {
-    // mburakov: Node exists, just update it.
-    struct Node* node = *nodep;
-    if (node->is_dir) {
-      LOG(ERR, "node is a directory");
-      goto rollback_mtx_lock;
+  const char* maybe_cache = getenv("MQTT_CACHE");
+  if (maybe_cache) {
+    int cache = atoi(maybe_cache);
+    if (cache < 0 || 1 < cache) {
+      LOG(ERR, "invalid cache value provided");
+      exit(EINVAL);
     }
-    if (!NodeUpdate(node, payload, payload_len)) {
-      LOG(ERR, "failed to update node");
-      goto rollback_mtx_lock;
+    options.cache = (_Bool)cache;
+  }
+  const char* maybe_buffer = getenv("MQTT_BUFFER");
+  if (maybe_buffer) {
+    int buffer = atoi(maybe_buffer);
+    if (buffer < 0 || 1 < buffer) {
+      LOG(ERR, "invalid buffer value provided");
+      exit(EINVAL);
     }
-    mtx_unlock(&context->root_mutex);
-    return;
+    options.buffer = (_Bool)buffer;
   }
-
-  // mburakov: Node does not exist, and has to be created and updated.
-  struct Node* node = NodeCreate(topic, 0);
-  if (!node) {
-    LOG(ERR, "failed to create node");
-    goto rollback_tsearch;
+  const char* maybe_entry_timeout = getenv("MQTT_ENTRY_TIMEOUT");
+  if (maybe_entry_timeout) {
+    double entry_timeout = atof(maybe_entry_timeout);
+    if (entry_timeout < 0) {
+      LOG(ERR, "invalid entry timeout value provided");
+      exit(EINVAL);
+    }
+    options.entry_timeout = entry_timeout;
   }
-  if (!NodeUpdate(node, payload, payload_len)) {
-    LOG(ERR, "failed to update node");
-    goto rollback_node_create;
+  const char* maybe_attr_timeout = getenv("MQTT_ATTR_TIMEOUT");
+  if (maybe_attr_timeout) {
+    double attr_timeout = atof(maybe_attr_timeout);
+    if (attr_timeout < 0) {
+      LOG(ERR, "invalid attr timeout value provided");
+      exit(EINVAL);
+    }
+    options.attr_timeout = attr_timeout;
   }
-  *nodep = node;
-
-  // mburakov: Some parent directory nodes might also be missing.
-  struct Str base_path = StrBasePath(topic);
-  for (; base_path.size; base_path = StrBasePath(&base_path)) {
-    nodep = tsearch(&base_path, &context->root_node, NodeCompare);
-    if (!nodep) {
-      LOG(ERR, "failed to search parent node: %s", strerror(errno));
-      goto rollback_recurse;
+  const char* maybe_lazy = getenv("MQTT_LAZY");
+  if (maybe_lazy) {
+    int lazy = atoi(maybe_lazy);
+    if (lazy < 0 || INT_MAX / 1000 < lazy) {
+      LOG(ERR, "invalid lazy value provided");
+      exit(EINVAL);
     }
-
-    if (*nodep != &base_path) {
-      // mburakov: Reached first existing parent node.
-      struct Node* parent = *nodep;
-      if (!parent->is_dir) {
-        LOG(ERR, "parent node is not a directory");
-        goto rollback_recurse;
-      }
-      // mburakov: The first existing parent node is a directory. Reaching it
-      // means that the full base path is available now.
-      break;
+    options.lazy = lazy * 1000;
+  }
+  const char* maybe_connections = getenv("MQTT_CONNECTIONS");
+  if (maybe_connections) {
+    int connections = atoi(maybe_connections);
+    if (connections <= 0 || 64 < connections) {
+      LOG(ERR, "invalid connections value provided");
+      exit(EINVAL);
     }
-
-    // mburakov: Parent node does not exist, and has to be created.
-    struct Node* parent = NodeCreate(&base_path, 1);
-    if (!parent) {
-      LOG(ERR, "failed to create parent node");
-      tdelete(&base_path, &context->root_node, NodeCompare);
-      goto rollback_recurse;
+    options.connections = (size_t)connections;
+  }
+  const char* maybe_version = getenv("MQTT_VERSION");
+  if (maybe_version) {
+    int version = atoi(maybe_version);
+    if (version != 4 && version != 5) {
+      LOG(ERR, "invalid version value provided");
+      exit(EINVAL);
+    }
+    options.version = version;
+  }
+  const char* maybe_qos = getenv("MQTT_QOS");
+  if (maybe_qos) {
+    int qos = atoi(maybe_qos);
+    if (qos < 0 || 1 < qos) {
+      LOG(ERR, "invalid qos value provided");
+      exit(EINVAL);
+    }
+    options.qos = qos;
+  }
+  const char* maybe_inflight = getenv("MQTT_INFLIGHT");
+  if (maybe_inflight) {
+    int inflight = atoi(maybe_inflight);
+    if (inflight <= 0 || UINT16_MAX < inflight) {
+      LOG(ERR, "invalid inflight value provided");
+      exit(EINVAL);
+    }
+    options.inflight = (size_t)inflight;
+  }
+  const char* maybe_sync = getenv("MQTT_SYNC");
+  if (maybe_sync) {
+    int sync = atoi(maybe_sync);
+    if (sync < 0 || 1 < sync) {
+      LOG(ERR, "invalid sync value provided");
+      exit(EINVAL);
     }
-    *nodep = parent;
+    options.sync = (_Bool)sync;
   }
+  const char* maybe_memory = getenv("MQTT_MEMORY");
+  if (maybe_memory) {
+    long long memory = atoll(maybe_memory);
+    if (memory < 0 || (long long)(SIZE_MAX >> 20) < memory) {
+      LOG(ERR, "invalid memory value provided");
+      exit(EINVAL);
+    }
+    options.memory = (size_t)memory << 20;
+  }
+  const char* maybe_snapshot = getenv("MQTT_SNAPSHOT");
+  if (maybe_snapshot && *maybe_snapshot) options.snapshot = maybe_snapshot;
+  const char* maybe_snapshot_interval = getenv("MQTT_SNAPSHOT_INTERVAL");
+  if (maybe_snapshot_interval) {
+    int snapshot_interval = atoi(maybe_snapshot_interval);
+    if (snapshot_interval <= 0) {
+      LOG(ERR, "invalid snapshot interval value provided");
+      exit(EINVAL);
+    }
+    options.snapshot_interval = snapshot_interval;
+  }
+  const char* maybe_stream = getenv("MQTT_STREAM");
+  if (maybe_stream) {
+    int stream = atoi(maybe_stream);
+    if (stream < 2) {
+      LOG(ERR, "invalid stream value provided");
+      exit(EINVAL);
+    }
+    options.stream = (size_t)stream;
+  }
+  const char* maybe_dedup = getenv("MQTT_DEDUP");
+  if (maybe_dedup) {
+    int dedup = atoi(maybe_dedup);
+    if (dedup < 0 || 1 < dedup) {
+      LOG(ERR, "invalid dedup value provided");
+      exit(EINVAL);
+    }
+    options.dedup = (_Bool)dedup;
+  }
+  const char* maybe_notify = getenv("MQTT_NOTIFY");
+  if (maybe_notify) {
+    int notify = atoi(maybe_notify);
+    if (notify < 0 || INT_MAX / 1000 < notify) {
+      LOG(ERR, "invalid notify value provided");
+      exit(EINVAL);
+    }
+    options.notify = notify;
+  }
+  // mburakov: Lazy mode subscribes on demand, so there's nothing to subscribe
+  // to in advance, unless asked explicitly.
+  const char* maybe_subscribe = getenv("MQTT_SUBSCRIBE");
+  if (maybe_subscribe)
+    options.subscribe = maybe_subscribe;
+  else if (options.lazy)
+    options.subscribe = "";
+  if (options.connections > 1 && !IsSpreadable(options.subscribe)) {
+    LOG(ERR, "filters starting with a wildcard need a single connection");
+    exit(EINVAL);
+  }
+  return options;
+}
 
-  mtx_unlock(&context->root_mutex);
-  return;
+static void OnMqttConnect(void* user) {
+  // mburakov: Whatever was received before might have changed while there was
+  // no connection. Nodes are kept, and retained messages refresh those.
+  struct Connection* connection = user;
+  struct Context* context = connection->context;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return;
+  }
+  connection->epoch++;
+  MqttfsUnlock(context);
+}
 
-rollback_recurse:
-  for (struct Str rollback_path = StrBasePath(topic);
-       rollback_path.size != base_path.size;
-       rollback_path = StrBasePath(&rollback_path)) {
-    nodep = tfind(&rollback_path, &context->root_node, NodeCompare);
-    // mburakov: The node has to be in the tree.
-    NodeDestroy(*nodep);
-    tdelete(&rollback_path, &context->root_node, NodeCompare);
-  }
-rollback_node_create:
-  NodeDestroy(node);
-rollback_tsearch:
-  tdelete(topic, &context->root_node, 0);
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
+static int InitRootLock(pthread_rwlock_t* root_lock) {
+  pthread_rwlockattr_t attr;
+  int result = pthread_rwlockattr_init(&attr);
+  if (result) return result;
+#ifdef __GLIBC__
+  // mburakov: Readers hold the lock shortly, but there could be many of them.
+  // Without this setting glibc would let them starve message ingestion.
+  result = pthread_rwlockattr_setkind_np(
+      &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif  // __GLIBC__
+  if (!result) result = pthread_rwlock_init(root_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  return result;
 }
 
-static void* MqttfsInit(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+static void MqttfsInit(void* userdata, struct fuse_conn_info* conn) {
   (void)conn;
-  // TODO(mburakov): Implement lazy connecting.
-  struct Context* context = fuse_get_context()->private_data;
-  context->mqtt = MqttCreate(context->options.host, context->options.port,
-                             context->options.keepalive,
-                             context->options.holdback, OnMqttMessage, context);
-  cfg->direct_io = 1;
-  cfg->nullpath_ok = 1;
-  return context;
+  // mburakov: Clients connect in the background, so filesystem is served
+  // right away, and topics show up as soon as those arrive. Every connection
+  // has its own IO thread, and all of those feed the same tree.
+  struct Context* context = userdata;
+  int flags = (context->options.coalesce ? kMqttFlagCoalesce : 0) |
+              (context->options.nodelay ? kMqttFlagNodelay : 0) |
+              (context->options.cork ? kMqttFlagCork : 0) |
+              (context->options.version == 5 ? kMqttFlagMqtt5 : 0) |
+              (context->options.qos == 1 ? kMqttFlagQos1 : 0);
+  for (size_t index = 0; index < context->options.connections; index++) {
+    struct Connection* connection = context->connections + index;
+    char* filters = MqttfsConnectionFilters(context, index);
+    if (!filters) {
+      LOG(ERR, "failed to get connection filters");
+      continue;
+    }
+    if (!MqttfsApplyStart(connection)) {
+      LOG(ERR, "failed to start applying messages");
+      free(filters);
+      continue;
+    }
+    connection->mqtt = MqttCreate(
+        context->options.host, context->options.port,
+        context->options.keepalive, context->options.holdback,
+        context->options.queue, context->options.inflight, filters, flags,
+        OnMqttConnect, MqttfsApplyMessage, connection);
+    free(filters);
+  }
+  if (!MqttfsSnapshotStart(context)) LOG(ERR, "failed to start snapshots");
+}
+
+static void MqttfsDestroy(void* userdata) {
+  // mburakov: Applying messages might use the session, so connections and
+  // their apply threads have to be gone before the session is. This is called
+  // while the latter still exists.
+  struct Context* context = userdata;
+  struct MqttStats total = {.batches = {0}};
+  for (size_t index = 0; index < context->options.connections; index++) {
+    struct Connection* connection = context->connections + index;
+    if (!connection->mqtt) continue;
+    struct MqttStats stats;
+    MqttGetStats(connection->mqtt, &stats);
+    for (size_t bucket = 0; bucket < LENGTH(stats.batches); bucket++)
+      total.batches[bucket] += stats.batches[bucket];
+    MqttDestroy(connection->mqtt);
+    connection->mqtt = NULL;
+  }
+  for (size_t index = 0; index < context->options.connections; index++)
+    MqttfsApplyStop(context->connections + index);
+  for (size_t index = 0; index < LENGTH(total.batches); index++) {
+    if (!total.batches[index]) continue;
+    LOG(INFO, "%zu batches of %zu to %zu publishes", total.batches[index],
+        (size_t)1 << index, ((size_t)2 << index) - 1);
+  }
+  MqttfsSnapshotStop(context);
 }
 
-static int MqttfsChmod(const char* path, mode_t mode,
-                       struct fuse_file_info* fi) {
-  // mburakov: This operation is unsupported, but required by NGINX.
-  (void)path;
-  (void)mode;
-  (void)fi;
-  return 0;
+// mburakov: Operations are timed from being dispatched until their handlers
+// return. Requests that are parked, like blocking reads of events files, are
+// only timed until parked.
+#define TIMED(name, params, ...)                 \
+  static void Timed##name params {               \
+    int64_t start = MqttfsStatsClock();          \
+    Mqttfs##name(__VA_ARGS__);                   \
+    MqttfsStatsOp(kMqttfsOp##name, start);       \
+  }
+
+TIMED(Lookup, (fuse_req_t req, fuse_ino_t parent, const char* name), req,
+      parent, name)
+TIMED(Forget, (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup), req, ino,
+      nlookup)
+TIMED(Getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi),
+      req, ino, fi)
+TIMED(Setattr,
+      (fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+       struct fuse_file_info* fi),
+      req, ino, attr, to_set, fi)
+TIMED(Mkdir,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode), req,
+      parent, name, mode)
+TIMED(Unlink, (fuse_req_t req, fuse_ino_t parent, const char* name), req,
+      parent, name)
+TIMED(Rename,
+      (fuse_req_t req, fuse_ino_t parent, const char* name,
+       fuse_ino_t newparent, const char* newname, unsigned int flags),
+      req, parent, name, newparent, newname, flags)
+TIMED(Open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), req,
+      ino, fi)
+TIMED(Read,
+      (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+       struct fuse_file_info* fi),
+      req, ino, size, off, fi)
+TIMED(Write,
+      (fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+       off_t off, struct fuse_file_info* fi),
+      req, ino, buf, size, off, fi)
+TIMED(Flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), req,
+      ino, fi)
+TIMED(Fsync,
+      (fuse_req_t req, fuse_ino_t ino, int datasync,
+       struct fuse_file_info* fi),
+      req, ino, datasync, fi)
+TIMED(Release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi),
+      req, ino, fi)
+TIMED(Opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi),
+      req, ino, fi)
+TIMED(Readdir,
+      (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+       struct fuse_file_info* fi),
+      req, ino, size, off, fi)
+TIMED(Create,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+       struct fuse_file_info* fi),
+      req, parent, name, mode, fi)
+TIMED(Poll,
+      (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+       struct fuse_pollhandle* ph),
+      req, ino, fi, ph)
+TIMED(Getxattr,
+      (fuse_req_t req, fuse_ino_t ino, const char* name, size_t size), req,
+      ino, name, size)
+TIMED(ForgetMulti,
+      (fuse_req_t req, size_t count, struct fuse_forget_data* forgets), req,
+      count, forgets)
+
+static void TimedRmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  int64_t start = MqttfsStatsClock();
+  MqttfsUnlink(req, parent, name);
+  MqttfsStatsOp(kMqttfsOpRmdir, start);
 }
 
-static void NodeDestroyWrapper(void* node) {
-  // mburakov: This is needed to avoid casting function types.
-  NodeDestroy(node);
+static int RunSession(struct fuse_args* args, struct Context* context) {
+  // mburakov: This reproduces fuse_main, including its exit codes.
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(args, &opts)) {
+    LOG(ERR, "failed to parse command line");
+    return 1;
+  }
+  int result = 0;
+  if (opts.show_help) {
+    printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    goto rollback_parse_cmdline;
+  }
+  if (opts.show_version) {
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    goto rollback_parse_cmdline;
+  }
+  if (!opts.mountpoint) {
+    LOG(ERR, "no mountpoint specified");
+    result = 1;
+    goto rollback_parse_cmdline;
+  }
+
+  static const struct fuse_lowlevel_ops kFuseOperations = {
+      .init = MqttfsInit,
+      .destroy = MqttfsDestroy,
+      .lookup = TimedLookup,
+      .forget = TimedForget,
+      .getattr = TimedGetattr,
+      .setattr = TimedSetattr,
+      .mkdir = TimedMkdir,
+      .unlink = TimedUnlink,
+      .rmdir = TimedRmdir,
+      .rename = TimedRename,
+      .open = TimedOpen,
+      .read = TimedRead,
+      .write = TimedWrite,
+      .flush = TimedFlush,
+      .fsync = TimedFsync,
+      .release = TimedRelease,
+      .opendir = TimedOpendir,
+      .readdir = TimedReaddir,
+      .create = TimedCreate,
+      .poll = TimedPoll,
+      .getxattr = TimedGetxattr,
+      .forget_multi = TimedForgetMulti,
+  };
+  struct fuse_session* session = fuse_session_new(
+      args, &kFuseOperations, sizeof(kFuseOperations), context);
+  if (!session) {
+    LOG(ERR, "failed to create session");
+    result = 1;
+    goto rollback_parse_cmdline;
+  }
+  context->session = session;
+  if (fuse_set_signal_handlers(session)) {
+    LOG(ERR, "failed to set signal handlers");
+    result = 1;
+    goto rollback_session_new;
+  }
+  if (fuse_session_mount(session, opts.mountpoint)) {
+    LOG(ERR, "failed to mount session");
+    result = 1;
+    goto rollback_set_signal_handlers;
+  }
+  fuse_daemonize(opts.foreground);
+  if (opts.singlethread ? fuse_session_loop(session)
+                         : fuse_session_loop_mt(session, opts.clone_fd))
+    result = 1;
+  fuse_session_unmount(session);
+rollback_set_signal_handlers:
+  fuse_remove_signal_handlers(session);
+rollback_session_new:
+  fuse_session_destroy(session);
+rollback_parse_cmdline:
+  free(opts.mountpoint);
+  return result;
 }
 
 int main(int argc, char* argv[]) {
   struct Context context = {
       .options = ParseOptions(),
-      .root_node = CreateRootNode(),
+      .refetch_mutex = PTHREAD_MUTEX_INITIALIZER,
+      .refetch_cond = PTHREAD_COND_INITIALIZER,
   };
-  if (!context.root_node) {
-    LOG(ERR, "failed to create root node");
+  context.connections =
+      calloc(context.options.connections, sizeof(struct Connection));
+  if (!context.connections) {
+    LOG(ERR, "failed to allocate connections: %s", strerror(errno));
+    exit(ENOMEM);
+  }
+  for (size_t index = 0; index < context.options.connections; index++) {
+    context.connections[index].context = &context;
+    context.connections[index].epoch = 1;
+  }
+  if (!TreeInit(&context.tree)) {
+    LOG(ERR, "failed to create node tree");
+    free(context.connections);
     exit(EIO);
   }
-  if (mtx_init(&context.root_mutex, mtx_plain) != thrd_success) {
-    LOG(ERR, "failed to initialize mutex: %s", strerror(errno));
-    tdestroy(context.root_node, NodeDestroyWrapper);
-    exit(errno);
-  }
-  static const struct fuse_operations kFuseOperations = {
-      .getattr = MqttfsGetattr,
-      .mkdir = MqttfsMkdir,
-      .unlink = MqttfsUnlink,
-      .rmdir = MqttfsUnlink,
-      .rename = MqttfsRename,
-      .chmod = MqttfsChmod,
-      .open = MqttfsOpen,
-      .read = MqttfsRead,
-      .write = MqttfsWrite,
-      .opendir = MqttfsOpendir,
-      .readdir = MqttfsReaddir,
-      .init = MqttfsInit,
-      .create = MqttfsCreate,
-      .utimens = MqttfsUtimens,
-      .poll = MqttfsPoll,
-  };
-  int result = fuse_main(argc, argv, &kFuseOperations, &context);
-  if (context.mqtt) MqttDestroy(context.mqtt);
-  tdestroy(context.root_node, NodeDestroyWrapper);
-  mtx_destroy(&context.root_mutex);
+  int error = InitRootLock(&context.root_lock);
+  if (error) {
+    LOG(ERR, "failed to initialize root lock: %s", strerror(error));
+    TreeDestroy(&context.tree);
+    free(context.connections);
+    exit(error);
+  }
+  if (!MqttfsSnapshotLoad(&context))
+    LOG(WARNING, "failed to load snapshot");
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  int result = RunSession(&args, &context);
+  fuse_opt_free_args(&args);
+  LOG(INFO, "%zu allocations for %zu messages", PoolAllocations(),
+      context.messages);
+  LOG(INFO, "%zu bytes of payloads resident", PayloadResident());
+  TreeDestroy(&context.tree);
+  pthread_rwlock_destroy(&context.root_lock);
+  free(context.connections);
   return result;
 }
@@ -19,21 +19,26 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <threads.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "hash.h"
 #include "log.h"
 #include "mqtt_impl.h"
 #include "mqtt_parser.h"
+#include "ring.h"
 #include "str.h"
 
 #ifndef LENGTH
@@ -44,24 +49,136 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif  // MIN
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif  // MAX
+
+#ifndef UNCONST
+#define UNCONST(op) ((void*)(uintptr_t)(op))
+#endif  // UNCONST
+
+// mburakov: Every publish message takes three iovecs.
+#define MQTT_BATCH_MAX (IOV_MAX / 3)
+
+// mburakov: Reconnect delay bounds, in milliseconds.
+#define MQTT_BACKOFF_MIN 500
+#define MQTT_BACKOFF_MAX 30000
+
+// mburakov: Number of topic aliases the broker is allowed to use with MQTT 5.
+#define MQTT_TOPIC_ALIAS_MAX 1024
+
+// mburakov: Pending messages are not written to the outbound buffer while it
+// holds this many bytes, and publishers are throttled meanwhile.
+#define MQTT_OUTBOUND_HIGH (1 << 20)
+
+// mburakov: Pending messages with the same topic are chained from the oldest
+// to the newest one, and only the newest one is indexed. Topic and payload are
+// stored right after the message itself, with a gap in between that is filled
+// with the packet identifier and properties when sending.
 struct MqttMessage {
   int64_t timestamp;
+  size_t seq;
+  size_t hash;
+  uint16_t packet_id;
+  struct MqttMessage* older;
+  struct MqttMessage* newer;
   struct Str topic;
   void* payload;
   size_t payload_len;
+  char data[];
+};
+
+// mburakov: Lazy subscriptions expire unless renewed before the deadline.
+// Expired ones are chained together before those are deleted from the hash.
+struct MqttSubscription {
+  int64_t deadline;
+  size_t hash;
+  uint16_t packet_id;
+  struct MqttSubscription* expired;
+  struct Str filter;
+  char data[];
+};
+
+// mburakov: Outbound topic aliases are assigned on the first publish to a
+// topic until the broker limit is reached, and are valid for the connection.
+struct MqttTopicAlias {
+  size_t hash;
+  uint16_t alias;
+  struct Str topic;
+  char data[];
+};
+
+// mburakov: Connection is established by the IO thread. Until the broker
+// acknowledges it, nothing but the connect message is written to the socket.
+// Lost connection is reestablished after a delay, and pending messages and
+// subscriptions are kept in the meantime.
+enum MqttState {
+  kMqttStateDisconnected,
+  kMqttStateConnecting,
+  kMqttStateHandshaking,
+  kMqttStateConnected,
 };
 
 struct Mqtt {
+  struct sockaddr_in addr;
+  enum MqttProtocolLevel level;
   uint16_t keepalive;
   int holdback;
+  int flags;
+  MqttConnectCallback connect_callback;
   MqttMessageCallback callback;
   void* user;
   int64_t last_timestamp;
-  struct MqttMessage* messages;
+  int reconnect_delay;
+  int backoff;
+  unsigned seed;
+  struct MqttMessage** messages;
   size_t messages_alloc;
+  size_t messages_head;
   size_t messages_size;
+  size_t messages_seq;
+  struct Hash messages_index;
+  struct MqttStats stats;
+  // mburakov: These counters are only ever written by the IO thread, but are
+  // read without the mutex, so updates are relaxed stores rather than atomic
+  // read-modify-writes.
+  atomic_size_t messages_in;
+  atomic_size_t bytes_in;
+  atomic_size_t parse_errors;
+  atomic_size_t loop_latency[MQTT_HISTOGRAM_SIZE];
+  char* filters_data;
+  struct Str* filters;
+  size_t filters_count;
+  uint16_t filters_packet_id;
+  uint16_t packet_id;
+  struct Hash subscriptions;
+  // mburakov: Topic aliases and broker limits are only ever accessed by the IO
+  // thread. Receive maximum only applies to publishes with QoS above zero.
+  struct Str* inbound_aliases;
+  struct Hash outbound_aliases;
+  uint16_t outbound_aliases_count;
+  uint16_t topic_alias_maximum;
+  uint16_t receive_maximum;
+  uint32_t maximum_packet_size;
+  // mburakov: Messages sent with QoS one are kept in flight until
+  // acknowledged. Flush waits for all the messages published before it to be
+  // either sent with QoS zero, or acknowledged, or dropped.
+  struct MqttMessage** inflight;
+  size_t inflight_alloc;
+  size_t inflight_window;
+  size_t inflight_head;
+  size_t inflight_size;
+  _Bool retransmit;
+  size_t dropped;
+  cnd_t flushed;
+  // mburakov: Besides pending messages, this mutex protects subscriptions,
+  // state and the outbound buffer, which serializes all writes to the socket.
+  // State is only ever changed by the IO thread.
   mtx_t messages_mutex;
+  enum MqttState state;
+  struct Ring ring;
   int fd;
+  struct Outbound outbound;
   int pipe[2];
   atomic_bool running;
   thrd_t io_thread;
@@ -73,38 +190,695 @@ static int64_t MillisNow() {
   return result.tv_sec * 1000 + result.tv_nsec / 1000000;
 }
 
+static int64_t MicrosNow() {
+  struct timespec result = {.tv_sec = 0, .tv_nsec = 0};
+  clock_gettime(CLOCK_MONOTONIC, &result);
+  return result.tv_sec * 1000000 + result.tv_nsec / 1000;
+}
+
+static size_t Bucket(int64_t value, size_t count) {
+  if (value <= 0) return 0;
+  size_t bucket = (size_t)(64 - __builtin_clzll((unsigned long long)value));
+  return MIN(bucket, count - 1);
+}
+
+static void Count(atomic_size_t* counter, size_t value) {
+  size_t current = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static int MessageMatch(const void* key, const void* item) {
+  const struct MqttMessage* a = key;
+  const struct MqttMessage* b = item;
+  return StrCompare(&a->topic, &b->topic);
+}
+
+static int SubscriptionMatch(const void* key, const void* item) {
+  const struct MqttSubscription* a = key;
+  const struct MqttSubscription* b = item;
+  return StrCompare(&a->filter, &b->filter);
+}
+
+static int TopicAliasMatch(const void* key, const void* item) {
+  const struct MqttTopicAlias* a = key;
+  const struct MqttTopicAlias* b = item;
+  return StrCompare(&a->topic, &b->topic);
+}
+
+static uint16_t NextPacketId(struct Mqtt* mqtt) {
+  // mburakov: Zero is not a valid packet identifier.
+  if (!++mqtt->packet_id) mqtt->packet_id++;
+  return mqtt->packet_id;
+}
+
+static _Bool ParseFilters(struct Mqtt* mqtt, const char* filters) {
+  // mburakov: Filters are separated by commas, and empty ones are skipped.
+  size_t size = strlen(filters);
+  size_t count = 1;
+  for (const char* ptr = filters; (ptr = strchr(ptr, ',')); ptr++) count++;
+  mqtt->filters_data = malloc(size + 1);
+  mqtt->filters = malloc(count * sizeof(struct Str));
+  if (!mqtt->filters_data || !mqtt->filters) {
+    LOG(ERR, "failed to allocate filters: %s", strerror(errno));
+    free(mqtt->filters);
+    free(mqtt->filters_data);
+    return 0;
+  }
+  memcpy(mqtt->filters_data, filters, size + 1);
+  mqtt->filters_count = 0;
+  const char* end = mqtt->filters_data + size;
+  for (const char* ptr = mqtt->filters_data; ptr <= end;) {
+    const char* separator = memchr(ptr, ',', (size_t)(end - ptr));
+    if (!separator) separator = end;
+    if (separator != ptr) {
+      mqtt->filters[mqtt->filters_count++] = (struct Str){
+          .size = (size_t)(separator - ptr),
+          .data = ptr,
+      };
+    }
+    ptr = separator + 1;
+  }
+  return 1;
+}
+
+static struct MqttMessage** MessageAt(struct Mqtt* mqtt, size_t index) {
+  // mburakov: Pending messages are stored in a circular buffer, and its size
+  // is always a power of two.
+  return mqtt->messages +
+         ((mqtt->messages_head + index) & (mqtt->messages_alloc - 1));
+}
+
+static _Bool GrowMessages(struct Mqtt* mqtt, size_t messages_alloc) {
+  struct MqttMessage** messages =
+      realloc(mqtt->messages, messages_alloc * sizeof(*mqtt->messages));
+  if (!messages) {
+    LOG(ERR, "failed to grow messages list: %s", strerror(errno));
+    return 0;
+  }
+  // mburakov: Wrapped part of the buffer is moved right after the old end,
+  // which always fits because the buffer at least doubles.
+  size_t end = mqtt->messages_head + mqtt->messages_size;
+  if (end > mqtt->messages_alloc) {
+    memcpy(messages + mqtt->messages_alloc, messages,
+           (end - mqtt->messages_alloc) * sizeof(*messages));
+  }
+  mqtt->messages = messages;
+  mqtt->messages_alloc = messages_alloc;
+  return 1;
+}
+
+static _Bool SetCork(int fd, int cork) {
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork))) {
+    LOG(ERR, "failed to set cork: %s", strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+static uint16_t FindTopicAlias(struct Mqtt* mqtt,
+                               const struct MqttMessage* message,
+                               _Bool* known) {
+  // mburakov: Returns zero if the topic has no alias and there are no more
+  // aliases left to assign. Otherwise tells whether broker knows the alias.
+  struct MqttTopicAlias key = {.topic = message->topic};
+  void** itemp =
+      HashFind(&mqtt->outbound_aliases, &key, message->hash, TopicAliasMatch);
+  *known = !!itemp;
+  if (itemp) return ((struct MqttTopicAlias*)*itemp)->alias;
+  if (mqtt->outbound_aliases_count == mqtt->topic_alias_maximum) return 0;
+  return (uint16_t)(mqtt->outbound_aliases_count + 1);
+}
+
+static _Bool AssignTopicAlias(struct Mqtt* mqtt,
+                              const struct MqttMessage* message,
+                              uint16_t alias) {
+  struct MqttTopicAlias* topic_alias =
+      malloc(sizeof(struct MqttTopicAlias) + message->topic.size);
+  if (!topic_alias) {
+    LOG(WARNING, "failed to allocate topic alias: %s", strerror(errno));
+    return 0;
+  }
+  topic_alias->hash = message->hash;
+  topic_alias->alias = alias;
+  memcpy(topic_alias->data, message->topic.data, message->topic.size);
+  topic_alias->topic.size = message->topic.size;
+  topic_alias->topic.data = topic_alias->data;
+  if (!HashSearch(&mqtt->outbound_aliases, topic_alias, topic_alias->hash,
+                  TopicAliasMatch)) {
+    LOG(WARNING, "failed to index topic alias: %s", strerror(errno));
+    free(topic_alias);
+    return 0;
+  }
+  mqtt->outbound_aliases_count++;
+  return 1;
+}
+
+static void ResetTopicAliases(struct Mqtt* mqtt) {
+  for (size_t index = 0; index < mqtt->outbound_aliases.alloc; index++)
+    free(mqtt->outbound_aliases.slots[index].item);
+  HashDestroy(&mqtt->outbound_aliases);
+  mqtt->outbound_aliases = (struct Hash){.slots = NULL};
+  mqtt->outbound_aliases_count = 0;
+  if (!mqtt->inbound_aliases) return;
+  for (size_t index = 0; index < MQTT_TOPIC_ALIAS_MAX; index++) {
+    StrFree(&mqtt->inbound_aliases[index]);
+    mqtt->inbound_aliases[index] = (struct Str){.data = NULL};
+  }
+}
+
+static _Bool ResolveTopicAlias(struct Mqtt* mqtt, struct MqttPacketView* view) {
+  // mburakov: Publish with both the topic and the alias sets the alias, and
+  // the one without the topic uses it.
+  if (!view->topic_alias) return 1;
+  if (view->topic_alias > MQTT_TOPIC_ALIAS_MAX) {
+    LOG(ERR, "invalid topic alias %u", view->topic_alias);
+    return 0;
+  }
+  struct Str* alias = mqtt->inbound_aliases + view->topic_alias - 1;
+  if (!view->topic.size) {
+    if (!alias->data) {
+      LOG(ERR, "unknown topic alias %u", view->topic_alias);
+      return 0;
+    }
+    view->topic = *alias;
+    return 1;
+  }
+  StrFree(alias);
+  if (!StrCopy(alias, &view->topic)) {
+    LOG(ERR, "failed to copy topic alias: %s", strerror(errno));
+    *alias = (struct Str){.data = NULL};
+    return 0;
+  }
+  return 1;
+}
+
+static struct MqttMessage** InflightAt(struct Mqtt* mqtt, size_t index) {
+  // mburakov: Unacknowledged messages are kept in the order those were sent.
+  // Acknowledged ones leave holes behind until everything before is done.
+  return mqtt->inflight +
+         ((mqtt->inflight_head + index) & (mqtt->inflight_alloc - 1));
+}
+
+static size_t InflightLimit(const struct Mqtt* mqtt) {
+  if (~mqtt->flags & kMqttFlagQos1) return SIZE_MAX;
+  return MIN(mqtt->inflight_window, mqtt->receive_maximum);
+}
+
+static void ShrinkInflight(struct Mqtt* mqtt) {
+  while (mqtt->inflight_size && !*InflightAt(mqtt, 0)) {
+    mqtt->inflight_head =
+        (mqtt->inflight_head + 1) & (mqtt->inflight_alloc - 1);
+    mqtt->inflight_size--;
+  }
+}
+
+static _Bool CollectMessage(struct Mqtt* mqtt, struct MqttMessage* message,
+                            _Bool dup, uint8_t header[MQTT_PUBLISH_HEADER_MAX],
+                            struct iovec iov[3]) {
+  // mburakov: Packet identifier and properties are written right before the
+  // payload. Topic is omitted if the broker already knows its alias. Returns
+  // false if the message is too big for the broker to accept it.
+  uint16_t topic_size = (uint16_t)message->topic.size;
+  uint16_t alias = 0;
+  _Bool known = 0;
+  if (mqtt->level == kMqttProtocolLevel5) {
+    alias = FindTopicAlias(mqtt, message, &known);
+    if (known) topic_size = 0;
+  }
+  uint8_t flags = (uint8_t)((message->packet_id ? 0x02 : 0) | (dup ? 0x08 : 0));
+  uint8_t extra[MQTT_PUBLISH_EXTRA_MAX];
+  size_t extra_size =
+      EncodePublishExtra(extra, mqtt->level, message->packet_id, alias);
+  size_t header_size = EncodePublishHeader(
+      header, flags, topic_size, (uint32_t)(extra_size + message->payload_len));
+  if (mqtt->maximum_packet_size &&
+      header_size + topic_size + extra_size + message->payload_len >
+          mqtt->maximum_packet_size) {
+    // mburakov: Broker would disconnect upon receiving this message, so it is
+    // dropped instead, along with any alias that it was to introduce.
+    LOG(WARNING, "dropping publish to %.*s exceeding maximum packet size",
+        (int)message->topic.size, message->topic.data);
+    mqtt->dropped++;
+    return 0;
+  }
+  if (alias && !known && !AssignTopicAlias(mqtt, message, alias)) {
+    // mburakov: Alias is only an optimization, full topic works regardless.
+    extra_size = EncodePublishExtra(extra, mqtt->level, message->packet_id, 0);
+    header_size =
+        EncodePublishHeader(header, flags, topic_size,
+                            (uint32_t)(extra_size + message->payload_len));
+  }
+  uint8_t* payload = (uint8_t*)message->payload - extra_size;
+  memcpy(payload, extra, extra_size);
+  iov[0].iov_base = header;
+  iov[0].iov_len = header_size;
+  iov[1].iov_base = UNCONST(message->topic.data);
+  iov[1].iov_len = topic_size;
+  iov[2].iov_base = payload;
+  iov[2].iov_len = extra_size + message->payload_len;
+  return 1;
+}
+
+static size_t CollectBatch(struct Mqtt* mqtt, int64_t now, size_t begin,
+                           uint8_t (*headers)[MQTT_PUBLISH_HEADER_MAX],
+                           struct iovec* iov, size_t* batch_size) {
+  // mburakov: Collects due messages starting at the provided index until
+  // either the batch is full, or there are no more due messages, or there is
+  // no more room for unacknowledged ones. Returns the index of the first
+  // message that was not collected.
+  size_t index = begin;
+  for (; index < mqtt->messages_size && *batch_size < MQTT_BATCH_MAX;
+       index++) {
+    struct MqttMessage* iter = *MessageAt(mqtt, index);
+    // mburakov: Cancelled messages leave holes behind.
+    if (!iter) continue;
+    if (iter->timestamp > now) break;
+    if (mqtt->inflight_size + *batch_size >= InflightLimit(mqtt)) break;
+    iter->packet_id = mqtt->flags & kMqttFlagQos1 ? NextPacketId(mqtt) : 0;
+    if (!CollectMessage(mqtt, iter, 0, headers[*batch_size],
+                        iov + *batch_size * 3)) {
+      iter->packet_id = 0;
+      continue;
+    }
+    size_t bucket = Bucket(now - iter->timestamp + mqtt->holdback,
+                           LENGTH(mqtt->stats.queue_delay));
+    mqtt->stats.queue_delay[bucket]++;
+    ++*batch_size;
+  }
+  return index;
+}
+
+static void ReleaseBatch(struct Mqtt* mqtt, size_t begin, size_t end) {
+  for (size_t index = begin; index < end; index++) {
+    struct MqttMessage** iterp = MessageAt(mqtt, index);
+    struct MqttMessage* iter = *iterp;
+    if (!iter) continue;
+    // mburakov: Message at the front is always the oldest one for its topic.
+    if (iter->newer) {
+      iter->newer->older = NULL;
+    } else {
+      HashDelete(&mqtt->messages_index, iter, iter->hash);
+    }
+    *iterp = NULL;
+    // mburakov: Messages sent with QoS one are kept until acknowledged. There
+    // is always room for those, because batches are limited accordingly.
+    if (iter->packet_id)
+      *InflightAt(mqtt, mqtt->inflight_size++) = iter;
+    else
+      free(iter);
+  }
+}
+
+static _Bool SendBatch(struct Mqtt* mqtt, int64_t now, const struct iovec* iov,
+                       size_t batch_size, _Bool* corked) {
+  if (mqtt->flags & kMqttFlagCork && !*corked) {
+    if (!SetCork(mqtt->fd, 1)) return 0;
+    *corked = 1;
+  }
+  if (!OutboundWrite(&mqtt->outbound, iov, batch_size * 3)) {
+    LOG(ERR, "failed to write publish messages: %s", strerror(errno));
+    return 0;
+  }
+  size_t bucket = (size_t)(63 - __builtin_clzll(batch_size));
+  mqtt->stats.batches[MIN(bucket, LENGTH(mqtt->stats.batches) - 1)]++;
+  mqtt->stats.messages_out += batch_size;
+  for (size_t index = 0; index < batch_size * 3; index++)
+    mqtt->stats.bytes_out += iov[index].iov_len;
+  mqtt->last_timestamp = now;
+  return 1;
+}
+
+static _Bool RetransmitMessages(struct Mqtt* mqtt, int64_t now,
+                                _Bool* corked) {
+  // mburakov: Messages that were not acknowledged before the connection was
+  // lost are sent again, ahead of everything else, and marked as duplicates.
+  // Oversized ones leave holes behind, which are shrunk away even on failure,
+  // so that the oldest message in flight is never a hole.
+  _Bool result = 1;
+  size_t index = 0;
+  while (result && index < mqtt->inflight_size) {
+    uint8_t headers[MQTT_BATCH_MAX][MQTT_PUBLISH_HEADER_MAX];
+    struct iovec iov[MQTT_BATCH_MAX * 3];
+    size_t batch_size = 0;
+    for (; index < mqtt->inflight_size && batch_size < MQTT_BATCH_MAX;
+         index++) {
+      struct MqttMessage** iterp = InflightAt(mqtt, index);
+      if (!*iterp) continue;
+      if (CollectMessage(mqtt, *iterp, 1, headers[batch_size],
+                         iov + batch_size * 3)) {
+        batch_size++;
+        continue;
+      }
+      free(*iterp);
+      *iterp = NULL;
+    }
+    if (batch_size && !SendBatch(mqtt, now, iov, batch_size, corked))
+      result = 0;
+  }
+  ShrinkInflight(mqtt);
+  if (result) mqtt->retransmit = 0;
+  return result;
+}
+
 static int64_t DrainMessages(struct Mqtt* mqtt, int64_t now) {
   if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
     LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
     return -1;
   }
+
+  // mburakov: Due messages are written in batches, each one is a single
+  // writev call. Optional cork makes sure that consecutive batches are sent
+  // in full segments. Once the socket stops taking those, the rest is left
+  // pending until the outbound buffer drains.
   int64_t result = -1;
+  _Bool corked = 0;
+  if (mqtt->retransmit && !RetransmitMessages(mqtt, now, &corked))
+    goto rollback_set_cork;
   size_t counter = 0;
-  for (; counter < mqtt->messages_size &&
-         mqtt->messages[counter].timestamp <= now;
-       counter++) {
-    const struct MqttMessage* iter = mqtt->messages + counter;
-    if (!SendPublishMessage(mqtt->fd, iter->topic.data,
-                            (uint16_t)iter->topic.size, iter->payload,
-                            (uint32_t)iter->payload_len)) {
-      LOG(ERR, "failed to write complete publish message: %s", strerror(errno));
-      goto rollback_mtx_lock;
+  while (counter < mqtt->messages_size &&
+         OutboundPending(&mqtt->outbound) < MQTT_OUTBOUND_HIGH) {
+    uint8_t headers[MQTT_BATCH_MAX][MQTT_PUBLISH_HEADER_MAX];
+    struct iovec iov[MQTT_BATCH_MAX * 3];
+    size_t batch_size = 0;
+    size_t end = CollectBatch(mqtt, now, counter, headers, iov, &batch_size);
+    if (batch_size && !SendBatch(mqtt, now, iov, batch_size, &corked))
+      goto rollback_set_cork;
+    ReleaseBatch(mqtt, counter, end);
+    counter = end;
+    if (batch_size < MQTT_BATCH_MAX) break;
+  }
+  mqtt->messages_head =
+      (mqtt->messages_head + counter) & (mqtt->messages_alloc - 1);
+  mqtt->messages_seq += counter;
+  mqtt->messages_size -= counter;
+  if (counter) cnd_broadcast(&mqtt->flushed);
+
+  // mburakov: With no room for more unacknowledged messages, there is nothing
+  // to do until the broker acknowledges some. Same with no room in the
+  // outbound buffer, until the socket becomes writable.
+  result = INT64_MAX;
+  if (mqtt->messages_size && mqtt->inflight_size < InflightLimit(mqtt) &&
+      OutboundPending(&mqtt->outbound) < MQTT_OUTBOUND_HIGH)
+    result = (*MessageAt(mqtt, 0))->timestamp;
+
+rollback_set_cork:
+  if (corked) SetCork(mqtt->fd, 0);
+  mtx_unlock(&mqtt->messages_mutex);
+  return result;
+}
+
+static int64_t ExpireSubscriptions(struct Mqtt* mqtt, int64_t now) {
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return -1;
+  }
+
+  int64_t result = INT64_MAX;
+  struct MqttSubscription* expired = NULL;
+  for (size_t index = 0; index < mqtt->subscriptions.alloc; index++) {
+    struct MqttSubscription* iter = mqtt->subscriptions.slots[index].item;
+    if (!iter) continue;
+    if (iter->deadline > now) {
+      result = MIN(result, iter->deadline);
+      continue;
     }
+    iter->expired = expired;
+    expired = iter;
   }
-  for (struct MqttMessage* iter = mqtt->messages;
-       iter < mqtt->messages + counter; iter++) {
-    StrFree(&iter->topic);
-    free(iter->payload);
+  while (expired) {
+    struct MqttSubscription* next = expired->expired;
+    HashDelete(&mqtt->subscriptions, expired, expired->hash);
+    if (result != -1 && !SendUnsubscribeMessage(&mqtt->outbound, mqtt->level,
+                                                NextPacketId(mqtt),
+                                                &expired->filter, 1)) {
+      LOG(ERR, "failed to send unsubscribe message: %s", strerror(errno));
+      result = -1;
+    }
+    mqtt->last_timestamp = now;
+    free(expired);
+    expired = next;
+  }
+  mtx_unlock(&mqtt->messages_mutex);
+  return result;
+}
+
+static _Bool Disconnect(struct Mqtt* mqtt, int64_t now) {
+  // mburakov: Delay grows exponentially, and the actual one is picked at
+  // random from its upper half, so that many clients do not hit a restarted
+  // broker all at once.
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return 0;
+  }
+  if (mqtt->fd != -1) close(mqtt->fd);
+  mqtt->fd = -1;
+  mqtt->state = kMqttStateDisconnected;
+
+  // mburakov: Unacknowledged messages are sent again after reconnecting, but
+  // messages sent with QoS zero that were still buffered are lost, and so are
+  // flushes waiting for those.
+  if (OutboundPending(&mqtt->outbound) && ~mqtt->flags & kMqttFlagQos1)
+    mqtt->dropped++;
+  OutboundReset(&mqtt->outbound, -1);
+  cnd_broadcast(&mqtt->flushed);
+  mtx_unlock(&mqtt->messages_mutex);
+
+  // mburakov: Topic aliases are scoped to a single connection.
+  ResetTopicAliases(mqtt);
+
+  // mburakov: Anything left in the ring belongs to the lost connection.
+  size_t size;
+  RingReadable(&mqtt->ring, &size);
+  RingConsume(&mqtt->ring, size);
+  mqtt->reconnect_delay =
+      mqtt->backoff / 2 + rand_r(&mqtt->seed) % (mqtt->backoff / 2 + 1);
+  mqtt->backoff = MIN(mqtt->backoff * 2, MQTT_BACKOFF_MAX);
+  mqtt->last_timestamp = now;
+  LOG(WARNING, "reconnecting in %d ms", mqtt->reconnect_delay);
+  return 1;
+}
+
+static _Bool StartConnect(struct Mqtt* mqtt, int64_t now) {
+  // mburakov: Socket is never blocking, so that a slow or a dead broker never
+  // holds anything up.
+  mqtt->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (mqtt->fd == -1) {
+    LOG(ERR, "failed to create socket: %s", strerror(errno));
+    return 0;
   }
-  if (counter) {
-    if (counter != mqtt->messages_size) {
-      memmove(mqtt->messages, mqtt->messages + counter,
-              mqtt->messages_size - counter);
+  if (mqtt->flags & kMqttFlagNodelay) {
+    int nodelay = 1;
+    if (setsockopt(mqtt->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                   sizeof(nodelay))) {
+      LOG(ERR, "failed to set nodelay: %s", strerror(errno));
+      goto rollback_socket;
     }
+  }
+  if (connect(mqtt->fd, (struct sockaddr*)&mqtt->addr, sizeof(mqtt->addr)) ==
+          -1 &&
+      errno != EINPROGRESS) {
+    LOG(ERR, "failed to connect socket: %s", strerror(errno));
+    goto rollback_socket;
+  }
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    goto rollback_socket;
+  }
+  mqtt->last_timestamp = now;
+  mqtt->state = kMqttStateConnecting;
+  OutboundReset(&mqtt->outbound, mqtt->fd);
+  mtx_unlock(&mqtt->messages_mutex);
+  return 1;
+
+rollback_socket:
+  close(mqtt->fd);
+  mqtt->fd = -1;
+  return 0;
+}
+
+static _Bool FinishConnect(struct Mqtt* mqtt, int64_t now) {
+  int error = 0;
+  socklen_t error_size = sizeof(error);
+  if (getsockopt(mqtt->fd, SOL_SOCKET, SO_ERROR, &error, &error_size)) {
+    LOG(ERR, "failed to get socket error: %s", strerror(errno));
+    return 0;
+  }
+  if (error) {
+    LOG(ERR, "failed to connect socket: %s", strerror(error));
+    return 0;
+  }
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return 0;
+  }
+  _Bool result = SendConnectMessage(&mqtt->outbound, mqtt->level,
+                                    mqtt->keepalive, MQTT_TOPIC_ALIAS_MAX);
+  if (result) {
     mqtt->last_timestamp = now;
-    mqtt->messages_size -= counter;
+    mqtt->state = kMqttStateHandshaking;
+  } else {
+    LOG(ERR, "failed to send connect message: %s", strerror(errno));
+  }
+  mtx_unlock(&mqtt->messages_mutex);
+  return result;
+}
+
+static _Bool OnConnectAck(struct Mqtt* mqtt, const struct MqttPacketView* view,
+                          int64_t now) {
+  struct MqttConnectAck ack;
+  if (!MqttParseConnectAck(view, mqtt->level, &ack)) {
+    LOG(ERR, "failed to parse connect ack");
+    return 0;
+  }
+  if (ack.reason_code) {
+    LOG(ERR, "broker refused connection with code %u", ack.reason_code);
+    return 0;
+  }
+  mqtt->topic_alias_maximum = ack.topic_alias_maximum;
+  mqtt->receive_maximum = ack.receive_maximum;
+  mqtt->maximum_packet_size = ack.maximum_packet_size;
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return 0;
+  }
+
+  // mburakov: Lazy subscriptions made while connecting were only recorded, so
+  // those are sent now along with the permanent ones.
+  if (mqtt->filters_count) {
+    mqtt->filters_packet_id = NextPacketId(mqtt);
+    if (!SendSubscribeMessage(&mqtt->outbound, mqtt->level,
+                              mqtt->filters_packet_id, mqtt->filters,
+                              mqtt->filters_count)) {
+      LOG(ERR, "failed to send subscribe message: %s", strerror(errno));
+      goto rollback_mtx_lock;
+    }
   }
-  result = mqtt->messages_size ? mqtt->messages->timestamp : INT64_MAX;
+  for (size_t index = 0; index < mqtt->subscriptions.alloc; index++) {
+    struct MqttSubscription* iter = mqtt->subscriptions.slots[index].item;
+    // mburakov: Expired ones are going to be unsubscribed from right away.
+    if (!iter || iter->deadline <= now) continue;
+    iter->packet_id = NextPacketId(mqtt);
+    if (!SendSubscribeMessage(&mqtt->outbound, mqtt->level, iter->packet_id,
+                              &iter->filter, 1)) {
+      LOG(ERR, "failed to send subscribe message: %s", strerror(errno));
+      goto rollback_mtx_lock;
+    }
+  }
+  // mburakov: Broker session is always clean, so the tree is refreshed with
+  // retained messages following the new subscriptions.
+  mqtt->last_timestamp = now;
+  mqtt->state = kMqttStateConnected;
+  mqtt->retransmit = mqtt->inflight_size != 0;
+  mtx_unlock(&mqtt->messages_mutex);
+  mqtt->backoff = MQTT_BACKOFF_MIN;
+  LOG(INFO, "connected to broker");
+  mqtt->connect_callback(mqtt->user);
+  return 1;
+
+rollback_mtx_lock:
+  mtx_unlock(&mqtt->messages_mutex);
+  return 0;
+}
+
+static void OnPublishAck(struct Mqtt* mqtt, const struct MqttPacketView* view) {
+  uint16_t packet_id;
+  uint8_t reason_code;
+  if (!MqttParsePublishAck(view, mqtt->level, &packet_id, &reason_code)) {
+    LOG(WARNING, "failed to parse publish ack");
+    return;
+  }
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return;
+  }
+
+  // mburakov: Brokers acknowledge in order, so the message is almost always
+  // the first one. Reason codes from 0x80 up mean the broker refused it.
+  for (size_t index = 0; index < mqtt->inflight_size; index++) {
+    struct MqttMessage** iterp = InflightAt(mqtt, index);
+    if (!*iterp || (*iterp)->packet_id != packet_id) continue;
+    if (reason_code >= 0x80) {
+      LOG(WARNING, "broker refused publish to %.*s with code %u",
+          (int)(*iterp)->topic.size, (*iterp)->topic.data, reason_code);
+      mqtt->dropped++;
+    }
+    free(*iterp);
+    *iterp = NULL;
+    break;
+  }
+  ShrinkInflight(mqtt);
+  cnd_broadcast(&mqtt->flushed);
+  mtx_unlock(&mqtt->messages_mutex);
+}
+
+static void OnSubscribeAck(struct Mqtt* mqtt,
+                           const struct MqttPacketView* view) {
+  uint16_t packet_id;
+  const uint8_t* codes;
+  size_t count;
+  if (!MqttParseSubscribeAck(view, mqtt->level, &packet_id, &codes,
+                             &count)) {
+    LOG(WARNING, "failed to parse subscribe ack");
+    return;
+  }
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return;
+  }
+
+  // mburakov: Return codes from 0x80 up mean the broker refused the filter.
+  // Refused lazy subscriptions are forgotten, so that those could be retried
+  // later.
+  if (packet_id == mqtt->filters_packet_id) {
+    for (size_t index = 0; index < MIN(count, mqtt->filters_count); index++) {
+      if (codes[index] < 0x80) continue;
+      LOG(ERR, "broker refused subscription to %.*s",
+          (int)mqtt->filters[index].size, mqtt->filters[index].data);
+    }
+    goto rollback_mtx_lock;
+  }
+  for (size_t index = 0; index < mqtt->subscriptions.alloc; index++) {
+    struct MqttSubscription* iter = mqtt->subscriptions.slots[index].item;
+    if (!iter || iter->packet_id != packet_id) continue;
+    if (codes[0] >= 0x80) {
+      LOG(ERR, "broker refused subscription to %.*s", (int)iter->filter.size,
+          iter->filter.data);
+      HashDelete(&mqtt->subscriptions, iter, iter->hash);
+      free(iter);
+    }
+    break;
+  }
+
+rollback_mtx_lock:
+  mtx_unlock(&mqtt->messages_mutex);
+}
+
+static _Bool SendPing(struct Mqtt* mqtt, int64_t now) {
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return 0;
+  }
+  _Bool result = SendPingMessage(&mqtt->outbound);
+  if (result) mqtt->last_timestamp = now;
+  mtx_unlock(&mqtt->messages_mutex);
+  return result;
+}
+
+static int FlushOutbound(struct Mqtt* mqtt) {
+  // mburakov: Returns poll events to wait for on the socket, or -1 on error.
+  // Anybody waiting for the written bytes is woken up.
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock messages mutex: %s", strerror(errno));
+    return -1;
+  }
+  int result = -1;
+  size_t written = mqtt->outbound.written;
+  if (!OutboundFlush(&mqtt->outbound)) {
+    LOG(ERR, "failed to write outbound buffer: %s", strerror(errno));
+    goto rollback_mtx_lock;
+  }
+  if (mqtt->outbound.written != written) cnd_broadcast(&mqtt->flushed);
+  result = POLLIN | (OutboundPending(&mqtt->outbound) ? POLLOUT : 0);
 
 rollback_mtx_lock:
   mtx_unlock(&mqtt->messages_mutex);
@@ -112,10 +886,12 @@ rollback_mtx_lock:
 }
 
 static int IoThread(void* user) {
+  enum { kParseBatchSize = 64 };
   struct Mqtt* mqtt = user;
-  uint8_t* buffer = NULL;
-  size_t buffer_alloc = 0;
-  size_t buffer_size = 0;
+  uint8_t* spill = NULL;
+  size_t spill_alloc = 0;
+  size_t spill_size = 0;
+  int64_t woken = 0;
 
   while (atomic_load(&mqtt->running)) {
     int64_t now = MillisNow();
@@ -127,40 +903,84 @@ static int IoThread(void* user) {
       goto leave;
     }
 
-    int64_t next_timestamp = DrainMessages(mqtt, now);
-    if (next_timestamp == -1) {
-      // mburakov: This could only happen if either a) mutex failed to lock, or
-      // b) writing was not fully completed. In both cases it does not really
-      // make sense to proceed.
-      LOG(CRIT, "failed to drain messages");
-      goto leave;
+    // mburakov: Until connected, last timestamp is when the current connection
+    // step started. Each step has to complete within the keepalive, except for
+    // waiting before reconnecting.
+    int timeout = (int)(mqtt->last_timestamp + mqtt->keepalive * 1000 - now);
+    if (mqtt->state == kMqttStateDisconnected) {
+      timeout = (int)(mqtt->last_timestamp + mqtt->reconnect_delay - now);
+      if (timeout <= 0) {
+        if (!StartConnect(mqtt, now)) {
+          LOG(ERR, "failed to start connecting");
+          goto disconnect;
+        }
+        timeout = mqtt->keepalive * 1000;
+      }
+    } else if (mqtt->state != kMqttStateConnected && timeout <= 0) {
+      LOG(ERR, "timed out connecting to broker");
+      goto disconnect;
     }
+    if (mqtt->state == kMqttStateConnected) {
+      int64_t next_timestamp = DrainMessages(mqtt, now);
+      if (next_timestamp == -1) {
+        // mburakov: This could only happen if either a) mutex failed to lock,
+        // or b) writing was not fully completed. In both cases it does not
+        // really make sense to proceed with this connection. Messages that
+        // were not fully written are kept, and sent again after reconnecting.
+        LOG(ERR, "failed to drain messages");
+        goto disconnect;
+      }
+      int64_t next_deadline = ExpireSubscriptions(mqtt, now);
+      if (next_deadline == -1) {
+        LOG(ERR, "failed to expire subscriptions");
+        goto disconnect;
+      }
 
-    static const int64_t kPingThreshold = 100;
-    int64_t next_ping =
-        mqtt->last_timestamp + mqtt->keepalive * 1000 - kPingThreshold;
-    if (next_ping <= now) {
-      if (!SendPingMessage(mqtt->fd)) {
-        // mburakov: Inability to send a ping *will* lead to a server-side
-        // disconnect. It does not really make sense to proceed.
-        LOG(CRIT, "failed to send complete ping message: %s", strerror(errno));
-        goto leave;
+      static const int64_t kPingThreshold = 100;
+      int64_t next_ping =
+          mqtt->last_timestamp + mqtt->keepalive * 1000 - kPingThreshold;
+      if (next_ping <= now) {
+        if (!SendPing(mqtt, now)) {
+          // mburakov: Inability to send a ping *will* lead to a server-side
+          // disconnect. It does not really make sense to proceed.
+          LOG(ERR, "failed to send ping message");
+          goto disconnect;
+        }
+        next_ping = now + mqtt->keepalive * 1000 - kPingThreshold;
       }
-      mqtt->last_timestamp = now;
-      next_ping = now + mqtt->keepalive * 1000 - kPingThreshold;
-    }
 
-    // mburakov: Delay can not be negative or zero, because at this point some
-    // message was sent to the server. At the same time delay can not be more
-    // than 65535000 (maximum possible keepalive value times 1000), so it will
-    // certainly fit into 32-bit int.
-    int timeout = (int)(MIN(next_ping, next_timestamp) - now);
+      // mburakov: Delay can not be negative or zero, because at this point
+      // some message was sent to the server. At the same time delay can not be
+      // more than 65535000 (maximum possible keepalive value times 1000), so it
+      // will certainly fit into 32-bit int.
+      timeout = (int)(MIN(MIN(next_ping, next_timestamp), next_deadline) - now);
+    }
 
+    // mburakov: Reading and writing progress independently. Socket is only
+    // polled for writing while connecting, or while there is something left
+    // in the outbound buffer.
+    int events = POLLIN;
+    if (mqtt->state == kMqttStateConnecting) {
+      events = POLLOUT;
+    } else if (mqtt->state != kMqttStateDisconnected) {
+      events = FlushOutbound(mqtt);
+      if (events == -1) {
+        LOG(ERR, "failed to flush outbound buffer");
+        goto disconnect;
+      }
+    }
     struct pollfd pfds[] = {
-        {.fd = mqtt->fd, .events = POLLIN},
+        {.fd = mqtt->fd, .events = (short)events},
         {.fd = mqtt->pipe[0], .events = POLLIN},
     };
-    switch (poll(pfds, LENGTH(pfds), timeout)) {
+    if (woken) {
+      size_t bucket =
+          Bucket(MicrosNow() - woken, LENGTH(mqtt->loop_latency));
+      Count(mqtt->loop_latency + bucket, 1);
+    }
+    int ready = poll(pfds, LENGTH(pfds), timeout);
+    woken = ready != -1 ? MicrosNow() : 0;
+    switch (ready) {
       case -1:
         if (errno != EINTR)
           LOG(WARNING, "failed to complete poll: %s", strerror(errno));
@@ -178,68 +998,156 @@ static int IoThread(void* user) {
       continue;
     }
 
-    if (~pfds[0].revents & POLLIN) continue;
-
-    int fionread;
-    if (ioctl(mqtt->fd, FIONREAD, &fionread) == -1) {
-      LOG(WARNING, "failed to ioctl: %s", strerror(errno));
+    if (mqtt->state == kMqttStateConnecting) {
+      if (!pfds[0].revents) continue;
+      if (!FinishConnect(mqtt, now)) {
+        LOG(ERR, "failed to finish connecting");
+        goto disconnect;
+      }
       continue;
     }
 
-    size_t size = (size_t)fionread;
-    if (buffer_alloc - buffer_size < size) {
-      size_t new_buffer_alloc = buffer_size + size;
-      uint8_t* new_buffer = realloc(buffer, new_buffer_alloc);
-      if (!new_buffer) {
-        LOG(WARNING, "failed to allocate buffer: %s", strerror(errno));
-        continue;
+    if (~pfds[0].revents & POLLIN) continue;
+
+    // mburakov: Normally messages are received straight into the ring. Only a
+    // message that does not fit into the whole ring is spilled into a separate
+    // buffer, which grows as needed until the message is complete.
+    uint8_t* buffer;
+    size_t size;
+    if (spill) {
+      if (spill_size == spill_alloc) {
+        size_t new_spill_alloc = spill_alloc * 2;
+        uint8_t* new_spill = realloc(spill, new_spill_alloc);
+        if (!new_spill) {
+          LOG(WARNING, "failed to grow spill buffer: %s", strerror(errno));
+          continue;
+        }
+        spill = new_spill;
+        spill_alloc = new_spill_alloc;
       }
-      buffer = new_buffer;
-      buffer_alloc = new_buffer_alloc;
+      buffer = spill + spill_size;
+      size = spill_alloc - spill_size;
+    } else {
+      buffer = RingWritable(&mqtt->ring, &size);
     }
 
-    ssize_t read_size = read(mqtt->fd, buffer + buffer_size, size);
+    ssize_t read_size = read(mqtt->fd, buffer, size);
     switch (read_size) {
       case -1:
-        if (errno == EINTR) continue;
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+          continue;
         LOG(ERR, "failed to read: %s", strerror(errno));
         __attribute__((__fallthrough__));
       case 0:
-        LOG(CRIT, "server closed connection");
-        goto leave;
+        LOG(ERR, "server closed connection");
+        goto disconnect;
       default:
-        buffer_size += (size_t)read_size;
         break;
     }
 
+    size_t buffer_size;
+    if (spill) {
+      spill_size += (size_t)read_size;
+      buffer = spill;
+      buffer_size = spill_size;
+    } else {
+      RingCommit(&mqtt->ring, (size_t)read_size);
+      buffer = RingReadable(&mqtt->ring, &buffer_size);
+    }
+
     const void* tail = buffer;
     size_t tail_size = buffer_size;
-    for (;;) {
-      struct Str topic_view;
-      const void* payload;
-      size_t payload_len;
-      switch (MqttParseMessage(&tail, &tail_size, &topic_view, &payload,
-                               &payload_len)) {
-        case kMqttParseStatusSuccess:
-          mqtt->callback(mqtt->user, &topic_view, payload, payload_len);
-          __attribute__((__fallthrough__));
-        case kMqttParseStatusSkipped:
+    for (enum MqttParseStatus status = kMqttParseStatusSuccess;
+         status == kMqttParseStatusSuccess;) {
+      struct MqttPacketView views[kParseBatchSize];
+      size_t count = MqttParseMessages(&tail, &tail_size, mqtt->level, views,
+                                       LENGTH(views), &status);
+      for (size_t index = 0; index < count; index++) {
+        if (views[index].type == kMqttPacketTypeConnectAck) {
+          if (mqtt->state != kMqttStateHandshaking) {
+            LOG(WARNING, "unexpected connect ack");
+          } else if (!OnConnectAck(mqtt, views + index, now)) {
+            LOG(ERR, "failed to handle connect ack");
+            goto disconnect;
+          }
+          continue;
+        }
+        if (views[index].type == kMqttPacketTypePublishAck) {
+          OnPublishAck(mqtt, views + index);
+          continue;
+        }
+        if (views[index].type == kMqttPacketTypeSubscribeAck) {
+          OnSubscribeAck(mqtt, views + index);
           continue;
-        case kMqttParseStatusReadMore:
-          break;
-        case kMqttParseStatusError:
-          LOG(ERR, "failed to parse publish message");
-          goto leave;
+        }
+        if (!ResolveTopicAlias(mqtt, views + index)) {
+          LOG(ERR, "failed to resolve topic alias");
+          goto disconnect;
+        }
+        mqtt->callback(mqtt->user, &views[index].topic, views[index].payload,
+                       views[index].payload_len);
+        Count(&mqtt->messages_in, 1);
+        Count(&mqtt->bytes_in, views[index].payload_len);
       }
-      memmove(buffer, tail, tail_size);
-      buffer_size = tail_size;
-      break;
+      if (status == kMqttParseStatusError) {
+        Count(&mqtt->parse_errors, 1);
+        LOG(ERR, "failed to parse publish message");
+        goto disconnect;
+      }
+    }
+
+    if (!spill) {
+      RingConsume(&mqtt->ring, buffer_size - tail_size);
+      if (tail_size < mqtt->ring.size) continue;
+
+      // mburakov: Ring is full, but does not contain a complete message.
+      spill_alloc = mqtt->ring.size * 2;
+      spill = malloc(spill_alloc);
+      if (!spill) {
+        LOG(ERR, "failed to allocate spill buffer: %s", strerror(errno));
+        goto disconnect;
+      }
+      memcpy(spill, tail, tail_size);
+      spill_size = tail_size;
+      RingConsume(&mqtt->ring, tail_size);
+      continue;
+    }
+
+    if (tail_size < mqtt->ring.size) {
+      // mburakov: Oversized message is done, switch back to the ring. It is
+      // empty while spilling, so the remainder always fits.
+      void* ring_tail = RingWritable(&mqtt->ring, &size);
+      memcpy(ring_tail, tail, tail_size);
+      RingCommit(&mqtt->ring, tail_size);
+      free(spill);
+      spill = NULL;
+      spill_alloc = 0;
+      spill_size = 0;
+      continue;
+    }
+    memmove(spill, tail, tail_size);
+    spill_size = tail_size;
+    continue;
+
+  disconnect:
+    free(spill);
+    spill = NULL;
+    spill_alloc = 0;
+    spill_size = 0;
+    if (!Disconnect(mqtt, now)) {
+      LOG(CRIT, "failed to disconnect");
+      goto leave;
     }
   }
 
 leave:
   atomic_store(&mqtt->running, 0);
-  free(buffer);
+  // mburakov: Nothing is going to be sent anymore, so pending flushes fail.
+  if (mtx_lock(&mqtt->messages_mutex) == thrd_success) {
+    cnd_broadcast(&mqtt->flushed);
+    mtx_unlock(&mqtt->messages_mutex);
+  }
+  free(spill);
   return 0;
 }
 
@@ -250,16 +1158,27 @@ static void WakeIoThread(struct Mqtt* mqtt) {
 }
 
 struct Mqtt* MqttCreate(const char* host, uint16_t port, uint16_t keepalive,
-                        int holdback, MqttMessageCallback callback,
-                        void* user) {
+                        int holdback, size_t queue_size, size_t inflight,
+                        const char* filters, int flags,
+                        MqttConnectCallback connect_callback,
+                        MqttMessageCallback callback, void* user) {
   struct Mqtt* result = malloc(sizeof(struct Mqtt));
   if (!result) {
     LOG(ERR, "failed to allocate MQTT client: %s", strerror(errno));
     return NULL;
   }
 
+  result->addr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = inet_addr(host),
+  };
+  result->level = flags & kMqttFlagMqtt5 ? kMqttProtocolLevel5
+                                          : kMqttProtocolLevel311;
   result->keepalive = keepalive;
   result->holdback = holdback;
+  result->flags = flags;
+  result->connect_callback = connect_callback;
   result->callback = callback;
   result->user = user;
 
@@ -268,67 +1187,116 @@ struct Mqtt* MqttCreate(const char* host, uint16_t port, uint16_t keepalive,
     LOG(ERR, "failed to get clock: %s", strerror(errno));
     goto rollback_malloc;
   }
+  // mburakov: First connection attempt is made right away.
+  result->reconnect_delay = 0;
+  result->backoff = MQTT_BACKOFF_MIN;
+  result->seed = (unsigned)result->last_timestamp ^ (unsigned)getpid();
   result->messages = NULL;
   result->messages_alloc = 0;
+  result->messages_head = 0;
   result->messages_size = 0;
+  result->messages_seq = 0;
+  size_t messages_alloc = 1;
+  while (messages_alloc < queue_size) messages_alloc *= 2;
+  if (!GrowMessages(result, messages_alloc)) {
+    LOG(ERR, "failed to preallocate messages");
+    goto rollback_malloc;
+  }
+  result->messages_index = (struct Hash){.slots = NULL};
+  result->stats = (struct MqttStats){.batches = {0}};
+  atomic_init(&result->messages_in, 0);
+  atomic_init(&result->bytes_in, 0);
+  atomic_init(&result->parse_errors, 0);
+  for (size_t index = 0; index < LENGTH(result->loop_latency); index++)
+    atomic_init(result->loop_latency + index, 0);
+  if (!ParseFilters(result, filters)) {
+    LOG(ERR, "failed to parse filters");
+    goto rollback_grow_messages;
+  }
+  result->filters_packet_id = 0;
+  result->packet_id = 0;
+  result->subscriptions = (struct Hash){.slots = NULL};
+  result->inbound_aliases = NULL;
+  if (result->level == kMqttProtocolLevel5) {
+    result->inbound_aliases =
+        calloc(MQTT_TOPIC_ALIAS_MAX, sizeof(*result->inbound_aliases));
+    if (!result->inbound_aliases) {
+      LOG(ERR, "failed to allocate topic aliases: %s", strerror(errno));
+      goto rollback_parse_filters;
+    }
+  }
+  result->outbound_aliases = (struct Hash){.slots = NULL};
+  result->outbound_aliases_count = 0;
+  result->topic_alias_maximum = 0;
+  result->receive_maximum = UINT16_MAX;
+  result->maximum_packet_size = 0;
+  result->inflight_alloc = 1;
+  while (result->inflight_alloc < inflight) result->inflight_alloc *= 2;
+  result->inflight = NULL;
+  if (flags & kMqttFlagQos1) {
+    result->inflight =
+        malloc(result->inflight_alloc * sizeof(*result->inflight));
+    if (!result->inflight) {
+      LOG(ERR, "failed to allocate inflight messages: %s", strerror(errno));
+      goto rollback_calloc;
+    }
+  }
+  result->inflight_window = inflight;
+  result->inflight_head = 0;
+  result->inflight_size = 0;
+  result->retransmit = 0;
+  result->dropped = 0;
+  if (cnd_init(&result->flushed) != thrd_success) {
+    LOG(ERR, "failed to initialize condition: %s", strerror(errno));
+    goto rollback_malloc_inflight;
+  }
   if (mtx_init(&result->messages_mutex, 1) != thrd_success) {
     LOG(ERR, "failed to initialize mutex: %s", strerror(errno));
-    goto rollback_malloc;
+    goto rollback_cnd_init;
   }
 
-  result->fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (result->fd == -1) {
-    LOG(ERR, "failed to create socket: %s", strerror(errno));
+  // mburakov: Most messages are tiny, but this still fits a lot of those.
+  static const size_t kRingSize = 1 << 18;
+  if (!RingInit(&result->ring, kRingSize)) {
+    LOG(ERR, "failed to initialize ring");
     goto rollback_mtx_init;
   }
 
+  result->state = kMqttStateDisconnected;
+  result->fd = -1;
+  result->outbound = (struct Outbound){.fd = -1, .data = NULL};
   if (pipe(result->pipe) == -1) {
     LOG(ERR, "failed to create pipe: %s", strerror(errno));
-    goto rollback_socket;
-  }
-
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET,
-      .sin_port = htons(port),
-      .sin_addr.s_addr = inet_addr(host),
-  };
-  if (connect(result->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-    LOG(ERR, "failed to connect socket: %s", strerror(errno));
-    goto rollback_pipe;
-  }
-  if (!SendConnectMessage(result->fd, keepalive)) {
-    LOG(ERR, "failed to send complete connect message: %s", strerror(errno));
-    goto rollback_pipe;
-  }
-  if (!ReceiveConnectAck(result->fd)) {
-    LOG(ERR, "failed to receive complete connect ack: %s", strerror(errno));
-    goto rollback_pipe;
+    goto rollback_ring_init;
   }
 
-  if (!SendSubscribeMessage(result->fd)) {
-    LOG(ERR, "failed to send complete subscribe message: %s", strerror(errno));
-    goto rollback_send_connect_message;
-  }
-  if (!ReceiveSubscribeAck(result->fd)) {
-    LOG(ERR, "failed to receive complete subscribe ack: %s", strerror(errno));
-    goto rollback_send_connect_message;
-  }
+  // mburakov: Handshake is done by the IO thread, so this never waits for the
+  // broker. Messages and subscriptions are queued until it completes.
   atomic_store(&result->running, 1);
   if (thrd_create(&result->io_thread, &IoThread, result) != thrd_success) {
     LOG(ERR, "failed to create receive thread: %s", strerror(errno));
-    goto rollback_send_connect_message;
+    goto rollback_pipe;
   }
   return result;
 
-rollback_send_connect_message:
-  SendDisconnectMessage(result->fd);
 rollback_pipe:
   close(result->pipe[1]);
   close(result->pipe[0]);
-rollback_socket:
-  close(result->fd);
+rollback_ring_init:
+  RingDestroy(&result->ring);
 rollback_mtx_init:
   mtx_destroy(&result->messages_mutex);
+rollback_cnd_init:
+  cnd_destroy(&result->flushed);
+rollback_malloc_inflight:
+  free(result->inflight);
+rollback_calloc:
+  free(result->inbound_aliases);
+rollback_parse_filters:
+  free(result->filters);
+  free(result->filters_data);
+rollback_grow_messages:
+  free(result->messages);
 rollback_malloc:
   free(result);
   return NULL;
@@ -340,7 +1308,8 @@ _Bool MqttPublish(struct Mqtt* mqtt, const struct Str* topic,
     LOG(ERR, "invalid topic size");
     return 0;
   }
-  if (sizeof(uint16_t) + topic->size + payload_len > 268435455) {
+  if (sizeof(uint16_t) + topic->size + MQTT_PUBLISH_EXTRA_MAX + payload_len >
+      268435455) {
     LOG(ERR, "invalid message length");
     return 0;
   }
@@ -353,45 +1322,68 @@ _Bool MqttPublish(struct Mqtt* mqtt, const struct Str* topic,
     LOG(ERR, "failed to get monotonic clock: %s", strerror(errno));
     return 0;
   }
+  struct MqttMessage* message =
+      malloc(sizeof(struct MqttMessage) + topic->size +
+             MQTT_PUBLISH_EXTRA_MAX + payload_len);
+  if (!message) {
+    LOG(ERR, "failed to allocate message: %s", strerror(errno));
+    return 0;
+  }
+  message->timestamp = timestamp + mqtt->holdback;
+  message->hash = HashBytes(topic->data, topic->size);
+  message->older = NULL;
+  message->newer = NULL;
+  memcpy(message->data, topic->data, topic->size);
+  message->topic.size = topic->size;
+  message->topic.data = message->data;
+  message->payload = message->data + topic->size + MQTT_PUBLISH_EXTRA_MAX;
+  memcpy(message->payload, payload, payload_len);
+  message->payload_len = payload_len;
   if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
     LOG(ERR, "failed to lock mutex: %s", strerror(errno));
-    return 0;
+    goto rollback_malloc;
   }
 
-  if (mqtt->messages_size == mqtt->messages_alloc) {
-    size_t messages_alloc = mqtt->messages_alloc + 1;
-    struct MqttMessage* messages =
-        realloc(mqtt->messages, messages_alloc * sizeof(struct MqttMessage));
-    if (!messages) {
-      LOG(ERR, "failed to grow messages list: %s", strerror(errno));
-      goto rollback_mtx_lock;
-    }
-    mqtt->messages = messages;
-    mqtt->messages_alloc = messages_alloc;
+  if (mqtt->messages_size == mqtt->messages_alloc &&
+      !GrowMessages(mqtt, mqtt->messages_alloc * 2)) {
+    LOG(ERR, "failed to grow messages");
+    goto rollback_mtx_lock;
   }
-  struct MqttMessage* message = mqtt->messages + mqtt->messages_size;
-  message->timestamp = timestamp + mqtt->holdback;
-  if (!StrCopy(&message->topic, topic)) {
-    LOG(ERR, "failed to copy topic: %s", strerror(errno));
+  void** itemp = HashSearch(&mqtt->messages_index, message, message->hash,
+                            MessageMatch);
+  if (!itemp) {
+    LOG(ERR, "failed to index message: %s", strerror(errno));
     goto rollback_mtx_lock;
   }
 
-  message->payload = malloc(payload_len);
-  if (!message->payload) {
-    LOG(ERR, "failed to copy payload: %s", strerror(errno));
-    goto rollback_str_copy;
+  struct MqttMessage* newest = *itemp;
+  if (newest != message && mqtt->flags & kMqttFlagCoalesce) {
+    // mburakov: Pending message takes over the position and the deadline of
+    // its predecessor, which is never sent. With coalescing there is at most
+    // one pending message per topic, so there is no chain to maintain.
+    message->timestamp = newest->timestamp;
+    message->seq = newest->seq;
+    *MessageAt(mqtt, newest->seq - mqtt->messages_seq) = message;
+    *itemp = message;
+    mtx_unlock(&mqtt->messages_mutex);
+    free(newest);
+    return 1;
   }
-  memcpy(message->payload, payload, payload_len);
-  message->payload_len = payload_len;
-  mqtt->messages_size++;
+  if (newest != message) {
+    message->older = newest;
+    newest->newer = message;
+    *itemp = message;
+  }
+  message->seq = mqtt->messages_seq + mqtt->messages_size;
+  *MessageAt(mqtt, mqtt->messages_size++) = message;
   mtx_unlock(&mqtt->messages_mutex);
   WakeIoThread(mqtt);
   return 1;
 
-rollback_str_copy:
-  StrFree(&message->topic);
 rollback_mtx_lock:
   mtx_unlock(&mqtt->messages_mutex);
+rollback_malloc:
+  free(message);
   return 0;
 }
 
@@ -403,35 +1395,199 @@ void MqttCancel(struct Mqtt* mqtt, const struct Str* topic) {
     return;
   }
 
-  for (size_t index = 0; index < mqtt->messages_size;) {
-    struct MqttMessage* iter = mqtt->messages + index;
-    if (StrCompare(&iter->topic, topic)) {
-      index++;
-      continue;
+  struct MqttMessage key = {.topic = *topic};
+  void** itemp =
+      HashFind(&mqtt->messages_index, &key, HashBytes(topic->data, topic->size),
+               MessageMatch);
+  if (itemp) {
+    struct MqttMessage* newest = *itemp;
+    HashDelete(&mqtt->messages_index, newest, newest->hash);
+    for (struct MqttMessage* iter = newest; iter;) {
+      struct MqttMessage* older = iter->older;
+      *MessageAt(mqtt, iter->seq - mqtt->messages_seq) = NULL;
+      free(iter);
+      iter = older;
+    }
+  }
+
+  mtx_unlock(&mqtt->messages_mutex);
+}
+
+_Bool MqttSubscribe(struct Mqtt* mqtt, const struct Str* filter, int idle) {
+  if (!atomic_load(&mqtt->running)) {
+    LOG(ERR, "io thread is not running");
+    return 0;
+  }
+  // mburakov: Permanent filters are never unsubscribed from, so those must not
+  // get an expiration deadline. These are immutable after creation.
+  for (size_t index = 0; index < mqtt->filters_count; index++) {
+    if (!StrCompare(&mqtt->filters[index], filter)) return 1;
+  }
+  int64_t now = MillisNow();
+  if (!now) {
+    LOG(ERR, "failed to get monotonic clock: %s", strerror(errno));
+    return 0;
+  }
+  struct MqttSubscription* subscription =
+      malloc(sizeof(struct MqttSubscription) + filter->size);
+  if (!subscription) {
+    LOG(ERR, "failed to allocate subscription: %s", strerror(errno));
+    return 0;
+  }
+  subscription->deadline = now + idle;
+  subscription->hash = HashBytes(filter->data, filter->size);
+  memcpy(subscription->data, filter->data, filter->size);
+  subscription->filter.size = filter->size;
+  subscription->filter.data = subscription->data;
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock mutex: %s", strerror(errno));
+    goto rollback_malloc;
+  }
+
+  void** itemp = HashSearch(&mqtt->subscriptions, subscription,
+                            subscription->hash, SubscriptionMatch);
+  if (!itemp) {
+    LOG(ERR, "failed to index subscription: %s", strerror(errno));
+    goto rollback_mtx_lock;
+  }
+  if (*itemp != subscription) {
+    // mburakov: Already subscribed, just postpone the expiration.
+    struct MqttSubscription* existing = *itemp;
+    existing->deadline = MAX(existing->deadline, subscription->deadline);
+    mtx_unlock(&mqtt->messages_mutex);
+    free(subscription);
+    return 1;
+  }
+  // mburakov: Until connected, subscription is only recorded, and it is sent
+  // right after the connect ack.
+  subscription->packet_id = 0;
+  if (mqtt->state == kMqttStateConnected) {
+    subscription->packet_id = NextPacketId(mqtt);
+    if (!SendSubscribeMessage(&mqtt->outbound, mqtt->level,
+                              subscription->packet_id, filter, 1)) {
+      LOG(ERR, "failed to send subscribe message: %s", strerror(errno));
+      HashDelete(&mqtt->subscriptions, subscription, subscription->hash);
+      goto rollback_mtx_lock;
+    }
+    mqtt->last_timestamp = now;
+  }
+  mtx_unlock(&mqtt->messages_mutex);
+  // mburakov: IO thread has to learn about the new expiration deadline.
+  WakeIoThread(mqtt);
+  return 1;
+
+rollback_mtx_lock:
+  mtx_unlock(&mqtt->messages_mutex);
+rollback_malloc:
+  free(subscription);
+  return 0;
+}
+
+_Bool MqttFlush(struct Mqtt* mqtt) {
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock mutex: %s", strerror(errno));
+    return 0;
+  }
+
+  // mburakov: Messages are sent in the order of their sequence numbers, so
+  // everything before the oldest one not yet done is done. Messages taken from
+  // the queue might still be in the outbound buffer though, so those are only
+  // done once the buffer is written past them. Nothing is waited for while
+  // there's no connection, as that might take arbitrarily long, but messages
+  // are still kept, and sent after reconnecting.
+  size_t target = mqtt->messages_seq + mqtt->messages_size;
+  size_t dropped = mqtt->dropped;
+  _Bool taken = 0;
+  size_t accepted = 0;
+  _Bool result = 0;
+  while (atomic_load(&mqtt->running)) {
+    if (!taken && mqtt->messages_seq >= target) {
+      taken = 1;
+      accepted = mqtt->outbound.accepted;
     }
-    StrFree(&iter->topic);
-    free(iter->payload);
-    mqtt->messages_size--;
-    memmove(iter, iter + 1,
-            (mqtt->messages_size - index) * sizeof(struct MqttMessage));
+    size_t done = mqtt->inflight_size ? (*InflightAt(mqtt, 0))->seq
+                                      : mqtt->messages_seq;
+    if (done >= target && taken && mqtt->outbound.written >= accepted) {
+      result = mqtt->dropped == dropped;
+      break;
+    }
+    if (mqtt->state != kMqttStateConnected) break;
+    if (cnd_wait(&mqtt->flushed, &mqtt->messages_mutex) != thrd_success) {
+      LOG(ERR, "failed to wait for flush: %s", strerror(errno));
+      break;
+    }
+  }
+  mtx_unlock(&mqtt->messages_mutex);
+  return result;
+}
+
+void MqttThrottle(struct Mqtt* mqtt) {
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock mutex: %s", strerror(errno));
+    return;
   }
+  // mburakov: Outbound buffer is emptied on disconnect, so this never waits
+  // for the broker to come back.
+  while (atomic_load(&mqtt->running) &&
+         OutboundPending(&mqtt->outbound) >= MQTT_OUTBOUND_HIGH) {
+    if (cnd_wait(&mqtt->flushed, &mqtt->messages_mutex) != thrd_success) {
+      LOG(ERR, "failed to wait for outbound buffer: %s", strerror(errno));
+      break;
+    }
+  }
+  mtx_unlock(&mqtt->messages_mutex);
+}
 
+void MqttGetStats(struct Mqtt* mqtt, struct MqttStats* stats) {
+  if (mtx_lock(&mqtt->messages_mutex) != thrd_success) {
+    LOG(ERR, "failed to lock mutex: %s", strerror(errno));
+    *stats = (struct MqttStats){.batches = {0}};
+    return;
+  }
+  *stats = mqtt->stats;
+  stats->queued = mqtt->messages_size;
+  stats->inflight = mqtt->inflight_size;
+  stats->outbound = OutboundPending(&mqtt->outbound);
   mtx_unlock(&mqtt->messages_mutex);
+  stats->messages_in = atomic_load_explicit(&mqtt->messages_in,
+                                            memory_order_relaxed);
+  stats->bytes_in = atomic_load_explicit(&mqtt->bytes_in, memory_order_relaxed);
+  stats->parse_errors =
+      atomic_load_explicit(&mqtt->parse_errors, memory_order_relaxed);
+  for (size_t index = 0; index < LENGTH(stats->loop_latency); index++) {
+    stats->loop_latency[index] = atomic_load_explicit(
+        mqtt->loop_latency + index, memory_order_relaxed);
+  }
 }
 
 void MqttDestroy(struct Mqtt* mqtt) {
   atomic_store(&mqtt->running, 0);
   WakeIoThread(mqtt);
   thrd_join(mqtt->io_thread, NULL);
-  SendDisconnectMessage(mqtt->fd);
+  // mburakov: Socket is not going to be waited for anymore, so whatever it
+  // does not take right away is lost.
+  if (mqtt->state == kMqttStateConnected &&
+      OutboundFlush(&mqtt->outbound) && !OutboundPending(&mqtt->outbound))
+    SendDisconnectMessage(&mqtt->outbound);
+  if (mqtt->fd != -1) close(mqtt->fd);
+  OutboundDestroy(&mqtt->outbound);
   close(mqtt->pipe[1]);
   close(mqtt->pipe[0]);
-  close(mqtt->fd);
-  for (struct MqttMessage* iter = mqtt->messages;
-       iter < mqtt->messages + mqtt->messages_size; iter++) {
-    StrFree(&iter->topic);
-    free(iter->payload);
-  }
+  RingDestroy(&mqtt->ring);
+  for (size_t index = 0; index < mqtt->messages_size; index++)
+    free(*MessageAt(mqtt, index));
   free(mqtt->messages);
+  HashDestroy(&mqtt->messages_index);
+  for (size_t index = 0; index < mqtt->inflight_size; index++)
+    free(*InflightAt(mqtt, index));
+  free(mqtt->inflight);
+  cnd_destroy(&mqtt->flushed);
+  for (size_t index = 0; index < mqtt->subscriptions.alloc; index++)
+    free(mqtt->subscriptions.slots[index].item);
+  HashDestroy(&mqtt->subscriptions);
+  ResetTopicAliases(mqtt);
+  free(mqtt->inbound_aliases);
+  free(mqtt->filters);
+  free(mqtt->filters_data);
   free(mqtt);
 }
@@ -21,16 +21,67 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define MQTT_HISTOGRAM_SIZE 16
+
 struct Str;
 
+enum MqttFlags {
+  kMqttFlagCoalesce = 1 << 0,
+  kMqttFlagNodelay = 1 << 1,
+  kMqttFlagCork = 1 << 2,
+  kMqttFlagMqtt5 = 1 << 3,
+  kMqttFlagQos1 = 1 << 4,
+};
+
+struct MqttStats {
+  // mburakov: Number of batched writes, bucketed by powers of two of the
+  // number of messages in a batch, i.e. 1, 2-3, 4-7 and so on.
+  size_t batches[9];
+  // mburakov: Publishes written to the socket, including retransmits, and
+  // their size on the wire, and publishes received and their payload size.
+  size_t messages_out;
+  size_t bytes_out;
+  size_t messages_in;
+  size_t bytes_in;
+  size_t parse_errors;
+  // mburakov: Messages waiting to be sent, and messages sent but not yet
+  // acknowledged, at the moment of taking the stats.
+  size_t queued;
+  size_t inflight;
+  // mburakov: Bytes the socket did not take yet, at the same moment.
+  size_t outbound;
+  // mburakov: Time in milliseconds that publishes were queued for, including
+  // holdback, and time in microseconds that the IO thread was busy for after
+  // every wakeup. Bucketed by powers of two, i.e. 0, 1, 2-3 and so on.
+  size_t queue_delay[MQTT_HISTOGRAM_SIZE];
+  size_t loop_latency[MQTT_HISTOGRAM_SIZE];
+};
+
+// mburakov: Connect callback is called every time the broker acknowledges a
+// connection, including reconnects. Retained messages follow shortly after.
+typedef void (*MqttConnectCallback)(void* user);
 typedef void (*MqttMessageCallback)(void* user, const struct Str* topic,
                                     const void* payload, size_t payload_len);
 
+// mburakov: With QoS one, at most inflight messages are left unacknowledged.
 struct Mqtt* MqttCreate(const char* host, uint16_t port, uint16_t keepalive,
-                        int holdback, MqttMessageCallback callback, void* user);
+                        int holdback, size_t queue_size, size_t inflight,
+                        const char* filters, int flags,
+                        MqttConnectCallback connect_callback,
+                        MqttMessageCallback callback, void* user);
 _Bool MqttPublish(struct Mqtt* mqtt, const struct Str* topic,
                   const void* payload, size_t payload_len);
 void MqttCancel(struct Mqtt* mqtt, const struct Str* topic);
+// mburakov: Subscription is dropped if not renewed for idle milliseconds.
+_Bool MqttSubscribe(struct Mqtt* mqtt, const struct Str* filter, int idle);
+// mburakov: Waits until every message published so far is either written with
+// QoS zero, or acknowledged with QoS one. Fails if any of those was dropped,
+// or if the connection is not established, or gets lost meanwhile.
+_Bool MqttFlush(struct Mqtt* mqtt);
+// mburakov: Waits while too much is written that the socket did not take yet.
+// Must not be called with anything held that receiving messages might need.
+void MqttThrottle(struct Mqtt* mqtt);
+void MqttGetStats(struct Mqtt* mqtt, struct MqttStats* stats);
 void MqttDestroy(struct Mqtt* mqtt);
 
 #endif  // MQTTFS_MQTT_H_
@@ -18,20 +18,104 @@
 #include "mqtt_impl.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
-#ifndef UNCONST
-#define UNCONST(op) ((void*)(uintptr_t)(op))
-#endif  // UNCONST
-
-#ifndef LENGTH
-#define LENGTH(op) (sizeof(op) / sizeof *(op))
-#endif  // LENGTH
+#include "str.h"
 
 // TODO(mburakov): Implement more robust sending-receiving.
 
+static _Bool Send(struct Outbound* outbound, const void* data, size_t size) {
+  struct iovec iov = {.iov_base = (void*)(uintptr_t)data, .iov_len = size};
+  return OutboundWrite(outbound, &iov, 1);
+}
+
+void OutboundReset(struct Outbound* outbound, int fd) {
+  // mburakov: Whatever is still pending belongs to the previous socket, and
+  // is dropped, but still counted as written, so that nobody waits for it.
+  outbound->fd = fd;
+  outbound->written += outbound->size - outbound->offset;
+  outbound->offset = 0;
+  outbound->size = 0;
+}
+
+_Bool OutboundWrite(struct Outbound* outbound, const struct iovec* iov,
+                    size_t iov_count) {
+  // mburakov: Nothing could be written ahead of pending data, otherwise the
+  // socket is tried right away, so that usually nothing is copied.
+  size_t total = 0;
+  for (size_t index = 0; index < iov_count; index++)
+    total += iov[index].iov_len;
+  size_t skip = 0;
+  if (outbound->offset == outbound->size) {
+    outbound->offset = 0;
+    outbound->size = 0;
+    ssize_t result = writev(outbound->fd, iov, (int)iov_count);
+    if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+        errno != EINTR)
+      return 0;
+    if (result > 0) skip = (size_t)result;
+  }
+  // mburakov: Only what made it to the socket or to the buffer is accepted,
+  // so that the flush waiters never wait for the bytes that were dropped.
+  outbound->accepted += skip;
+  outbound->written += skip;
+  if (skip == total) return 1;
+
+  if (outbound->offset && outbound->size + total - skip > outbound->alloc) {
+    memmove(outbound->data, outbound->data + outbound->offset,
+            outbound->size - outbound->offset);
+    outbound->size -= outbound->offset;
+    outbound->offset = 0;
+  }
+  if (outbound->size + total - skip > outbound->alloc) {
+    size_t alloc = outbound->alloc ? outbound->alloc : 4096;
+    while (alloc < outbound->size + total - skip) alloc *= 2;
+    uint8_t* data = realloc(outbound->data, alloc);
+    if (!data) return 0;
+    outbound->data = data;
+    outbound->alloc = alloc;
+  }
+  for (size_t index = 0; index < iov_count; index++) {
+    size_t size = iov[index].iov_len;
+    if (skip >= size) {
+      skip -= size;
+      continue;
+    }
+    memcpy(outbound->data + outbound->size,
+           (const uint8_t*)iov[index].iov_base + skip, size - skip);
+    outbound->size += size - skip;
+    outbound->accepted += size - skip;
+    skip = 0;
+  }
+  return 1;
+}
+
+_Bool OutboundFlush(struct Outbound* outbound) {
+  if (outbound->offset == outbound->size) return 1;
+  ssize_t result = write(outbound->fd, outbound->data + outbound->offset,
+                         outbound->size - outbound->offset);
+  if (result == -1)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  outbound->offset += (size_t)result;
+  outbound->written += (size_t)result;
+  if (outbound->offset == outbound->size) {
+    outbound->offset = 0;
+    outbound->size = 0;
+  }
+  return 1;
+}
+
+size_t OutboundPending(const struct Outbound* outbound) {
+  return outbound->size - outbound->offset;
+}
+
+void OutboundDestroy(struct Outbound* outbound) { free(outbound->data); }
+
 static size_t EncodeLength(uint32_t length, uint8_t digits[4]) {
   if (length > 268435455) return 0;
   size_t result = 0;
@@ -47,7 +131,9 @@ static size_t EncodeLength(uint32_t length, uint8_t digits[4]) {
   }
 }
 
-_Bool SendConnectMessage(int fd, uint16_t keepalive) {
+static _Bool SendConnect5Message(struct Outbound* outbound,
+                                 uint16_t keepalive,
+                                 uint16_t topic_alias_maximum) {
   struct __attribute__((__packed__)) {
     uint8_t packet_type;
     uint8_t message_length;
@@ -56,75 +142,103 @@ _Bool SendConnectMessage(int fd, uint16_t keepalive) {
     uint8_t protocol_level;
     uint8_t connect_flags;
     uint16_t keepalive;
+    uint8_t properties_length;
+    uint8_t topic_alias_maximum_id;
+    uint16_t topic_alias_maximum;
     uint16_t client_id_length;
   } connect_message = {
       .packet_type = 0x10,
-      .message_length = 12,
+      .message_length = 16,
       .protocol_name_length = htons(4),
       .protocol_name = {'M', 'Q', 'T', 'T'},
-      .protocol_level = 4,
+      .protocol_level = 5,
       .connect_flags = 0x02,
       .keepalive = htons(keepalive),
+      .properties_length = 3,
+      .topic_alias_maximum_id = 0x22,
+      .topic_alias_maximum = htons(topic_alias_maximum),
       .client_id_length = 0,
   };
-  _Static_assert(sizeof(connect_message) == 14,
+  _Static_assert(sizeof(connect_message) == 18,
                  "Unexpected connect message size");
-  return write(fd, &connect_message, sizeof(connect_message)) ==
-         sizeof(connect_message);
+  return Send(outbound, &connect_message, sizeof(connect_message));
 }
 
-_Bool ReceiveConnectAck(int fd) {
+_Bool SendConnectMessage(struct Outbound* outbound, uint8_t level,
+                         uint16_t keepalive, uint16_t topic_alias_maximum) {
+  if (level == 5)
+    return SendConnect5Message(outbound, keepalive, topic_alias_maximum);
   struct __attribute__((__packed__)) {
     uint8_t packet_type;
     uint8_t message_length;
-    uint8_t connack_flags;
-    uint8_t return_code;
-  } connect_ack;
-  _Static_assert(sizeof(connect_ack) == 4, "Unexpected connect ack size");
-  return read(fd, &connect_ack, sizeof(connect_ack)) == sizeof(connect_ack) &&
-         connect_ack.packet_type == 0x20 && connect_ack.message_length == 2 &&
-         connect_ack.connack_flags == 0x00 && connect_ack.return_code == 0;
+    uint16_t protocol_name_length;
+    char protocol_name[4];
+    uint8_t protocol_level;
+    uint8_t connect_flags;
+    uint16_t keepalive;
+    uint16_t client_id_length;
+  } connect_message = {
+      .packet_type = 0x10,
+      .message_length = 12,
+      .protocol_name_length = htons(4),
+      .protocol_name = {'M', 'Q', 'T', 'T'},
+      .protocol_level = level,
+      .connect_flags = 0x02,
+      .keepalive = htons(keepalive),
+      .client_id_length = 0,
+  };
+  _Static_assert(sizeof(connect_message) == 14,
+                 "Unexpected connect message size");
+  return Send(outbound, &connect_message, sizeof(connect_message));
 }
 
-_Bool SendSubscribeMessage(int fd) {
-  struct __attribute__((__packed__)) {
-    uint8_t packet_type;
-    uint8_t message_length;
-    uint16_t packet_identifier;
-    uint16_t topic_length;
-    char topic[3];
-    uint8_t qos;
-  } subscribe_message = {
-      .packet_type = 0x82,
-      .message_length = 8,
-      .packet_identifier = htons(1),
-      .topic_length = htons(3),
-      .topic = {'+', '/', '#'},
-      .qos = 0x00,
-  };
-  _Static_assert(sizeof(subscribe_message) == 10,
-                 "Unexpected subscribe message size");
-  return write(fd, &subscribe_message, sizeof(subscribe_message)) ==
-         sizeof(subscribe_message);
+static _Bool SendFilters(struct Outbound* outbound, uint8_t level,
+                         uint8_t packet_type, uint16_t packet_id,
+                         const struct Str* filters, size_t count,
+                         _Bool with_qos) {
+  // mburakov: Packet identifier is followed by length-prefixed filters, each
+  // one with the requested QoS for subscriptions. MQTT 5 puts empty properties
+  // in between.
+  _Bool with_properties = level == 5;
+  size_t length = sizeof(packet_id) + with_properties;
+  for (size_t index = 0; index < count; index++) {
+    if (filters[index].size > UINT16_MAX) return 0;
+    length += sizeof(uint16_t) + filters[index].size + with_qos;
+  }
+  if (length > 268435455) return 0;
+  uint8_t* message = malloc(length + 5);
+  if (!message) return 0;
+
+  message[0] = packet_type;
+  size_t offset = 1 + EncodeLength((uint32_t)length, message + 1);
+  message[offset++] = (uint8_t)(packet_id >> 8);
+  message[offset++] = (uint8_t)packet_id;
+  if (with_properties) message[offset++] = 0x00;
+  for (size_t index = 0; index < count; index++) {
+    message[offset++] = (uint8_t)(filters[index].size >> 8);
+    message[offset++] = (uint8_t)filters[index].size;
+    memcpy(message + offset, filters[index].data, filters[index].size);
+    offset += filters[index].size;
+    if (with_qos) message[offset++] = 0x00;
+  }
+  _Bool result = Send(outbound, message, offset);
+  free(message);
+  return result;
 }
 
-_Bool ReceiveSubscribeAck(int fd) {
-  struct __attribute__((__packed__)) {
-    uint8_t packet_type;
-    uint8_t message_length;
-    uint16_t packet_identifier;
-    uint8_t return_code;
-  } subscribe_ack;
-  _Static_assert(sizeof(subscribe_ack) == 5, "Unexpected subscribe ack size");
-  return read(fd, &subscribe_ack, sizeof(subscribe_ack)) ==
-             sizeof(subscribe_ack) &&
-         subscribe_ack.packet_type == 0x90 &&
-         subscribe_ack.message_length == 3 &&
-         subscribe_ack.packet_identifier == htons(1) &&
-         subscribe_ack.return_code == 0;
+_Bool SendSubscribeMessage(struct Outbound* outbound, uint8_t level,
+                           uint16_t packet_id, const struct Str* filters,
+                           size_t count) {
+  return SendFilters(outbound, level, 0x82, packet_id, filters, count, 1);
 }
 
-_Bool SendPingMessage(int fd) {
+_Bool SendUnsubscribeMessage(struct Outbound* outbound, uint8_t level,
+                             uint16_t packet_id, const struct Str* filters,
+                             size_t count) {
+  return SendFilters(outbound, level, 0xa2, packet_id, filters, count, 0);
+}
+
+_Bool SendPingMessage(struct Outbound* outbound) {
   struct __attribute__((__packed__)) {
     uint8_t packet_type;
     uint8_t message_length;
@@ -133,10 +247,10 @@ _Bool SendPingMessage(int fd) {
       .message_length = 0,
   };
   _Static_assert(sizeof(ping_message) == 2, "Unexpected ping message size");
-  return write(fd, &ping_message, sizeof(ping_message)) == sizeof(ping_message);
+  return Send(outbound, &ping_message, sizeof(ping_message));
 }
 
-_Bool SendDisconnectMessage(int fd) {
+_Bool SendDisconnectMessage(struct Outbound* outbound) {
   struct __attribute__((__packed__)) {
     uint8_t packet_type;
     uint8_t message_length;
@@ -146,27 +260,39 @@ _Bool SendDisconnectMessage(int fd) {
   };
   _Static_assert(sizeof(disconnect_message) == 2,
                  "Unexpected disconnect message size");
-  return write(fd, &disconnect_message, sizeof(disconnect_message)) ==
-         sizeof(disconnect_message);
+  return Send(outbound, &disconnect_message, sizeof(disconnect_message));
 }
 
-_Bool SendPublishMessage(int fd, const char* topic, uint16_t topic_size,
-                         const void* payload, uint32_t payload_size) {
-  static const uint8_t kPacketType = 0x30;
-  uint8_t length_digits[4];
+size_t EncodePublishHeader(uint8_t header[MQTT_PUBLISH_HEADER_MAX],
+                           uint8_t flags, uint16_t topic_size,
+                           uint32_t payload_size) {
+  header[0] = 0x30 | flags;
   size_t length_digits_count = EncodeLength(
-      sizeof(topic_size) + topic_size + payload_size, length_digits);
+      sizeof(topic_size) + topic_size + payload_size, header + 1);
   if (!length_digits_count) return 0;
-  uint16_t topic_size_no = htons(topic_size);
-  struct iovec iov[] = {
-      {.iov_base = UNCONST(&kPacketType), .iov_len = sizeof(kPacketType)},
-      {.iov_base = UNCONST(length_digits), .iov_len = length_digits_count},
-      {.iov_base = &topic_size_no, .iov_len = sizeof(topic_size_no)},
-      {.iov_base = UNCONST(topic), .iov_len = topic_size},
-      {.iov_base = UNCONST(payload), .iov_len = payload_size},
-  };
-  ssize_t write_length = 0;
-  for (size_t idx = 0; idx < LENGTH(iov); idx++)
-    write_length += iov[idx].iov_len;
-  return writev(fd, iov, LENGTH(iov)) == write_length;
+  header[length_digits_count + 1] = (uint8_t)(topic_size >> 8);
+  header[length_digits_count + 2] = (uint8_t)topic_size;
+  return length_digits_count + 3;
+}
+
+size_t EncodePublishExtra(uint8_t extra[MQTT_PUBLISH_EXTRA_MAX],
+                          uint8_t level, uint16_t packet_id,
+                          uint16_t topic_alias) {
+  // mburakov: Zero packet identifier means QoS zero, and zero topic alias
+  // means there is no alias.
+  size_t size = 0;
+  if (packet_id) {
+    extra[size++] = (uint8_t)(packet_id >> 8);
+    extra[size++] = (uint8_t)packet_id;
+  }
+  if (level != 5) return size;
+  if (!topic_alias) {
+    extra[size++] = 0;
+    return size;
+  }
+  extra[size++] = 3;
+  extra[size++] = 0x23;
+  extra[size++] = (uint8_t)(topic_alias >> 8);
+  extra[size++] = (uint8_t)topic_alias;
+  return size;
 }
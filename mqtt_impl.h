@@ -18,15 +18,55 @@
 #ifndef MQTT_IMPL_H_
 #define MQTT_IMPL_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-_Bool SendConnectMessage(int fd, uint16_t keepalive);
-_Bool ReceiveConnectAck(int fd);
-_Bool SendSubscribeMessage(int fd);
-_Bool ReceiveSubscribeAck(int fd);
-_Bool SendPingMessage(int fd);
-_Bool SendDisconnectMessage(int fd);
-_Bool SendPublishMessage(int fd, const char* topic, uint16_t topic_size,
-                         const void* payload, uint32_t payload_size);
+// mburakov: Packet type, up to four bytes of remaining length and topic size.
+#define MQTT_PUBLISH_HEADER_MAX 7
+
+// mburakov: Packet identifier for QoS above zero, and properties length with a
+// topic alias for MQTT 5, which are sent between the topic and the payload.
+#define MQTT_PUBLISH_EXTRA_MAX 6
+
+struct Str;
+struct iovec;
+
+// mburakov: Socket is never blocking, so whatever it does not take right away
+// is kept in the outbound buffer, and written once the socket is writable
+// again. Written and accepted are running totals of bytes, so that anybody
+// could tell whether everything accepted up to some point is written.
+struct Outbound {
+  int fd;
+  uint8_t* data;
+  size_t offset;
+  size_t size;
+  size_t alloc;
+  size_t accepted;
+  size_t written;
+};
+
+void OutboundReset(struct Outbound* outbound, int fd);
+_Bool OutboundWrite(struct Outbound* outbound, const struct iovec* iov,
+                    size_t iov_count);
+_Bool OutboundFlush(struct Outbound* outbound);
+size_t OutboundPending(const struct Outbound* outbound);
+void OutboundDestroy(struct Outbound* outbound);
+
+_Bool SendConnectMessage(struct Outbound* outbound, uint8_t level,
+                         uint16_t keepalive, uint16_t topic_alias_maximum);
+_Bool SendSubscribeMessage(struct Outbound* outbound, uint8_t level,
+                           uint16_t packet_id, const struct Str* filters,
+                           size_t count);
+_Bool SendUnsubscribeMessage(struct Outbound* outbound, uint8_t level,
+                             uint16_t packet_id, const struct Str* filters,
+                             size_t count);
+_Bool SendPingMessage(struct Outbound* outbound);
+_Bool SendDisconnectMessage(struct Outbound* outbound);
+size_t EncodePublishHeader(uint8_t header[MQTT_PUBLISH_HEADER_MAX],
+                           uint8_t flags, uint16_t topic_size,
+                           uint32_t payload_size);
+size_t EncodePublishExtra(uint8_t extra[MQTT_PUBLISH_EXTRA_MAX],
+                          uint8_t level, uint16_t packet_id,
+                          uint16_t topic_alias);
 
 #endif  // MQTT_IMPL_H_
@@ -17,62 +17,278 @@
 
 #include "mqtt_parser.h"
 
-#include <setjmp.h>
 #include <stdint.h>
 
 #include "str.h"
 
-static uint8_t ReadByte(const uint8_t** buffer, size_t* size, jmp_buf jmpbuf) {
-  if (!*size) longjmp(jmpbuf, kMqttParseStatusReadMore);
-  uint8_t result = **buffer;
-  (*buffer)++;
-  (*size)--;
-  return result;
+static enum MqttParseStatus ParseFixedHeader(const uint8_t* buffer,
+                                             size_t size, size_t* header_size,
+                                             size_t* remaining_length) {
+  // mburakov: Fixed header is a packet type followed by up to four bytes of
+  // remaining length. Clamping the limit up front leaves a single bounds check
+  // per header instead of one per byte.
+  size_t limit = size < 5 ? size : 5;
+  size_t result = 0;
+  for (size_t index = 1; index < limit; index++) {
+    result |= (buffer[index] & 0x7full) << (7 * (index - 1));
+    if (~buffer[index] & 0x80) {
+      *header_size = index + 1;
+      *remaining_length = result;
+      return kMqttParseStatusSuccess;
+    }
+  }
+  return limit < 5 ? kMqttParseStatusReadMore : kMqttParseStatusError;
 }
 
-static size_t ReadRemainingLength(const uint8_t** buffer, size_t* size,
-                                  jmp_buf jmpbuf) {
-  size_t result = 0;
-  for (size_t counter = 0; counter < 4; counter++) {
-    uint8_t byte = ReadByte(buffer, size, jmpbuf);
-    result |= (byte & 0x7full) << (7ull * counter);
-    if (~byte & 0x80) return result;
+static _Bool ParseVarint(const uint8_t** buffer, const uint8_t* end,
+                         uint32_t* value) {
+  uint32_t result = 0;
+  for (size_t index = 0; index < 4 && *buffer < end; index++) {
+    uint8_t digit = *(*buffer)++;
+    result |= (uint32_t)(digit & 0x7f) << (7 * index);
+    if (~digit & 0x80) {
+      *value = result;
+      return 1;
+    }
   }
-  longjmp(jmpbuf, kMqttParseStatusError);
+  return 0;
+}
+
+static _Bool SkipBinary(const uint8_t** buffer, const uint8_t* end) {
+  if (end - *buffer < 2) return 0;
+  size_t size = (size_t)((*buffer)[0] << 8 | (*buffer)[1]);
+  if ((size_t)(end - *buffer) - 2 < size) return 0;
+  *buffer += 2 + size;
+  return 1;
+}
+
+static _Bool ParseProperty(const uint8_t** buffer, const uint8_t* end,
+                           uint8_t* id, uint32_t* value) {
+  // mburakov: Property identifiers are variable byte integers, but all of the
+  // defined ones fit into a single byte. Integer properties are reported with
+  // their values, and the rest are skipped.
+  if (*buffer == end) return 0;
+  *id = *(*buffer)++;
+  *value = 0;
+  size_t size;
+  switch (*id) {
+    case 0x01:
+    case 0x17:
+    case 0x19:
+    case 0x24:
+    case 0x25:
+    case 0x28:
+    case 0x29:
+    case 0x2a:
+      size = 1;
+      break;
+    case 0x13:
+    case 0x21:
+    case 0x22:
+    case 0x23:
+      size = 2;
+      break;
+    case 0x02:
+    case 0x11:
+    case 0x18:
+    case 0x27:
+      size = 4;
+      break;
+    case 0x0b:
+      return ParseVarint(buffer, end, value);
+    case 0x03:
+    case 0x08:
+    case 0x09:
+    case 0x12:
+    case 0x15:
+    case 0x16:
+    case 0x1a:
+    case 0x1c:
+    case 0x1f:
+      return SkipBinary(buffer, end);
+    case 0x26:
+      return SkipBinary(buffer, end) && SkipBinary(buffer, end);
+    default:
+      return 0;
+  }
+  if ((size_t)(end - *buffer) < size) return 0;
+  for (size_t index = 0; index < size; index++)
+    *value = *value << 8 | (*buffer)[index];
+  *buffer += size;
+  return 1;
+}
+
+static _Bool ParseProperties(const uint8_t** buffer, const uint8_t* end,
+                             const uint8_t** properties_end) {
+  uint32_t length;
+  if (!ParseVarint(buffer, end, &length)) return 0;
+  if ((size_t)(end - *buffer) < length) return 0;
+  *properties_end = *buffer + length;
+  return 1;
 }
 
 enum MqttParseStatus MqttParseMessage(const void** buffer, size_t* size,
-                                      struct Str* topic_view,
-                                      const void** payload,
-                                      size_t* payload_len) {
-  jmp_buf jmpbuf;
-  int result = setjmp(jmpbuf);
-  if (result) return (enum MqttParseStatus)result;
-  const uint8_t* buffer_copy = *buffer;
-  size_t size_copy = *size;
-
-  uint8_t packet_type = ReadByte(&buffer_copy, &size_copy, jmpbuf);
-  size_t remaining_length =
-      ReadRemainingLength(&buffer_copy, &size_copy, jmpbuf);
-  if (remaining_length > size_copy) return kMqttParseStatusReadMore;
-
-  if ((packet_type & 0xf0) != 0x30) {
-    *buffer = buffer_copy + remaining_length;
-    *size = size_copy - remaining_length;
+                                      enum MqttProtocolLevel level,
+                                      struct MqttPacketView* view) {
+  const uint8_t* data = *buffer;
+  size_t header_size;
+  size_t remaining_length;
+  enum MqttParseStatus status =
+      ParseFixedHeader(data, *size, &header_size, &remaining_length);
+  if (status != kMqttParseStatusSuccess) return status;
+  if (*size - header_size < remaining_length) return kMqttParseStatusReadMore;
+
+  const uint8_t* body = data + header_size;
+  const uint8_t* end = body + remaining_length;
+  if ((data[0] & 0xf0) == kMqttPacketTypeConnectAck ||
+      (data[0] & 0xf0) == kMqttPacketTypePublishAck ||
+      (data[0] & 0xf0) == kMqttPacketTypeSubscribeAck) {
+    *buffer = end;
+    *size -= header_size + remaining_length;
+    view->type = data[0] & 0xf0;
+    view->topic = (struct Str){.size = 0, .data = NULL};
+    view->topic_alias = 0;
+    view->payload = body;
+    view->payload_len = remaining_length;
+    return kMqttParseStatusSuccess;
+  }
+  if ((data[0] & 0xf0) != kMqttPacketTypePublish) {
+    *buffer = end;
+    *size -= header_size + remaining_length;
     return kMqttParseStatusSkipped;
   }
 
-  uint16_t topic_len = (buffer_copy[0] << 8 | buffer_copy[1]) & 0xffff;
-  if (topic_len > remaining_length) return kMqttParseStatusError;
-
-  *buffer = buffer_copy + remaining_length;
-  *size = size_copy - remaining_length;
-  struct Str topic = {
-      .size = topic_len,
-      .data = (const char*)buffer_copy + sizeof(uint16_t),
-  };
-  *topic_view = topic;
-  *payload = buffer_copy + sizeof(uint16_t) + topic_len;
-  *payload_len = remaining_length - sizeof(uint16_t) - topic_len;
+  if (remaining_length < sizeof(uint16_t)) return kMqttParseStatusError;
+  size_t topic_len = (size_t)(body[0] << 8 | body[1]);
+  if (topic_len > remaining_length - sizeof(uint16_t))
+    return kMqttParseStatusError;
+  view->type = kMqttPacketTypePublish;
+  view->topic.size = topic_len;
+  view->topic.data = (const char*)body + sizeof(uint16_t);
+  view->topic_alias = 0;
+  const uint8_t* ptr = body + sizeof(uint16_t) + topic_len;
+
+  // mburakov: Packet identifier is only there for QoS above zero, and MQTT 5
+  // adds properties right before the payload.
+  if (data[0] & 0x06) {
+    if ((size_t)(end - ptr) < sizeof(uint16_t)) return kMqttParseStatusError;
+    ptr += sizeof(uint16_t);
+  }
+  if (level == kMqttProtocolLevel5) {
+    const uint8_t* properties_end;
+    if (!ParseProperties(&ptr, end, &properties_end))
+      return kMqttParseStatusError;
+    while (ptr < properties_end) {
+      uint8_t id;
+      uint32_t value;
+      if (!ParseProperty(&ptr, properties_end, &id, &value))
+        return kMqttParseStatusError;
+      if (id == 0x23) view->topic_alias = (uint16_t)value;
+    }
+  }
+
+  *buffer = end;
+  *size -= header_size + remaining_length;
+  view->payload = ptr;
+  view->payload_len = (size_t)(end - ptr);
   return kMqttParseStatusSuccess;
 }
+
+size_t MqttParseMessages(const void** buffer, size_t* size,
+                         enum MqttProtocolLevel level,
+                         struct MqttPacketView* views, size_t count,
+                         enum MqttParseStatus* status) {
+  // mburakov: Status is only reported for the packet that stopped parsing.
+  // Success means that all the views were filled, and there might be more.
+  size_t result = 0;
+  while (result < count) {
+    switch (MqttParseMessage(buffer, size, level, views + result)) {
+      case kMqttParseStatusSuccess:
+        result++;
+        __attribute__((__fallthrough__));
+      case kMqttParseStatusSkipped:
+        continue;
+      case kMqttParseStatusReadMore:
+        *status = kMqttParseStatusReadMore;
+        return result;
+      case kMqttParseStatusError:
+        *status = kMqttParseStatusError;
+        return result;
+    }
+  }
+  *status = kMqttParseStatusSuccess;
+  return result;
+}
+
+_Bool MqttParseConnectAck(const struct MqttPacketView* view,
+                          enum MqttProtocolLevel level,
+                          struct MqttConnectAck* ack) {
+  // mburakov: Acknowledge flags are followed by the return code, and with
+  // MQTT 5 by properties, which carry the limits imposed by the broker.
+  const uint8_t* ptr = view->payload;
+  const uint8_t* end = ptr + view->payload_len;
+  if (view->payload_len < 2 || ptr[0] & 0xfe) return 0;
+  ack->session_present = ptr[0] & 0x01;
+  ack->reason_code = ptr[1];
+  ack->receive_maximum = UINT16_MAX;
+  ack->topic_alias_maximum = 0;
+  ack->maximum_packet_size = 0;
+  ptr += 2;
+  if (level != kMqttProtocolLevel5) return ptr == end;
+
+  const uint8_t* properties_end;
+  if (!ParseProperties(&ptr, end, &properties_end)) return 0;
+  while (ptr < properties_end) {
+    uint8_t id;
+    uint32_t value;
+    if (!ParseProperty(&ptr, properties_end, &id, &value)) return 0;
+    switch (id) {
+      case 0x21:
+        if (!value) return 0;
+        ack->receive_maximum = (uint16_t)value;
+        break;
+      case 0x22:
+        ack->topic_alias_maximum = (uint16_t)value;
+        break;
+      case 0x27:
+        if (!value) return 0;
+        ack->maximum_packet_size = value;
+        break;
+      default:
+        break;
+    }
+  }
+  return 1;
+}
+
+_Bool MqttParsePublishAck(const struct MqttPacketView* view,
+                          enum MqttProtocolLevel level, uint16_t* packet_id,
+                          uint8_t* reason_code) {
+  // mburakov: MQTT 5 might add a reason code and properties after the packet
+  // identifier, but both could be omitted when the publish succeeded.
+  const uint8_t* ptr = view->payload;
+  if (view->payload_len < sizeof(uint16_t)) return 0;
+  *packet_id = (uint16_t)(ptr[0] << 8 | ptr[1]);
+  *reason_code = 0;
+  if (level != kMqttProtocolLevel5) return view->payload_len == 2;
+  if (view->payload_len > 2) *reason_code = ptr[2];
+  return 1;
+}
+
+_Bool MqttParseSubscribeAck(const struct MqttPacketView* view,
+                            enum MqttProtocolLevel level, uint16_t* packet_id,
+                            const uint8_t** codes, size_t* count) {
+  // mburakov: Packet identifier is followed by a return code per filter, and
+  // with MQTT 5 there are properties in between.
+  const uint8_t* ptr = view->payload;
+  const uint8_t* end = ptr + view->payload_len;
+  if (view->payload_len < sizeof(uint16_t)) return 0;
+  *packet_id = (uint16_t)(ptr[0] << 8 | ptr[1]);
+  ptr += sizeof(uint16_t);
+  if (level == kMqttProtocolLevel5 && !ParseProperties(&ptr, end, &ptr))
+    return 0;
+  if (ptr == end) return 0;
+  *codes = ptr;
+  *count = (size_t)(end - ptr);
+  return 1;
+}
@@ -19,8 +19,9 @@
 #define MQTTFS_MQTT_PARSER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
-struct Str;
+#include "str.h"
 
 enum MqttParseStatus {
   kMqttParseStatusSuccess = 0,
@@ -29,9 +30,57 @@ enum MqttParseStatus {
   kMqttParseStatusError
 };
 
+enum MqttProtocolLevel {
+  kMqttProtocolLevel311 = 4,
+  kMqttProtocolLevel5 = 5,
+};
+
+// mburakov: Only publish messages, connect acks, publish acks and subscribe
+// acks are reported, anything else is skipped. Acks have no topic, and their
+// payload is the rest of the packet after the fixed header.
+enum MqttPacketType {
+  kMqttPacketTypeConnectAck = 0x20,
+  kMqttPacketTypePublish = 0x30,
+  kMqttPacketTypePublishAck = 0x40,
+  kMqttPacketTypeSubscribeAck = 0x90,
+};
+
+// mburakov: With MQTT 5 a publish might carry a topic alias instead of the
+// topic, or both, in which case the alias has to be remembered. Resolving
+// aliases needs the state of the connection, so it is up to the caller.
+struct MqttPacketView {
+  enum MqttPacketType type;
+  struct Str topic;
+  uint16_t topic_alias;
+  const void* payload;
+  size_t payload_len;
+};
+
+// mburakov: Limits are reported with their default values if not provided
+// by the broker. Zero maximum packet size means there is no limit.
+struct MqttConnectAck {
+  _Bool session_present;
+  uint8_t reason_code;
+  uint16_t receive_maximum;
+  uint16_t topic_alias_maximum;
+  uint32_t maximum_packet_size;
+};
+
 enum MqttParseStatus MqttParseMessage(const void** buffer, size_t* size,
-                                      struct Str* topic_view,
-                                      const void** payload,
-                                      size_t* payload_len);
+                                      enum MqttProtocolLevel level,
+                                      struct MqttPacketView* view);
+size_t MqttParseMessages(const void** buffer, size_t* size,
+                         enum MqttProtocolLevel level,
+                         struct MqttPacketView* views, size_t count,
+                         enum MqttParseStatus* status);
+_Bool MqttParseConnectAck(const struct MqttPacketView* view,
+                          enum MqttProtocolLevel level,
+                          struct MqttConnectAck* ack);
+_Bool MqttParsePublishAck(const struct MqttPacketView* view,
+                          enum MqttProtocolLevel level, uint16_t* packet_id,
+                          uint8_t* reason_code);
+_Bool MqttParseSubscribeAck(const struct MqttPacketView* view,
+                            enum MqttProtocolLevel level, uint16_t* packet_id,
+                            const uint8_t** codes, size_t* count);
 
 #endif  // MQTTFS_MQTT_PARSER_H_
@@ -18,46 +18,238 @@
 #ifndef MQTTFS_MQTTFS_H_
 #define MQTTFS_MQTTFS_H_
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
-#include <threads.h>
-#include <time.h>
 
+#include "tree.h"
+
+// mburakov: Every directory has a virtual events file. Its node id is the node
+// id of the directory with the tag bit set, which node pointers and the root
+// node id never have.
+#define MQTTFS_EVENTS_NAME ".events"
+#define MQTTFS_EVENTS_TAG 2
+
+// mburakov: Root directory has a virtual stats file. Its node id is the root
+// node id with another tag bit set, which node pointers never have either.
+#define MQTTFS_STATS_NAME ".stats"
+#define MQTTFS_STATS_TAG 4
+
+// mburakov: Every directory also has a virtual all file, with yet another tag
+// bit. Nodes come from the pool, which keeps those 16 bytes aligned.
+#define MQTTFS_ALL_NAME ".all"
+#define MQTTFS_ALL_TAG 8
+
+// mburakov: Files that were not refreshed since the last connection to the
+// broker are reported as stale by this extended attribute.
+#define MQTTFS_STALE_XATTR "user.mqttfs.stale"
+
+// mburakov: Root directory reports the total size of resident payloads.
+#define MQTTFS_RESIDENT_XATTR "user.mqttfs.resident"
+
+struct Apply;
+struct Context;
+struct Events;
+struct Handle;
+struct Mqtt;
+struct Node;
+struct Snapshot;
+struct Str;
+struct Stream;
 struct stat;
 
+enum MqttfsOp {
+  kMqttfsOpLookup,
+  kMqttfsOpForget,
+  kMqttfsOpGetattr,
+  kMqttfsOpSetattr,
+  kMqttfsOpMkdir,
+  kMqttfsOpUnlink,
+  kMqttfsOpRmdir,
+  kMqttfsOpRename,
+  kMqttfsOpOpen,
+  kMqttfsOpRead,
+  kMqttfsOpWrite,
+  kMqttfsOpFlush,
+  kMqttfsOpFsync,
+  kMqttfsOpRelease,
+  kMqttfsOpOpendir,
+  kMqttfsOpReaddir,
+  kMqttfsOpCreate,
+  kMqttfsOpPoll,
+  kMqttfsOpGetxattr,
+  kMqttfsOpForgetMulti,
+  kMqttfsOpCount,
+};
+
 struct Options {
   const char* host;
   uint16_t port;
   uint16_t keepalive;
   int holdback;
+  size_t queue;
+  _Bool coalesce;
+  _Bool nodelay;
+  _Bool cork;
+  _Bool cache;
+  _Bool buffer;
+  double entry_timeout;
+  double attr_timeout;
+  const char* subscribe;
+  int lazy;
+  size_t connections;
+  int version;
+  int qos;
+  size_t inflight;
+  _Bool sync;
+  size_t memory;
+  const char* snapshot;
+  int snapshot_interval;
+  size_t stream;
+  _Bool dedup;
+  int notify;
+};
+
+struct Connection {
+  struct Context* context;
+  struct Mqtt* mqtt;
+  struct Apply* apply;
+  // mburakov: Number of times this connection was established so far, plus
+  // one, so that restored nodes, which have zero, are older than any epoch.
+  uint64_t epoch;
 };
 
 struct Context {
   const struct Options options;
-  void* root_node;
-  mtx_t root_mutex;
-  struct Mqtt* mqtt;
+  struct Tree tree;
+  pthread_rwlock_t root_lock;
+  size_t messages;
+  struct Connection* connections;
+  struct fuse_session* session;
+  struct Events* events;
+  struct Snapshot* snapshot;
+  struct Stream* streams;
+  // mburakov: Bumped whenever an evicted payload is filled again, so that the
+  // callers waiting for a refetch could check their nodes once more.
+  pthread_mutex_t refetch_mutex;
+  pthread_cond_t refetch_cond;
+  uint64_t refetched;
 };
 
-int MqttfsGetattr(const char* path, struct stat* stbuf,
-                  struct fuse_file_info* fi);
-int MqttfsMkdir(const char* path, mode_t mode);
-int MqttfsUnlink(const char* path);
-int MqttfsRename(const char* from, const char* to, unsigned int flags);
-int MqttfsOpen(const char* path, struct fuse_file_info* fi);
-int MqttfsRead(const char* path, char* buf, size_t size, off_t offset,
-               struct fuse_file_info* fi);
-int MqttfsWrite(const char* path, const char* buf, size_t size, off_t offset,
+struct Node* MqttfsNode(struct Context* context, fuse_ino_t ino);
+fuse_ino_t MqttfsIno(struct Context* context, const struct Node* node);
+void MqttfsStat(const struct Node* node, struct stat* stbuf);
+void MqttfsEntry(struct Context* context, struct Node* node,
+                 struct fuse_entry_param* entry);
+_Bool MqttfsOpenHandle(struct Context* context, uint64_t seen,
+                       struct fuse_file_info* fi);
+_Bool MqttfsLoadHandle(struct Context* context, fuse_ino_t ino,
+                      struct Handle* handle);
+int MqttfsCommit(struct Context* context, struct Node* node, const void* data,
+                 size_t size);
+
+struct Connection* MqttfsConnection(struct Context* context,
+                                    const struct Str* topic);
+struct Connection* MqttfsNodeConnection(struct Context* context,
+                                        const struct Node* node);
+char* MqttfsConnectionFilters(const struct Context* context, size_t index);
+
+_Bool MqttfsApplyStart(struct Connection* connection);
+void MqttfsApplyMessage(void* user, const struct Str* topic,
+                        const void* payload, size_t payload_len);
+void MqttfsApplyStop(struct Connection* connection);
+size_t MqttfsApplyDuplicates(void);
+
+void MqttfsSubscribe(struct Context* context, struct Node* dir,
+                     const char* name);
+void MqttfsEvict(struct Context* context);
+_Bool MqttfsRefetch(struct Context* context, struct Node* node);
+void MqttfsRefilled(struct Context* context);
+
+_Bool MqttfsSnapshotLoad(struct Context* context);
+_Bool MqttfsSnapshotStart(struct Context* context);
+void MqttfsSnapshotStop(struct Context* context);
+
+_Bool MqttfsIsEvents(fuse_ino_t ino);
+void MqttfsEventsStat(const struct Node* dir, struct stat* stbuf);
+void MqttfsEventsEntry(struct Context* context, struct Node* dir,
+                       struct fuse_entry_param* entry);
+void MqttfsEventsPublish(struct Context* context, const struct Node* node,
+                         const struct Str* topic);
+void MqttfsEventsOpen(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info* fi);
+void MqttfsEventsRead(fuse_req_t req, size_t size, struct fuse_file_info* fi);
+void MqttfsEventsPoll(fuse_req_t req, struct fuse_file_info* fi,
+                      struct fuse_pollhandle* ph);
+void MqttfsEventsRelease(fuse_req_t req, struct fuse_file_info* fi);
+
+_Bool MqttfsIsAll(fuse_ino_t ino);
+void MqttfsAllStat(const struct Node* dir, struct stat* stbuf);
+void MqttfsAllEntry(struct Context* context, struct Node* dir,
+                    struct fuse_entry_param* entry);
+void MqttfsAllOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsAllRead(fuse_req_t req, size_t size, off_t off,
+                   struct fuse_file_info* fi);
+void MqttfsAllPoll(fuse_req_t req, struct fuse_pollhandle* ph);
+void MqttfsAllRelease(fuse_req_t req, struct fuse_file_info* fi);
+
+_Bool MqttfsStreamOpen(struct Context* context, struct Node* node,
+                       struct Handle* handle);
+void MqttfsStreamPublish(struct Node* node);
+void MqttfsStreamRead(fuse_req_t req, size_t size, struct fuse_file_info* fi);
+void MqttfsStreamPoll(fuse_req_t req, struct fuse_file_info* fi,
+                      struct fuse_pollhandle* ph);
+void MqttfsStreamRelease(struct Context* context, struct Handle* handle);
+size_t MqttfsStreamDropped(void);
+
+// mburakov: Clock is in microseconds. Operations are timed from the provided
+// start. Root lock must only be taken with the functions below, which time
+// waiting for and holding it, and return the pthread error.
+int64_t MqttfsStatsClock(void);
+void MqttfsStatsOp(enum MqttfsOp op, int64_t start);
+int MqttfsLockShared(struct Context* context);
+int MqttfsLockExclusive(struct Context* context);
+void MqttfsUnlock(struct Context* context);
+_Bool MqttfsIsStats(fuse_ino_t ino);
+void MqttfsStatsStat(const struct Node* root, struct stat* stbuf);
+void MqttfsStatsEntry(struct Context* context, struct fuse_entry_param* entry);
+void MqttfsStatsOpen(fuse_req_t req, struct fuse_file_info* fi);
+void MqttfsStatsRead(fuse_req_t req, size_t size, off_t off,
+                     struct fuse_file_info* fi);
+void MqttfsStatsPoll(fuse_req_t req, struct fuse_pollhandle* ph);
+void MqttfsStatsRelease(fuse_req_t req, struct fuse_file_info* fi);
+
+void MqttfsLookup(fuse_req_t req, fuse_ino_t parent, const char* name);
+void MqttfsForget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+void MqttfsForgetMulti(fuse_req_t req, size_t count,
+                       struct fuse_forget_data* forgets);
+void MqttfsGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsSetattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                   int to_set, struct fuse_file_info* fi);
+void MqttfsMkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+                 mode_t mode);
+void MqttfsUnlink(fuse_req_t req, fuse_ino_t parent, const char* name);
+void MqttfsRename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                  fuse_ino_t newparent, const char* newname,
+                  unsigned int flags);
+void MqttfsOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                 struct fuse_file_info* fi);
-int MqttfsOpendir(const char* path, struct fuse_file_info* fi);
-int MqttfsReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info* fi,
-                  enum fuse_readdir_flags flags);
-int MqttfsCreate(const char* path, mode_t mode, struct fuse_file_info* fi);
-int MqttfsUtimens(const char* path, const struct timespec tv[2],
-                  struct fuse_file_info* fi);
-int MqttfsPoll(const char* path, struct fuse_file_info* fi,
-               struct fuse_pollhandle* ph, unsigned* reventsp);
+void MqttfsWrite(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+                 off_t off, struct fuse_file_info* fi);
+void MqttfsFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsFsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                 struct fuse_file_info* fi);
+void MqttfsRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void MqttfsReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info* fi);
+void MqttfsCreate(fuse_req_t req, fuse_ino_t parent, const char* name,
+                  mode_t mode, struct fuse_file_info* fi);
+void MqttfsPoll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+                struct fuse_pollhandle* ph);
+void MqttfsGetxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+                    size_t size);
 
 #endif  // MQTTFS_MQTTFS_H_
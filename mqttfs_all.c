@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <poll.h>
+#include <pthread.h>
+#include <search.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+
+#include "atom.h"
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+#include "str.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#ifndef LENGTH
+#define LENGTH(op) (sizeof(op) / sizeof *(op))
+#endif  // LENGTH
+
+// mburakov: Every directory has a virtual all file, that returns every topic
+// below the directory along with its payload in one go. Each topic is preceded
+// by a line with sizes of its path, relative to the directory, and its payload.
+// Paths are collected and payloads are pinned once on open, so that reads at
+// any offset return the same consistent snapshot. Payloads are not copied, and
+// every read formats just the records it covers.
+
+struct AllEntry {
+  size_t offset;
+  size_t path_offset;
+  size_t path_size;
+  struct Payload* payload;
+};
+
+struct AllBuffer {
+  char* data;
+  size_t size;
+  size_t alloc;
+};
+
+struct AllClosure {
+  struct timespec now;
+  // mburakov: Path of the directory being visited, and paths of all the files.
+  struct AllBuffer path;
+  struct AllBuffer paths;
+  struct AllEntry* entries;
+  size_t count;
+  size_t alloc;
+  _Bool failed;
+};
+
+struct All {
+  struct AllEntry* entries;
+  size_t count;
+  char* paths;
+  size_t size;
+};
+
+// mburakov: musl does not implement twalk_r. Readers run concurrently, so
+// closure has to be thread local.
+static thread_local struct AllClosure* g_twalk_closure;
+
+_Bool MqttfsIsAll(fuse_ino_t ino) { return !!(ino & MQTTFS_ALL_TAG); }
+
+void MqttfsAllStat(const struct Node* dir, struct stat* stbuf) {
+  // mburakov: Size is unknown until assembled, so it is read with direct io.
+  MqttfsStat(dir, stbuf);
+  stbuf->st_ino = dir->ino | (UINT64_C(1) << 61);
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = 0;
+}
+
+void MqttfsAllEntry(struct Context* context, struct Node* dir,
+                    struct fuse_entry_param* entry) {
+  // mburakov: Kernel references to the all file keep its directory around.
+  memset(entry, 0, sizeof(struct fuse_entry_param));
+  entry->ino = MqttfsIno(context, dir) | MQTTFS_ALL_TAG;
+  entry->attr_timeout = context->options.attr_timeout;
+  entry->entry_timeout = context->options.entry_timeout;
+  MqttfsAllStat(dir, &entry->attr);
+  atomic_fetch_add(&dir->nlookup, 1);
+}
+
+static _Bool Append(struct AllBuffer* buffer, const void* data, size_t size) {
+  if (!size) return 1;
+  if (buffer->size + size > buffer->alloc) {
+    size_t alloc = buffer->alloc ? buffer->alloc : 4096;
+    while (alloc < buffer->size + size) alloc *= 2;
+    char* buffer_data = realloc(buffer->data, alloc);
+    if (!buffer_data) {
+      LOG(ERR, "failed to reallocate buffer: %s", strerror(errno));
+      return 0;
+    }
+    buffer->data = buffer_data;
+    buffer->alloc = alloc;
+  }
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+  return 1;
+}
+
+static _Bool AppendPath(struct AllClosure* closure, struct AllBuffer* buffer,
+                        const struct Str* name) {
+  return Append(buffer, closure->path.data, closure->path.size) &&
+         (!closure->path.size || Append(buffer, "/", 1)) &&
+         Append(buffer, name->data, name->size);
+}
+
+static _Bool AppendEntry(struct AllClosure* closure, struct Node* node) {
+  if (closure->count == closure->alloc) {
+    size_t alloc = closure->alloc ? closure->alloc * 2 : 256;
+    struct AllEntry* entries =
+        realloc(closure->entries, alloc * sizeof(struct AllEntry));
+    if (!entries) {
+      LOG(ERR, "failed to reallocate entries: %s", strerror(errno));
+      return 0;
+    }
+    closure->entries = entries;
+    closure->alloc = alloc;
+  }
+  size_t path_offset = closure->paths.size;
+  if (!AppendPath(closure, &closure->paths, &node->name->str)) return 0;
+  closure->entries[closure->count++] = (struct AllEntry){
+      .path_offset = path_offset,
+      .path_size = closure->paths.size - path_offset,
+      .payload = PayloadAcquire(node->payload),
+  };
+  NodeSetAtime(node, &closure->now);
+  return 1;
+}
+
+static void OnVisit(const void* nodep, VISIT which, int depth) {
+  (void)depth;
+
+  // mburakov: Children are visited in order, and each directory is descended
+  // into right away, with its name appended to the current path meanwhile.
+  struct AllClosure* closure = g_twalk_closure;
+  if (which == preorder || which == endorder || closure->failed) return;
+  struct Node* node = *(void* const*)nodep;
+  if (!node->is_dir) {
+    if (node->payload && !AppendEntry(closure, node)) closure->failed = 1;
+    return;
+  }
+
+  size_t path_size = closure->path.size;
+  const struct Str* name = &node->name->str;
+  if ((path_size && !Append(&closure->path, "/", 1)) ||
+      !Append(&closure->path, name->data, name->size)) {
+    closure->failed = 1;
+    return;
+  }
+  twalk(node->children, OnVisit);
+  closure->path.size = path_size;
+}
+
+static void ReleaseEntries(struct AllClosure* closure) {
+  for (size_t index = 0; index < closure->count; index++)
+    PayloadRelease(closure->entries[index].payload);
+  free(closure->entries);
+  free(closure->path.data);
+  free(closure->paths.data);
+}
+
+static size_t FormatHeader(const struct AllEntry* entry, char* buffer,
+                           size_t size) {
+  int result = snprintf(buffer, size, "%zu %zu\n", entry->path_size,
+                        entry->payload->size);
+  return result > 0 ? (size_t)result : 0;
+}
+
+static void Layout(struct AllClosure* closure, struct All* all) {
+  // mburakov: Records are laid out one after another, so that a read could
+  // find the first one it covers by offset.
+  char header[48];
+  all->size = 0;
+  for (size_t index = 0; index < closure->count; index++) {
+    struct AllEntry* entry = closure->entries + index;
+    entry->offset = all->size;
+    all->size += FormatHeader(entry, header, sizeof(header)) +
+                 entry->path_size + entry->payload->size;
+  }
+  all->entries = closure->entries;
+  all->count = closure->count;
+  all->paths = closure->paths.data;
+  free(closure->path.data);
+}
+
+void MqttfsAllOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  struct AllClosure closure = {.failed = 0};
+  if (clock_gettime(CLOCK_REALTIME, &closure.now) == -1) {
+    LOG(ERR, "failed to get clock: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  struct All* all = malloc(sizeof(struct All));
+  if (!all) {
+    LOG(ERR, "failed to allocate all: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    free(all);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  // mburakov: Only a single pass over the subtree is made under the root lock,
+  // which collects paths and pins payloads.
+  struct Node* dir = MqttfsNode(context, ino);
+  MqttfsSubscribe(context, dir, NULL);
+  g_twalk_closure = &closure;
+  twalk(dir->children, OnVisit);
+  MqttfsUnlock(context);
+  if (closure.failed) {
+    LOG(ERR, "failed to collect all");
+    goto rollback_twalk;
+  }
+  Layout(&closure, all);
+  fi->fh = (uint64_t)(uintptr_t)all;
+  fi->direct_io = 1;
+  fuse_reply_open(req, fi);
+  return;
+
+rollback_twalk:
+  ReleaseEntries(&closure);
+  free(all);
+  fuse_reply_err(req, EIO);
+}
+
+void MqttfsAllRead(fuse_req_t req, size_t size, off_t off,
+                   struct fuse_file_info* fi) {
+  const struct All* all = (const struct All*)(uintptr_t)fi->fh;
+  size_t offset = MIN((size_t)off, all->size);
+  size = MIN(size, all->size - offset);
+  char* buffer = malloc(size ? size : 1);
+  if (!buffer) {
+    LOG(ERR, "failed to allocate all buffer: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  size_t first = 0;
+  for (size_t last = all->count; last - first > 1;) {
+    size_t middle = first + (last - first) / 2;
+    if (all->entries[middle].offset <= offset)
+      first = middle;
+    else
+      last = middle;
+  }
+  size_t total = 0;
+  for (size_t index = first; index < all->count && total < size; index++) {
+    const struct AllEntry* entry = all->entries + index;
+    char header[48];
+    const struct Str parts[] = {
+        {.size = FormatHeader(entry, header, sizeof(header)), .data = header},
+        {.size = entry->path_size, .data = all->paths + entry->path_offset},
+        {.size = entry->payload->size, .data = entry->payload->data},
+    };
+    size_t skip = offset + total - entry->offset;
+    for (size_t part = 0; part < LENGTH(parts) && total < size; part++) {
+      if (skip >= parts[part].size) {
+        skip -= parts[part].size;
+        continue;
+      }
+      size_t take = MIN(parts[part].size - skip, size - total);
+      memcpy(buffer + total, parts[part].data + skip, take);
+      total += take;
+      skip = 0;
+    }
+  }
+  fuse_reply_buf(req, buffer, total);
+  free(buffer);
+}
+
+void MqttfsAllPoll(fuse_req_t req, struct fuse_pollhandle* ph) {
+  // mburakov: Contents never change after being opened.
+  if (ph) fuse_pollhandle_destroy(ph);
+  fuse_reply_poll(req, POLLIN);
+}
+
+void MqttfsAllRelease(fuse_req_t req, struct fuse_file_info* fi) {
+  struct All* all = (struct All*)(uintptr_t)fi->fh;
+  for (size_t index = 0; index < all->count; index++)
+    PayloadRelease(all->entries[index].payload);
+  free(all->entries);
+  free(all->paths);
+  free(all);
+  fuse_reply_err(req, 0);
+}
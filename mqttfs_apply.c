@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+#include "queue.h"
+#include "str.h"
+#include "tree.h"
+
+// mburakov: IO threads do not apply received messages to the tree. Those only
+// copy messages into the queue of their connection, and get back to draining
+// the socket right away, regardless of readers holding the root lock. Every
+// connection has an apply thread, which drains its queue in batches, and takes
+// the root lock once per batch. Within a batch only the newest message of each
+// topic is applied, unless there are open streams, which see every message.
+
+// mburakov: Optionally, messages repeating the current payload of their topic
+// are dropped altogether, apart from refreshing the epoch. Also optionally,
+// pollers of any topic are woken up at most once per notify interval. Updates
+// arriving sooner than that are applied, but leave the node deferred, and the
+// apply thread wakes up its pollers once the interval has passed.
+
+// mburakov: Most messages are tiny, but this still fits a lot of those. Larger
+// messages are copied into separate allocations.
+#define APPLY_QUEUE_SIZE (1 << 20)
+#define APPLY_INLINE_MAX (APPLY_QUEUE_SIZE / 4)
+
+struct Update {
+  uint64_t epoch;
+  size_t topic_size;
+  size_t payload_size;
+  char* spill;
+  char data[];
+};
+
+struct Apply {
+  struct Connection* connection;
+  struct Queue queue;
+  pthread_t thread;
+  // mburakov: Deferred nodes and the earliest deadline among those, or zero.
+  // Both are protected by the root lock.
+  struct Node* deferred;
+  int64_t deadline;
+};
+
+struct Invalidation {
+  fuse_ino_t ino;
+  fuse_ino_t parent;
+  size_t name_len;
+  char name[NAME_MAX + 1];
+};
+
+static atomic_size_t g_apply_duplicates;
+
+static size_t UpdateSize(const struct Update* update) {
+  // mburakov: Records are kept aligned, so that headers could be accessed in
+  // place. Ring size is a multiple of this alignment.
+  size_t size = sizeof(struct Update);
+  if (!update->spill) size += update->topic_size + update->payload_size;
+  return (size + _Alignof(struct Update) - 1) &
+         ~(_Alignof(struct Update) - 1);
+}
+
+static const char* UpdateData(const struct Update* update) {
+  return update->spill ? update->spill : update->data;
+}
+
+void MqttfsApplyMessage(void* user, const struct Str* topic,
+                        const void* payload, size_t payload_len) {
+  // mburakov: Epoch is only ever changed by the IO thread that calls this, so
+  // it is recorded with the message to be applied later.
+  struct Connection* connection = user;
+  struct Update header = {
+      .epoch = connection->epoch,
+      .topic_size = topic->size,
+      .payload_size = payload_len,
+      .spill = NULL,
+  };
+  if (topic->size + payload_len > APPLY_INLINE_MAX) {
+    header.spill = malloc(topic->size + payload_len);
+    if (!header.spill) {
+      LOG(ERR, "failed to allocate spilled message: %s", strerror(errno));
+      return;
+    }
+  }
+
+  size_t size = UpdateSize(&header);
+  struct Update* update = QueueWritable(&connection->apply->queue, size);
+  if (!update) {
+    LOG(ERR, "failed to queue message");
+    free(header.spill);
+    return;
+  }
+  *update = header;
+  char* data = header.spill ? header.spill : update->data;
+  memcpy(data, topic->data, topic->size);
+  if (payload_len) memcpy(data + topic->size, payload, payload_len);
+  QueueCommit(&connection->apply->queue, size);
+}
+
+static void Collapse(const struct Str* topics, size_t count,
+                     _Bool* superseded) {
+  // mburakov: Batch is walked from the newest message, and older messages of
+  // topics that were seen already are superseded. Slots hold indices plus one.
+  enum { kSlots = 256 };
+  unsigned char slots[kSlots] = {0};
+  for (size_t index = count; index--;) {
+    const struct Str* topic = topics + index;
+    size_t slot = HashBytes(topic->data, topic->size) & (kSlots - 1);
+    superseded[index] = 0;
+    for (; slots[slot]; slot = (slot + 1) & (kSlots - 1)) {
+      if (StrCompare(topics + slots[slot] - 1, topic)) continue;
+      superseded[index] = 1;
+      break;
+    }
+    if (!superseded[index]) slots[slot] = (unsigned char)(index + 1);
+  }
+}
+
+static _Bool IsDuplicate(const struct Node* node, const void* payload,
+                         size_t payload_size) {
+  // mburakov: Evicted nodes have no payload, and are refilled by any message.
+  // Payloads written through the mount are yet to be announced by their echo.
+  if (node->committed || !node->payload || node->payload->size != payload_size)
+    return 0;
+  return !payload_size || !memcmp(node->payload->data, payload, payload_size);
+}
+
+static void Notify(struct Apply* apply, struct Node* node, int64_t now) {
+  // mburakov: Deferred nodes are woken up by the apply thread regardless.
+  if (!node->pollers || node->deferred_prev) return;
+  int64_t interval = (int64_t)apply->connection->context->options.notify * 1000;
+  if (interval && now - node->notified < interval) {
+    NodeDefer(&apply->deferred, node);
+    int64_t deadline = node->notified + interval;
+    if (!apply->deadline || deadline < apply->deadline)
+      apply->deadline = deadline;
+    return;
+  }
+  node->notified = now;
+  NodeNotify(node);
+}
+
+static void NotifyDeferred(struct Apply* apply, int64_t now) {
+  if (!apply->deadline || now < apply->deadline) return;
+  int64_t interval = (int64_t)apply->connection->context->options.notify * 1000;
+  apply->deadline = 0;
+  for (struct Node* node = apply->deferred; node;) {
+    struct Node* next = node->deferred;
+    int64_t deadline = node->notified + interval;
+    if (deadline <= now) {
+      NodeUndefer(node);
+      node->notified = now;
+      NodeNotify(node);
+    } else if (!apply->deadline || deadline < apply->deadline) {
+      apply->deadline = deadline;
+    }
+    node = next;
+  }
+}
+
+static _Bool ApplyUpdate(struct Connection* connection,
+                         const struct Update* update, const struct Str* topic,
+                         int64_t now, struct Invalidation* inval) {
+  // mburakov: In cached mode the kernel has to be told about changes, but only
+  // after the root lock is released. Invalidating pages waits for the reads in
+  // flight, and those might in turn be waiting for the root lock.
+  struct Context* context = connection->context;
+  inval->ino = 0;
+  inval->parent = 0;
+  inval->name_len = 0;
+
+  // mburakov: Walk the topic segment by segment. Some parent directory nodes
+  // might be missing, and have to be created on the way. The first created
+  // node is remembered, so that everything could be rolled back on failure.
+  struct Node* node = context->tree.root;
+  struct Node* created = NULL;
+  const char* end = topic->data + topic->size;
+  for (const char* ptr = topic->data;; ptr++) {
+    const char* separator = memchr(ptr, '/', (size_t)(end - ptr));
+    struct Str name = {
+        .size = (size_t)((separator ? separator : end) - ptr),
+        .data = ptr,
+    };
+
+    struct Node* parent = node;
+    node = TreeLookup(&context->tree, parent, &name);
+    if (!node) {
+      node = TreeCreate(&context->tree, parent, &name, !!separator);
+      if (!node) {
+        LOG(ERR, "failed to create node");
+        node = parent;
+        goto rollback_tree_create;
+      }
+      if (!created) {
+        // mburakov: Only the first created node could have been looked up by
+        // the kernel, and only if its parent is known to the kernel at all.
+        created = node;
+        if (context->options.cache && name.size <= NAME_MAX &&
+            (parent == context->tree.root || atomic_load(&parent->nlookup))) {
+          inval->parent = MqttfsIno(context, parent);
+          memcpy(inval->name, name.data, name.size);
+          inval->name[name.size] = 0;
+          inval->name_len = name.size;
+        }
+      }
+    } else if (separator && !node->is_dir) {
+      LOG(ERR, "parent node is not a directory");
+      goto rollback_tree_create;
+    } else if (!separator && node->is_dir) {
+      LOG(ERR, "node is a directory");
+      goto rollback_tree_create;
+    }
+
+    if (!separator) break;
+    ptr = separator;
+  }
+
+  const char* payload = topic->data + topic->size;
+  if (context->options.dedup &&
+      IsDuplicate(node, payload, update->payload_size)) {
+    atomic_fetch_add_explicit(&g_apply_duplicates, 1, memory_order_relaxed);
+    node->epoch = update->epoch;
+    node->connection = (uint8_t)(connection - context->connections);
+    return 0;
+  }
+  _Bool refilled = node->evicted;
+  if (!NodeUpdate(node, payload, update->payload_size)) {
+    LOG(ERR, "failed to update node");
+    goto rollback_tree_create;
+  }
+  if (refilled) MqttfsRefilled(context);
+  node->epoch = update->epoch;
+  node->connection = (uint8_t)(connection - context->connections);
+  Notify(connection->apply, node, now);
+  MqttfsEventsPublish(context, node, topic);
+  MqttfsStreamPublish(node);
+  if (context->options.cache && atomic_load(&node->nlookup))
+    inval->ino = MqttfsIno(context, node);
+  return inval->ino || inval->parent;
+
+rollback_tree_create:
+  // mburakov: Created nodes form a chain, so those are removed bottom-up.
+  inval->parent = 0;
+  while (created) {
+    struct Node* parent = node->parent;
+    TreeRemove(&context->tree, node);
+    if (node == created) break;
+    node = parent;
+  }
+  return 0;
+}
+
+static size_t ApplyBatch(struct Connection* connection, const char* data,
+                         size_t size) {
+  enum { kBatchSize = 64 };
+  struct Context* context = connection->context;
+  const struct Update* updates[kBatchSize];
+  struct Str topics[kBatchSize];
+  _Bool superseded[kBatchSize];
+  size_t count = 0;
+  size_t offset = 0;
+  for (; count < kBatchSize && offset < size; count++) {
+    const struct Update* update = (const void*)(data + offset);
+    updates[count] = update;
+    topics[count] = (struct Str){
+        .size = update->topic_size,
+        .data = UpdateData(update),
+    };
+    offset += UpdateSize(update);
+  }
+  Collapse(topics, count, superseded);
+
+  struct Invalidation invals[kBatchSize];
+  size_t invals_count = 0;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    goto rollback_collapse;
+  }
+
+  int64_t locked = MqttfsStatsClock();
+  context->messages += count;
+  _Bool collapse = !context->streams;
+  for (size_t index = 0; index < count; index++) {
+    if (collapse && superseded[index]) continue;
+    if (ApplyUpdate(connection, updates[index], topics + index, locked,
+                    invals + invals_count))
+      invals_count++;
+  }
+  NotifyDeferred(connection->apply, locked);
+  MqttfsEvict(context);
+  MqttfsUnlock(context);
+
+  // mburakov: Kernel might have forgotten the nodes in the meantime, which is
+  // reported as ENOENT, and is fine.
+  for (size_t index = 0; index < invals_count; index++) {
+    const struct Invalidation* inval = invals + index;
+    if (inval->parent) {
+      int result = fuse_lowlevel_notify_inval_entry(
+          context->session, inval->parent, inval->name, inval->name_len);
+      if (result && result != -ENOENT)
+        LOG(WARNING, "failed to invalidate entry: %s", strerror(-result));
+    }
+    if (inval->ino) {
+      int result = fuse_lowlevel_notify_inval_inode(context->session,
+                                                    inval->ino, 0, 0);
+      if (result && result != -ENOENT)
+        LOG(WARNING, "failed to invalidate inode: %s", strerror(-result));
+    }
+  }
+
+rollback_collapse:
+  for (size_t index = 0; index < count; index++) free(updates[index]->spill);
+  return offset;
+}
+
+static void ApplyTimeout(struct Connection* connection) {
+  struct Context* context = connection->context;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return;
+  }
+  NotifyDeferred(connection->apply, MqttfsStatsClock());
+  MqttfsUnlock(context);
+}
+
+static void* ApplyThread(void* user) {
+  struct Connection* connection = user;
+  struct Apply* apply = connection->apply;
+  for (;;) {
+    // mburakov: Deadline is only changed by this thread, so it is fine to read
+    // it without the root lock.
+    size_t size;
+    const char* data = QueueReadable(&apply->queue, &size, apply->deadline);
+    if (data) {
+      QueueConsume(&apply->queue, ApplyBatch(connection, data, size));
+      continue;
+    }
+    if (QueueClosed(&apply->queue)) break;
+    ApplyTimeout(connection);
+  }
+  return NULL;
+}
+
+_Bool MqttfsApplyStart(struct Connection* connection) {
+  struct Apply* apply = malloc(sizeof(struct Apply));
+  if (!apply) {
+    LOG(ERR, "failed to allocate apply: %s", strerror(errno));
+    return 0;
+  }
+  apply->connection = connection;
+  apply->deferred = NULL;
+  apply->deadline = 0;
+  if (!QueueInit(&apply->queue, APPLY_QUEUE_SIZE)) {
+    LOG(ERR, "failed to initialize apply queue");
+    goto rollback_malloc;
+  }
+  connection->apply = apply;
+  int error = pthread_create(&apply->thread, NULL, ApplyThread, connection);
+  if (error) {
+    LOG(ERR, "failed to create apply thread: %s", strerror(error));
+    goto rollback_queue_init;
+  }
+  return 1;
+
+rollback_queue_init:
+  connection->apply = NULL;
+  QueueDestroy(&apply->queue);
+rollback_malloc:
+  free(apply);
+  return 0;
+}
+
+void MqttfsApplyStop(struct Connection* connection) {
+  // mburakov: Nothing is queued after the IO thread is gone, and whatever was
+  // queued before is still applied. Deferred nodes are left to be destroyed
+  // with the tree, so those are unlinked from the list being freed.
+  struct Apply* apply = connection->apply;
+  if (!apply) return;
+  QueueClose(&apply->queue);
+  pthread_join(apply->thread, NULL);
+  while (apply->deferred) NodeUndefer(apply->deferred);
+  QueueDestroy(&apply->queue);
+  free(apply);
+  connection->apply = NULL;
+}
+
+size_t MqttfsApplyDuplicates(void) {
+  return atomic_load_explicit(&g_apply_duplicates, memory_order_relaxed);
+}
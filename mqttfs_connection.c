@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atom.h"
+#include "hash.h"
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "str.h"
+
+// mburakov: Topics are spread across connections by their top-level segment.
+// This way each connection is subscribed to its own part of the tree, and all
+// the messages of any given topic go through the same connection in order.
+// Topics are also published over the connection subscribed to them, so that
+// echoes come back the same way. Filters starting with a wildcard would match
+// topics of every connection, and are not allowed with more than one.
+
+static size_t ConnectionIndex(const struct Context* context, const char* data,
+                              size_t size) {
+  if (context->options.connections == 1) return 0;
+  const char* separator = memchr(data, '/', size);
+  if (separator) size = (size_t)(separator - data);
+  return HashBytes(data, size) % context->options.connections;
+}
+
+struct Connection* MqttfsConnection(struct Context* context,
+                                    const struct Str* topic) {
+  return context->connections +
+         ConnectionIndex(context, topic->data, topic->size);
+}
+
+struct Connection* MqttfsNodeConnection(struct Context* context,
+                                        const struct Node* node) {
+  // mburakov: Root node and removed nodes have no topic, so those are owned by
+  // the first connection.
+  while (node->parent && node->parent != context->tree.root)
+    node = node->parent;
+  if (!node->parent) return context->connections;
+  return MqttfsConnection(context, &node->name->str);
+}
+
+char* MqttfsConnectionFilters(const struct Context* context, size_t index) {
+  // mburakov: Filters of every connection are picked out of the configured
+  // ones, and are formatted the same way.
+  const char* filters = context->options.subscribe;
+  char* result = malloc(strlen(filters) + 1);
+  if (!result) {
+    LOG(ERR, "failed to allocate filters: %s", strerror(errno));
+    return NULL;
+  }
+  size_t size = 0;
+  for (const char* ptr = filters;;) {
+    const char* separator = strchr(ptr, ',');
+    size_t length = separator ? (size_t)(separator - ptr) : strlen(ptr);
+    if (length && ConnectionIndex(context, ptr, length) == index) {
+      if (size) result[size++] = ',';
+      memcpy(result + size, ptr, length);
+      size += length;
+    }
+    if (!separator) break;
+    ptr = separator + 1;
+  }
+  result[size] = 0;
+  return result;
+}
@@ -16,59 +16,63 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <threads.h>
 
+#include "handle.h"
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
 #include "str.h"
+#include "tree.h"
 
-int MqttfsCreate(const char* path, mode_t mode, struct fuse_file_info* fi) {
+void MqttfsCreate(fuse_req_t req, fuse_ino_t parent, const char* name,
+                  mode_t mode, struct fuse_file_info* fi) {
   (void)mode;
 
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock root mutex");
-    return -EIO;
+  struct Context* context = fuse_req_userdata(req);
+  if (!MqttfsOpenHandle(context, 0, fi)) {
+    fuse_reply_err(req, EIO);
+    return;
   }
-
   int result;
-  struct Str path_view = StrView(path + 1);
-  void** nodep = tsearch(&path_view, &context->root_node, NodeCompare);
-  if (!nodep) {
-    LOG(ERR, "failed to search node: %s", strerror(errno));
-    result = -EIO;
-    goto rollback_mtx_lock;
-  }
-  if (*nodep != &path_view) {
-    result = -EEXIST;
-    goto rollback_mtx_lock;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    result = EIO;
+    goto rollback_open_handle;
   }
 
-  // TODO(mburakov): Should recursive creation be allowed?
-  // TODO(mburakov): Should parent node type be verified?
+  struct Node* parent_node = MqttfsNode(context, parent);
+  struct Str name_view = StrView(name);
+  if (TreeLookup(&context->tree, parent_node, &name_view)) {
+    result = EEXIST;
+    goto rollback_rwlock_wrlock;
+  }
 
-  struct Node* node = NodeCreate(&path_view, 0);
+  struct Node* node = TreeCreate(&context->tree, parent_node, &name_view, 0);
   if (!node) {
     LOG(ERR, "failed to create node");
-    result = -EIO;
-    goto rollback_tsearch;
+    result = EIO;
+    goto rollback_rwlock_wrlock;
   }
 
-  *nodep = node;
-  fi->fh = (uint64_t)node;
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  struct fuse_entry_param entry;
+  MqttfsEntry(context, node, &entry);
+  MqttfsUnlock(context);
+  if (context->options.cache)
+    fi->keep_cache = 1;
+  else
+    fi->direct_io = 1;
+  fuse_reply_create(req, &entry, fi);
+  return;
 
-rollback_tsearch:
-  tdelete(&path_view, &context->root_node, NodeCompare);
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+rollback_open_handle:
+  if (fi->fh) HandleDestroy((struct Handle*)(uintptr_t)fi->fh);
+  fuse_reply_err(req, result);
 }
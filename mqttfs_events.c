@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "str.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// mburakov: Events file streams a line with the topic name for every message
+// received anywhere under its directory. Reads block until there's something
+// to return, but without occupying a FUSE thread: the request is parked, and
+// replied to by the apply thread of the connection that received a message,
+// once it is applied to the tree. Every open events file is linked into the
+// context, and all of those are protected by the root lock.
+
+struct Events {
+  struct Node* dir;
+  struct Events* prev;
+  struct Events* next;
+  char* data;
+  size_t size;
+  size_t alloc;
+  _Bool overflow;
+  fuse_req_t req;
+  size_t req_size;
+  struct fuse_pollhandle* ph;
+};
+
+_Bool MqttfsIsEvents(fuse_ino_t ino) { return !!(ino & MQTTFS_EVENTS_TAG); }
+
+void MqttfsEventsStat(const struct Node* dir, struct stat* stbuf) {
+  // mburakov: Inode numbers of nodes are sequential, and never get that high.
+  MqttfsStat(dir, stbuf);
+  stbuf->st_ino = dir->ino | (UINT64_C(1) << 63);
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = 0;
+}
+
+void MqttfsEventsEntry(struct Context* context, struct Node* dir,
+                       struct fuse_entry_param* entry) {
+  // mburakov: Kernel references to the events file keep its directory around.
+  memset(entry, 0, sizeof(struct fuse_entry_param));
+  entry->ino = MqttfsIno(context, dir) | MQTTFS_EVENTS_TAG;
+  entry->attr_timeout = context->options.attr_timeout;
+  entry->entry_timeout = context->options.entry_timeout;
+  MqttfsEventsStat(dir, &entry->attr);
+  atomic_fetch_add(&dir->nlookup, 1);
+}
+
+static _Bool IsAncestor(const struct Node* dir, const struct Node* node) {
+  for (node = node->parent; node; node = node->parent) {
+    if (node == dir) return 1;
+  }
+  return 0;
+}
+
+static _Bool Append(struct Events* events, const struct Str* topic) {
+  // mburakov: Slow readers lose events instead of growing memory unbounded.
+  static const size_t kMaxSize = 1 << 20;
+  size_t size = topic->size + 1;
+  if (size > kMaxSize - events->size) {
+    if (!events->overflow) LOG(WARNING, "events stream overflowed");
+    events->overflow = 1;
+    return 0;
+  }
+  if (events->size + size > events->alloc) {
+    size_t alloc = events->alloc ? events->alloc : 4096;
+    while (alloc < events->size + size) alloc *= 2;
+    char* data = realloc(events->data, alloc);
+    if (!data) {
+      LOG(ERR, "failed to reallocate events: %s", strerror(errno));
+      return 0;
+    }
+    events->data = data;
+    events->alloc = alloc;
+  }
+  memcpy(events->data + events->size, topic->data, topic->size);
+  events->data[events->size + topic->size] = '\n';
+  events->size += size;
+  return 1;
+}
+
+static void Reply(struct Events* events, fuse_req_t req, size_t size) {
+  size = MIN(size, events->size);
+  fuse_reply_buf(req, events->data, size);
+  memmove(events->data, events->data + size, events->size - size);
+  events->size -= size;
+  if (!events->size) events->overflow = 0;
+}
+
+void MqttfsEventsPublish(struct Context* context, const struct Node* node,
+                         const struct Str* topic) {
+  for (struct Events* events = context->events; events;
+       events = events->next) {
+    if (!IsAncestor(events->dir, node) || !Append(events, topic)) continue;
+    if (events->req) {
+      Reply(events, events->req, events->req_size);
+      events->req = NULL;
+    } else if (events->ph) {
+      int result = fuse_lowlevel_notify_poll(events->ph);
+      if (result) LOG(WARNING, "failed to notify poll: %s", strerror(-result));
+      fuse_pollhandle_destroy(events->ph);
+      events->ph = NULL;
+    }
+  }
+}
+
+void MqttfsEventsOpen(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info* fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  struct Events* events = calloc(1, sizeof(struct Events));
+  if (!events) {
+    LOG(ERR, "failed to allocate events: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    free(events);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  events->dir = MqttfsNode(context, ino);
+  events->next = context->events;
+  if (context->events) context->events->prev = events;
+  context->events = events;
+  MqttfsUnlock(context);
+  fi->fh = (uint64_t)(uintptr_t)events;
+  fi->direct_io = 1;
+  fi->nonseekable = 1;
+  fuse_reply_open(req, fi);
+}
+
+static void OnInterrupt(fuse_req_t req, void* data) {
+  // mburakov: Interrupted request is looked up among the parked ones, because
+  // it might have been replied to, and its events file closed, meanwhile.
+  struct Context* context = data;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return;
+  }
+  for (struct Events* events = context->events; events;
+       events = events->next) {
+    if (events->req != req) continue;
+    events->req = NULL;
+    fuse_reply_err(req, EINTR);
+    break;
+  }
+  MqttfsUnlock(context);
+}
+
+void MqttfsEventsRead(fuse_req_t req, size_t size, struct fuse_file_info* fi) {
+  // mburakov: Interrupt callback is registered before taking the root lock,
+  // since it might be called right away, and it takes the lock itself.
+  struct Context* context = fuse_req_userdata(req);
+  fuse_req_interrupt_func(req, OnInterrupt, context);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  int result;
+  struct Events* events = (struct Events*)(uintptr_t)fi->fh;
+  if (events->size) {
+    Reply(events, req, size);
+    MqttfsUnlock(context);
+    return;
+  }
+  if (fi->flags & O_NONBLOCK) {
+    result = EAGAIN;
+    goto rollback_rwlock_wrlock;
+  }
+  if (events->req) {
+    result = EBUSY;
+    goto rollback_rwlock_wrlock;
+  }
+  if (fuse_req_interrupted(req)) {
+    result = EINTR;
+    goto rollback_rwlock_wrlock;
+  }
+  events->req = req;
+  events->req_size = size;
+  MqttfsUnlock(context);
+  return;
+
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
+}
+
+void MqttfsEventsPoll(fuse_req_t req, struct fuse_file_info* fi,
+                      struct fuse_pollhandle* ph) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    if (ph) fuse_pollhandle_destroy(ph);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct Events* events = (struct Events*)(uintptr_t)fi->fh;
+  unsigned revents = events->size ? POLLIN : 0;
+  if (ph) {
+    if (events->ph) fuse_pollhandle_destroy(events->ph);
+    events->ph = ph;
+  }
+  MqttfsUnlock(context);
+  fuse_reply_poll(req, revents);
+}
+
+void MqttfsEventsRelease(fuse_req_t req, struct fuse_file_info* fi) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    // mburakov: Events are still linked into the context, so those are leaked.
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct Events* events = (struct Events*)(uintptr_t)fi->fh;
+  if (events->prev)
+    events->prev->next = events->next;
+  else
+    context->events = events->next;
+  if (events->next) events->next->prev = events->prev;
+  MqttfsUnlock(context);
+  if (events->ph) fuse_pollhandle_destroy(events->ph);
+  free(events->data);
+  free(events);
+  fuse_reply_err(req, 0);
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "log.h"
+#include "mqtt.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+#include "str.h"
+
+// mburakov: Once payloads take more than the memory budget, the ones of the
+// topics that were neither read nor updated for the longest time are evicted,
+// until everything fits into seven eighths of the budget. This way a full scan
+// of the tree only happens once in a while, and not on every update. Pinned
+// payloads could keep it from getting there, and then the next scan waits for
+// payloads to grow by another eighth of the budget, or for a second to pass,
+// whichever comes first. Only payload bytes are
+// counted, and freed memory is not necessarily given back to the system.
+
+// mburakov: Evicted payloads are fetched again by subscribing to the exact
+// topic, upon which the broker sends the retained message once more. Whoever
+// needs the payload waits for that for a few seconds, and fails otherwise.
+
+struct Candidate {
+  long long used;
+  struct Node* node;
+};
+
+// mburakov: Resident size and time after the last scan that did not reach
+// the target, or zeros. Protected by the root lock, as is every eviction.
+static size_t g_evict_floor;
+static int64_t g_evict_scanned;
+
+static long long NodeUsed(const struct Node* node) {
+  struct timespec atime = NodeGetAtime(node);
+  long long result = (long long)atime.tv_sec * 1000000000ll + atime.tv_nsec;
+  long long mtime =
+      (long long)node->mtime.tv_sec * 1000000000ll + node->mtime.tv_nsec;
+  return result > mtime ? result : mtime;
+}
+
+static int CandidateCompare(const void* a, const void* b) {
+  const struct Candidate* candidate_a = a;
+  const struct Candidate* candidate_b = b;
+  return (candidate_a->used > candidate_b->used) -
+         (candidate_a->used < candidate_b->used);
+}
+
+void MqttfsEvict(struct Context* context) {
+  size_t budget = context->options.memory;
+  size_t resident = PayloadResident();
+  if (!budget || resident <= budget) return;
+  static const int64_t kEvictBackoff = 1000000;
+  int64_t now = MqttfsStatsClock();
+  if (g_evict_floor && resident < g_evict_floor + budget / 8 &&
+      now - g_evict_scanned < kEvictBackoff)
+    return;
+
+  const struct Hash* nodes = &context->tree.nodes;
+  struct Candidate* candidates = malloc(nodes->size * sizeof(struct Candidate));
+  if (!candidates) {
+    LOG(WARNING, "failed to allocate eviction candidates: %s",
+        strerror(errno));
+    return;
+  }
+  size_t count = 0;
+  for (size_t index = 0; index < nodes->alloc; index++) {
+    struct Node* node = nodes->slots[index].item;
+    if (!node || !node->payload) continue;
+    // mburakov: Pinned payloads would not be freed anyway, and in cached mode
+    // the kernel might still have the pages of the ones it knows about.
+    if (atomic_load_explicit(&node->payload->refs, memory_order_relaxed) > 1)
+      continue;
+    if (context->options.cache && atomic_load(&node->nlookup)) continue;
+    candidates[count++] = (struct Candidate){
+        .used = NodeUsed(node),
+        .node = node,
+    };
+  }
+
+  qsort(candidates, count, sizeof(struct Candidate), CandidateCompare);
+  size_t target = budget - budget / 8;
+  for (size_t index = 0; index < count && PayloadResident() > target; index++)
+    NodeEvict(candidates[index].node);
+  free(candidates);
+  resident = PayloadResident();
+  if (resident > target && !g_evict_floor)
+    LOG(WARNING, "%zu bytes of payloads are pinned over the budget", resident);
+  g_evict_floor = resident > target ? resident : 0;
+  g_evict_scanned = now;
+}
+
+static _Bool Subscribe(struct Context* context, const struct Node* node) {
+  static const int kRefetchIdle = 5000;
+  struct Str topic;
+  if (!NodePath(node, &topic)) {
+    LOG(ERR, "failed to get node path");
+    return 0;
+  }
+  struct Mqtt* mqtt = MqttfsConnection(context, &topic)->mqtt;
+  _Bool result = mqtt && MqttSubscribe(mqtt, &topic, kRefetchIdle);
+  StrFree(&topic);
+  return result;
+}
+
+_Bool MqttfsRefetch(struct Context* context, struct Node* node) {
+  // mburakov: Caller does not hold the root lock, so that the refetched payload
+  // could be applied meanwhile, but keeps the node referenced. Counter is read
+  // before checking the node, so that no refill is missed in between.
+  static const int kRefetchTimeout = 5;
+  struct timespec deadline;
+  if (clock_gettime(CLOCK_REALTIME, &deadline) == -1) {
+    LOG(ERR, "failed to get clock: %s", strerror(errno));
+    return 0;
+  }
+  deadline.tv_sec += kRefetchTimeout;
+  _Bool subscribed = 0;
+  for (;;) {
+    pthread_mutex_lock(&context->refetch_mutex);
+    uint64_t refetched = context->refetched;
+    pthread_mutex_unlock(&context->refetch_mutex);
+
+    int error = MqttfsLockShared(context);
+    if (error) {
+      LOG(ERR, "failed to lock root lock: %s", strerror(error));
+      return 0;
+    }
+    _Bool evicted = node->evicted;
+    if (evicted && !subscribed && node->parent)
+      subscribed = Subscribe(context, node);
+    MqttfsUnlock(context);
+    if (!evicted) return 1;
+    if (!subscribed) {
+      LOG(WARNING, "failed to subscribe for refetch");
+      return 0;
+    }
+
+    pthread_mutex_lock(&context->refetch_mutex);
+    while (!error && context->refetched == refetched) {
+      error = pthread_cond_timedwait(&context->refetch_cond,
+                                     &context->refetch_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&context->refetch_mutex);
+    if (error) {
+      LOG(WARNING, "timed out waiting for refetch");
+      return 0;
+    }
+  }
+}
+
+void MqttfsRefilled(struct Context* context) {
+  pthread_mutex_lock(&context->refetch_mutex);
+  context->refetched++;
+  pthread_cond_broadcast(&context->refetch_cond);
+  pthread_mutex_unlock(&context->refetch_mutex);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "handle.h"
+#include "log.h"
+#include "mqtt.h"
+#include "mqttfs.h"
+#include "node.h"
+
+// mburakov: Flush is called on every close of a file descriptor, and release
+// once the last one referencing the handle is gone. Buffered writes are
+// published on whichever comes first, and only once. Synchronous flush also
+// waits until everything published over the connection of the file is done,
+// and either one waits while the connection is not keeping up.
+
+static int FlushHandle(struct Context* context, fuse_ino_t ino,
+                       struct Handle* handle, _Bool sync) {
+  int error = pthread_mutex_lock(&handle->mutex);
+  if (error) {
+    LOG(ERR, "failed to lock handle mutex: %s", strerror(error));
+    return EIO;
+  }
+  if (!handle->dirty && !sync) {
+    pthread_mutex_unlock(&handle->mutex);
+    return 0;
+  }
+  error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    pthread_mutex_unlock(&handle->mutex);
+    return EIO;
+  }
+  struct Node* node = MqttfsNode(context, ino);
+  int result = handle->dirty ? MqttfsCommit(context, node, handle->data,
+                                            handle->size)
+                             : 0;
+  struct Mqtt* mqtt = MqttfsNodeConnection(context, node)->mqtt;
+  MqttfsUnlock(context);
+  if (!result) handle->dirty = 0;
+  pthread_mutex_unlock(&handle->mutex);
+  if (!result) MqttThrottle(mqtt);
+  if (!result && sync && !MqttFlush(mqtt)) result = EIO;
+  return result;
+}
+
+void MqttfsFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  if (MqttfsIsEvents(ino) || MqttfsIsStats(ino) || MqttfsIsAll(ino)) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  fuse_reply_err(req,
+                 FlushHandle(context, ino, handle, context->options.sync));
+}
+
+void MqttfsFsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                 struct fuse_file_info* fi) {
+  (void)datasync;
+  if (MqttfsIsEvents(ino) || MqttfsIsStats(ino) || MqttfsIsAll(ino)) {
+    fuse_reply_err(req, 0);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  fuse_reply_err(req, FlushHandle(context, ino, handle, 1));
+}
+
+void MqttfsRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  if (MqttfsIsEvents(ino)) {
+    MqttfsEventsRelease(req, fi);
+    return;
+  }
+  if (MqttfsIsStats(ino)) {
+    MqttfsStatsRelease(req, fi);
+    return;
+  }
+  if (MqttfsIsAll(ino)) {
+    MqttfsAllRelease(req, fi);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  int result = FlushHandle(context, ino, handle, context->options.sync);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    // mburakov: Handle might still be linked into pollers, so it is leaked.
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  if (handle->ph) NodeRemovePoller(MqttfsNode(context, ino), handle);
+  if (handle->stream) MqttfsStreamRelease(context, handle);
+  MqttfsUnlock(context);
+  HandleDestroy(handle);
+  fuse_reply_err(req, result);
+}
@@ -16,55 +16,53 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
-#include <stdlib.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
-#include "str.h"
-
-int MqttfsGetattr(const char* path, struct stat* stbuf,
-                  struct fuse_file_info* fi) {
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
-  }
-
-  int result;
-  struct Node* node;
-  if (fi) {
-    node = (struct Node*)fi->fh;
-  } else {
-    struct Str path_view = StrView(path + 1);
-    struct Node** nodep = tfind(&path_view, &context->root_node, NodeCompare);
-    if (!nodep) {
-      result = -ENOENT;
-      goto rollback_mtx_lock;
-    }
-    node = *nodep;
-  }
+#include "payload.h"
 
+void MqttfsStat(const struct Node* node, struct stat* stbuf) {
   memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = node->ino;
   if (node->is_dir) {
     stbuf->st_mode = S_IFDIR | 0755;
     stbuf->st_nlink = 2;
   } else {
     stbuf->st_mode = S_IFREG | 0644;
     stbuf->st_nlink = 1;
-    stbuf->st_size = (off_t)node->size;
+    stbuf->st_size = node->payload   ? (off_t)node->payload->size
+                     : node->evicted ? (off_t)node->evicted_size
+                                     : 0;
   }
-  stbuf->st_atim = node->atime;
+  stbuf->st_atim = NodeGetAtime(node);
   stbuf->st_mtim = node->mtime;
-  mtx_unlock(&context->root_mutex);
-  return 0;
+}
+
+void MqttfsGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  (void)fi;
+
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
 
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+  struct stat stbuf;
+  if (MqttfsIsStats(ino))
+    MqttfsStatsStat(context->tree.root, &stbuf);
+  else if (MqttfsIsEvents(ino))
+    MqttfsEventsStat(MqttfsNode(context, ino), &stbuf);
+  else if (MqttfsIsAll(ino))
+    MqttfsAllStat(MqttfsNode(context, ino), &stbuf);
+  else
+    MqttfsStat(MqttfsNode(context, ino), &stbuf);
+  MqttfsUnlock(context);
+  fuse_reply_attr(req, &stbuf, context->options.attr_timeout);
 }
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+
+static void ReplyValue(fuse_req_t req, const char* value, size_t value_size,
+                       size_t size) {
+  if (!size)
+    fuse_reply_xattr(req, value_size);
+  else if (size < value_size)
+    fuse_reply_err(req, ERANGE);
+  else
+    fuse_reply_buf(req, value, value_size);
+}
+
+static void GetResident(fuse_req_t req, size_t size) {
+  char value[32];
+  int value_size = snprintf(value, sizeof(value), "%zu", PayloadResident());
+  ReplyValue(req, value, (size_t)value_size, size);
+}
+
+void MqttfsGetxattr(fuse_req_t req, fuse_ino_t ino, const char* name,
+                    size_t size) {
+  if (ino == FUSE_ROOT_ID && !strcmp(name, MQTTFS_RESIDENT_XATTR)) {
+    GetResident(req, size);
+    return;
+  }
+  if (MqttfsIsEvents(ino) || MqttfsIsStats(ino) || MqttfsIsAll(ino) ||
+      strcmp(name, MQTTFS_STALE_XATTR)) {
+    fuse_reply_err(req, ENODATA);
+    return;
+  }
+
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  // mburakov: Directories are never refreshed on their own. Files are stale
+  // if the connection that last refreshed those has reconnected since.
+  const struct Node* node = MqttfsNode(context, ino);
+  _Bool is_dir = node->is_dir;
+  char value =
+      node->epoch == context->connections[node->connection].epoch ? '0' : '1';
+  MqttfsUnlock(context);
+  if (is_dir)
+    fuse_reply_err(req, ENODATA);
+  else
+    ReplyValue(req, &value, sizeof(value), size);
+}
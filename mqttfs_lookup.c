@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "str.h"
+#include "tree.h"
+
+// mburakov: Kernel node ids are node pointers, except for the root node, which
+// has a fixed id. Kernel holds a reference on every node id it knows about, so
+// the nodes behind those can not go away.
+
+struct Node* MqttfsNode(struct Context* context, fuse_ino_t ino) {
+  ino &= ~(fuse_ino_t)(MQTTFS_EVENTS_TAG | MQTTFS_STATS_TAG | MQTTFS_ALL_TAG);
+  return ino == FUSE_ROOT_ID ? context->tree.root
+                             : (struct Node*)(uintptr_t)ino;
+}
+
+fuse_ino_t MqttfsIno(struct Context* context, const struct Node* node) {
+  return node == context->tree.root ? FUSE_ROOT_ID
+                                    : (fuse_ino_t)(uintptr_t)node;
+}
+
+void MqttfsEntry(struct Context* context, struct Node* node,
+                 struct fuse_entry_param* entry) {
+  memset(entry, 0, sizeof(struct fuse_entry_param));
+  entry->ino = MqttfsIno(context, node);
+  entry->attr_timeout = context->options.attr_timeout;
+  entry->entry_timeout = context->options.entry_timeout;
+  MqttfsStat(node, &entry->attr);
+  atomic_fetch_add(&node->nlookup, 1);
+}
+
+void MqttfsLookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  int result;
+  struct fuse_entry_param entry;
+  struct Node* parent_node = MqttfsNode(context, parent);
+  if (!strcmp(name, MQTTFS_EVENTS_NAME)) {
+    MqttfsEventsEntry(context, parent_node, &entry);
+    MqttfsUnlock(context);
+    fuse_reply_entry(req, &entry);
+    return;
+  }
+  if (!strcmp(name, MQTTFS_ALL_NAME)) {
+    MqttfsAllEntry(context, parent_node, &entry);
+    MqttfsUnlock(context);
+    fuse_reply_entry(req, &entry);
+    return;
+  }
+  if (parent == FUSE_ROOT_ID && !strcmp(name, MQTTFS_STATS_NAME)) {
+    MqttfsStatsEntry(context, &entry);
+    MqttfsUnlock(context);
+    fuse_reply_entry(req, &entry);
+    return;
+  }
+
+  struct Str name_view = StrView(name);
+  struct Node* node = TreeLookup(&context->tree, parent_node, &name_view);
+  if (node && node->is_dir)
+    MqttfsSubscribe(context, node, NULL);
+  else if (node)
+    MqttfsSubscribe(context, parent_node, NULL);
+  else
+    MqttfsSubscribe(context, parent_node, name);
+  if (!node) {
+    if (!context->options.cache) {
+      result = ENOENT;
+      goto rollback_rwlock_rdlock;
+    }
+    // mburakov: In cached mode negative entries are cached by the kernel too.
+    // Topics appearing later invalidate those, see ApplyUpdate.
+    MqttfsUnlock(context);
+    memset(&entry, 0, sizeof(entry));
+    entry.entry_timeout = context->options.entry_timeout;
+    fuse_reply_entry(req, &entry);
+    return;
+  }
+
+  MqttfsEntry(context, node, &entry);
+  MqttfsUnlock(context);
+  fuse_reply_entry(req, &entry);
+  return;
+
+rollback_rwlock_rdlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
+}
+
+void MqttfsForget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    // mburakov: Forget has no reply, so the node is leaked.
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_none(req);
+    return;
+  }
+
+  TreeForget(&context->tree, MqttfsNode(context, ino), nlookup);
+  MqttfsUnlock(context);
+  fuse_reply_none(req);
+}
+
+void MqttfsForgetMulti(fuse_req_t req, size_t count,
+                       struct fuse_forget_data* forgets) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    // mburakov: Forget has no reply, so the nodes are leaked.
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_none(req);
+    return;
+  }
+
+  for (size_t index = 0; index < count; index++) {
+    TreeForget(&context->tree, MqttfsNode(context, forgets[index].ino),
+               forgets[index].nlookup);
+  }
+  MqttfsUnlock(context);
+  fuse_reply_none(req);
+}
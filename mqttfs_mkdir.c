@@ -16,57 +16,51 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
-#include <stdlib.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
 #include "str.h"
+#include "tree.h"
 
-int MqttfsMkdir(const char* path, mode_t mode) {
+void MqttfsMkdir(fuse_req_t req, fuse_ino_t parent, const char* name,
+                 mode_t mode) {
   (void)mode;
 
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
   }
 
   int result;
-  struct Str path_view = StrView(path + 1);
-  void** nodep = tsearch(&path_view, &context->root_node, NodeCompare);
-  if (!nodep) {
-    LOG(ERR, "failed to search node: %s", strerror(errno));
-    result = -EIO;
-    goto rollback_mtx_lock;
+  struct Node* parent_node = MqttfsNode(context, parent);
+  struct Str name_view = StrView(name);
+  if (TreeLookup(&context->tree, parent_node, &name_view)) {
+    result = EEXIST;
+    goto rollback_rwlock_wrlock;
   }
-  if (*nodep != &path_view) {
-    result = -EEXIST;
-    goto rollback_mtx_lock;
-  }
-
-  // TODO(mburakov): Should recursive creation be allowed?
-  // TODO(mburakov): Should parent node type be verified?
 
-  struct Node* node = NodeCreate(&path_view, 1);
+  struct Node* node = TreeCreate(&context->tree, parent_node, &name_view, 1);
   if (!node) {
     LOG(ERR, "failed to create node");
-    result = -EIO;
-    goto rollback_tsearch;
+    result = EIO;
+    goto rollback_rwlock_wrlock;
   }
 
-  *nodep = node;
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  struct fuse_entry_param entry;
+  MqttfsEntry(context, node, &entry);
+  MqttfsUnlock(context);
+  fuse_reply_entry(req, &entry);
+  return;
 
-rollback_tsearch:
-  tdelete(&path_view, &context->root_node, NodeCompare);
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
 }
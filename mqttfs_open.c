@@ -16,43 +16,89 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
-#include <threads.h>
 
+#include "handle.h"
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
-#include "str.h"
 
-int MqttfsOpen(const char* path, struct fuse_file_info* fi) {
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
+_Bool MqttfsOpenHandle(struct Context* context, uint64_t seen,
+                       struct fuse_file_info* fi) {
+  // mburakov: Buffered writes to files opened without truncation have to start
+  // from the current payload, which is loaded on the first write.
+  _Bool loaded = !context->options.buffer || (fi->flags & O_TRUNC);
+  struct Handle* handle = HandleCreate(loaded, seen);
+  if (!handle) {
+    LOG(ERR, "failed to create handle");
+    return 0;
+  }
+  fi->fh = (uint64_t)(uintptr_t)handle;
+  return 1;
+}
+
+void MqttfsOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+  if (MqttfsIsEvents(ino)) {
+    MqttfsEventsOpen(req, ino, fi);
+    return;
+  }
+  if (MqttfsIsStats(ino)) {
+    MqttfsStatsOpen(req, fi);
+    return;
+  }
+  if (MqttfsIsAll(ino)) {
+    MqttfsAllOpen(req, ino, fi);
+    return;
   }
 
-  int result;
-  struct Str path_view = StrView(path + 1);
-  struct Node** nodep = tfind(&path_view, &context->root_node, NodeCompare);
-  if (!nodep) {
-    result = -ENOENT;
-    goto rollback_mtx_lock;
-  }
-  struct Node* node = *nodep;
+  // mburakov: Node type never changes, so there is no need for the root lock.
+  struct Context* context = fuse_req_userdata(req);
+  struct Node* node = MqttfsNode(context, ino);
   if (node->is_dir) {
-    result = -EISDIR;
-    goto rollback_mtx_lock;
+    fuse_reply_err(req, EISDIR);
+    return;
   }
 
-  fi->fh = (uint64_t)node;
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  // mburakov: Files opened read-only with O_APPEND are streams, and are never
+  // cached. Streams start with the current payload, so an evicted one has to
+  // be fetched first. In cached mode the kernel keeps file contents in its
+  // page cache across opens, and incoming messages invalidate those.
+  _Bool stream = (fi->flags & O_ACCMODE) == O_RDONLY && (fi->flags & O_APPEND);
+  if (stream && !MqttfsRefetch(context, node)) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
 
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+  // mburakov: Pollers of a freshly opened file wait for the next update.
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  uint64_t seen = node->version;
+  MqttfsUnlock(context);
+  if (!MqttfsOpenHandle(context, seen, fi)) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  if (stream) {
+    struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+    if (!MqttfsStreamOpen(context, node, handle)) {
+      HandleDestroy(handle);
+      fuse_reply_err(req, EIO);
+      return;
+    }
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+  } else if (context->options.cache) {
+    fi->keep_cache = 1;
+  } else {
+    fi->direct_io = 1;
+  }
+  fuse_reply_open(req, fi);
 }
@@ -16,43 +16,32 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
-#include <stdint.h>
-#include <stdlib.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <string.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
-#include "str.h"
 
-int MqttfsOpendir(const char* path, struct fuse_file_info* fi) {
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
+void MqttfsOpendir(fuse_req_t req, fuse_ino_t ino,
+                   struct fuse_file_info* fi) {
+  // mburakov: Node type never changes, so there is no need for the root lock.
+  struct Context* context = fuse_req_userdata(req);
+  if (!MqttfsNode(context, ino)->is_dir) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
   }
-
-  int result;
-  struct Str path_view = StrView(path + 1);
-  struct Node** nodep = tfind(&path_view, &context->root_node, NodeCompare);
-  if (!nodep) {
-    result = -ENOENT;
-    goto rollback_mtx_lock;
-  }
-  struct Node* node = *nodep;
-  if (!node->is_dir) {
-    result = -ENOTDIR;
-    goto rollback_mtx_lock;
+  if (context->options.lazy) {
+    int error = MqttfsLockShared(context);
+    if (error) {
+      LOG(ERR, "failed to lock root lock: %s", strerror(error));
+      fuse_reply_err(req, EIO);
+      return;
+    }
+    MqttfsSubscribe(context, MqttfsNode(context, ino), NULL);
+    MqttfsUnlock(context);
   }
 
-  fi->fh = (uint64_t)node;
-  mtx_unlock(&context->root_mutex);
-  return 0;
-
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+  fuse_reply_open(req, fi);
 }
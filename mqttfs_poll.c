@@ -16,44 +16,70 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
-#include <threads.h>
 
+#include "handle.h"
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
 
-// TODO(mburakov): I have no clue what goes on here, it's probably all wrong.
+// mburakov: Kernel polls every open file separately, and asks to be notified
+// on the poll handle if nothing is ready yet. Each open file remembers the node
+// version it has last seen, and keeps the latest poll handle for the node to
+// notify. This way every waiter on a node is woken up by an update, and sees it
+// exactly once.
 
-int MqttfsPoll(const char* path, struct fuse_file_info* fi,
-               struct fuse_pollhandle* ph, unsigned* reventsp) {
-  (void)path;
-
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock root mutex: %s", strerror(errno));
-    return -EIO;
+void MqttfsPoll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+                struct fuse_pollhandle* ph) {
+  if (MqttfsIsEvents(ino)) {
+    MqttfsEventsPoll(req, fi, ph);
+    return;
+  }
+  if (MqttfsIsStats(ino)) {
+    MqttfsStatsPoll(req, ph);
+    return;
+  }
+  if (MqttfsIsAll(ino)) {
+    MqttfsAllPoll(req, ph);
+    return;
+  }
+  if (((struct Handle*)(uintptr_t)fi->fh)->stream) {
+    MqttfsStreamPoll(req, fi, ph);
+    return;
   }
 
-  struct Node* node = (struct Node*)fi->fh;
-  if (ph) {
-    // mburakov: Replace currently preserved ph with the new one. This
-    // reproduces the behavior from the official poll sample.
-    if (node->ph) {
-      fuse_pollhandle_destroy(node->ph);
-    }
-    node->ph = ph;
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    if (ph) fuse_pollhandle_destroy(ph);
+    fuse_reply_err(req, EIO);
+    return;
   }
 
   // mburakov: This assumes entries are always writable.
-  *reventsp |= POLLOUT;
-  if (node->was_updated) {
-    *reventsp |= POLLIN;
-    node->was_updated = 0;
+  struct Node* node = MqttfsNode(context, ino);
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  unsigned revents = POLLOUT;
+  if (handle->seen != node->version) {
+    revents |= POLLIN;
+    handle->seen = node->version;
+  }
+
+  if (ph) {
+    // mburakov: Kernel reuses the same notification key for any poll handle of
+    // an open file, so only the latest one is worth keeping.
+    if (handle->ph)
+      fuse_pollhandle_destroy(handle->ph);
+    else
+      NodeAddPoller(node, handle);
+    handle->ph = ph;
   }
 
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  MqttfsUnlock(context);
+  fuse_reply_poll(req, revents);
 }
@@ -16,40 +16,81 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
-#include <threads.h>
 #include <time.h>
 
+#include "handle.h"
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
+#include "payload.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-int MqttfsRead(const char* path, char* buf, size_t size, off_t offset,
-               struct fuse_file_info* fi) {
-  (void)path;
+void MqttfsRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info* fi) {
+  if (MqttfsIsEvents(ino)) {
+    MqttfsEventsRead(req, size, fi);
+    return;
+  }
+  if (MqttfsIsStats(ino)) {
+    MqttfsStatsRead(req, size, off, fi);
+    return;
+  }
+  if (MqttfsIsAll(ino)) {
+    MqttfsAllRead(req, size, off, fi);
+    return;
+  }
+  if (((struct Handle*)(uintptr_t)fi->fh)->stream) {
+    MqttfsStreamRead(req, size, fi);
+    return;
+  }
 
-  if (offset) return 0;
   struct timespec now;
   if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
     LOG(ERR, "failed to get clock: %s", strerror(errno));
-    return -EIO;
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  // mburakov: Pin the current payload, so that it could be replied without
+  // holding the root lock. Concurrent updates would replace, not modify it.
+  // Evicted payload is fetched again without the root lock held.
+  struct Context* context = fuse_req_userdata(req);
+  struct Node* node = MqttfsNode(context, ino);
+  struct Payload* payload;
+  for (;;) {
+    int error = MqttfsLockShared(context);
+    if (error) {
+      LOG(ERR, "failed to lock root lock: %s", strerror(error));
+      fuse_reply_err(req, EIO);
+      return;
+    }
+    _Bool evicted = node->evicted;
+    payload = node->payload ? PayloadAcquire(node->payload) : NULL;
+    if (!evicted) NodeSetAtime(node, &now);
+    MqttfsUnlock(context);
+    if (!evicted) break;
+    if (!MqttfsRefetch(context, node)) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
   }
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock root mutex: %s", strerror(errno));
-    return -EIO;
+  if (!payload || payload->size <= (size_t)off) {
+    fuse_reply_buf(req, NULL, 0);
+    PayloadRelease(payload);
+    return;
   }
 
-  // mburakov: Read shall return a number of bytes.
-  struct Node* node = (struct Node*)fi->fh;
-  size = MIN(size, node->size);
-  memcpy(buf, node->data, size);
-  node->atime = now;
-  mtx_unlock(&context->root_mutex);
-  return (int)size;
+  // mburakov: Reply points right into the pinned payload, so libfuse sends it
+  // to the kernel without copying it first. Payload is released afterwards.
+  struct fuse_bufvec bufvec =
+      FUSE_BUFVEC_INIT(MIN(size, payload->size - (size_t)off));
+  bufvec.buf[0].mem = payload->data + off;
+  fuse_reply_data(req, &bufvec, FUSE_BUF_SPLICE_MOVE);
+  PayloadRelease(payload);
 }
@@ -16,77 +16,113 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <search.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <threads.h>
 #include <time.h>
 
+#include "atom.h"
 #include "log.h"
 #include "mqttfs.h"
 #include "node.h"
-#include "str.h"
 
-// mburakov: musl does not implement twalk_r.
-static void* g_twalk_closure;
+struct ReaddirClosure {
+  fuse_req_t req;
+  char* buf;
+  size_t size;
+  size_t used;
+  off_t offset;
+  off_t counter;
+  _Bool full;
+};
+
+// mburakov: musl does not implement twalk_r. Readers run concurrently, so
+// closure has to be thread local.
+static thread_local struct ReaddirClosure* g_twalk_closure;
+
+static _Bool AddEntry(struct ReaddirClosure* closure, const char* name,
+                      const struct Node* node, off_t offset) {
+  // mburakov: Only inode number and type bits of the mode are used by FUSE.
+  struct stat stbuf = {
+      .st_ino = node->ino,
+      .st_mode = node->is_dir ? S_IFDIR : S_IFREG,
+  };
+  size_t size =
+      fuse_add_direntry(closure->req, closure->buf + closure->used,
+                        closure->size - closure->used, name, &stbuf, offset);
+  if (size > closure->size - closure->used) return 0;
+  closure->used += size;
+  return 1;
+}
 
 static void OnReaddir(const void* nodep, VISIT which, int depth) {
   (void)depth;
 
-  struct {
-    void* buf;
-    fuse_fill_dir_t filler;
-    const struct Str* parent;
-  }* closure = g_twalk_closure;
-
-  if (which == postorder || which == endorder) return;
-  struct Node* node = *(void* const*)nodep;
-  if (!node->path.size) return;
+  // mburakov: Visit children in order, so that their ordinal numbers could be
+  // used as readdir offsets.
+  struct ReaddirClosure* closure = g_twalk_closure;
+  if (which == preorder || which == endorder) return;
+  closure->counter++;
+  if (closure->full || closure->counter <= closure->offset) return;
 
-  struct Str base_path = StrBasePath(&node->path);
-  if (!StrCompare(closure->parent, &base_path)) {
-    // TODO(mburakov): Handle filler errors!
-    closure->filler(closure->buf, StrFileName(&node->path), NULL, 0,
-                    (enum fuse_fill_dir_flags)0);
-  }
+  const struct Node* node = *(void* const*)nodep;
+  closure->full =
+      !AddEntry(closure, node->name->str.data, node, closure->counter);
 }
 
-int MqttfsReaddir(const char* path, void* buf, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info* fi,
-                  enum fuse_readdir_flags flags) {
-  (void)path;
-  (void)offset;
-  (void)flags;
+void MqttfsReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                   struct fuse_file_info* fi) {
+  (void)fi;
 
   struct timespec now;
   if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
     LOG(ERR, "failed to get clock: %s", strerror(errno));
-    return -EIO;
+    fuse_reply_err(req, EIO);
+    return;
   }
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock root mutex: %s", strerror(errno));
-    return -EIO;
+  char* buf = malloc(size);
+  if (!buf) {
+    LOG(ERR, "failed to allocate buffer: %s", strerror(errno));
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    free(buf);
+    fuse_reply_err(req, EIO);
+    return;
   }
 
-  struct Node* node = (struct Node*)fi->fh;
-  filler(buf, ".", NULL, 0, (enum fuse_fill_dir_flags)0);
-  filler(buf, "..", NULL, 0, (enum fuse_fill_dir_flags)0);
-
-  struct {
-    void* buf;
-    fuse_fill_dir_t filler;
-    const struct Str* parent;
-  } closure = {
+  // mburakov: Offsets 1 and 2 are reserved for dot entries, children start at
+  // offset 3. Entries are added until the buffer is full.
+  struct Node* node = MqttfsNode(context, ino);
+  struct ReaddirClosure closure = {
+      .req = req,
       .buf = buf,
-      .filler = filler,
-      .parent = &node->path,
+      .size = size,
+      .used = 0,
+      .offset = off,
+      .counter = 2,
+      .full = 0,
   };
+  if (off < 1 && !AddEntry(&closure, ".", node, 1)) goto done;
+  if (off < 2 && !AddEntry(&closure, "..",
+                           node->parent ? node->parent : node, 2))
+    goto done;
 
   g_twalk_closure = &closure;
-  twalk(context->root_node, OnReaddir);
-  node->atime = now;
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  twalk(node->children, OnReaddir);
+
+done:
+  NodeSetAtime(node, &now);
+  MqttfsUnlock(context);
+  fuse_reply_buf(req, buf, closure.used);
+  free(buf);
 }
@@ -16,17 +16,18 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqtt.h"
 #include "mqttfs.h"
 #include "node.h"
+#include "payload.h"
 #include "str.h"
+#include "tree.h"
 
 #ifndef RENAME_NOREPLACE
 // mburakov: musl does not define this.
@@ -38,149 +39,174 @@
 #define RENAME_EXCHANGE (1 << 1)
 #endif  // RENAME_EXCHANGE
 
-static int RenameExchange(struct Context* context, struct Node** from_nodep,
-                          void** to_nodep) {
+static int RenameExchange(struct Context* context, struct Node* from_node,
+                          const struct Str* from_view, struct Node* to_node,
+                          const struct Str* to_view) {
   // mburakov: Check below reproduces behavior described in man 2 rename.
-  struct Node* from_node = *from_nodep;
-  struct Node* to_node = *to_nodep;
   if (from_node->is_dir != to_node->is_dir)
-    return from_node->is_dir ? -ENOTDIR : -EISDIR;
+    return from_node->is_dir ? ENOTDIR : EISDIR;
 
   // mburakov: Publish payload with the updated topic.
   if (!from_node->is_dir) {
-    if (!MqttPublish(context->mqtt, &to_node->path, from_node->data,
-                     from_node->size)) {
+    const struct Payload* payload = from_node->payload;
+    if (!MqttPublish(MqttfsConnection(context, to_view)->mqtt, to_view,
+                     payload ? payload->data : NULL,
+                     payload ? payload->size : 0)) {
       LOG(ERR, "failed to publish topic");
-      return -EIO;
+      return EIO;
     }
     // mburakov: Delivery might not be done yet, try to cancel.
-    MqttCancel(context->mqtt, &from_node->path);
+    MqttCancel(MqttfsConnection(context, from_view)->mqtt, from_view);
   }
 
-  // mburakov: Exchange names first.
-  struct Str temp = from_node->path;
-  from_node->path = to_node->path;
-  to_node->path = temp;
-
-  // mburakov: Exchange nodes afterwards.
-  *from_nodep = to_node;
-  *to_nodep = from_node;
+  TreeExchange(&context->tree, from_node, to_node);
   return 0;
 }
 
-static int RenameNoreplace(struct Context* context, struct Node** from_nodep,
-                           void** to_nodep, struct Str* to_view) {
-  if (!to_nodep) {
-    LOG(ERR, "failed to search node: %s", strerror(errno));
-    return -EIO;
-  }
-  if (*to_nodep != to_view) return -EEXIST;
-
-  // TODO(mburakov): Should recursive creation be allowed?
-  // TODO(mburakov): Should parent node type be verified?
-
-  int result;
-  struct Str to_copy;
-  if (!StrCopy(&to_copy, to_view)) {
-    LOG(ERR, "failed to copy string: %s", strerror(errno));
-    result = -EIO;
-    goto rollback_tsearch;
-  }
-
+static int RenameNoreplace(struct Context* context, struct Node* from_node,
+                           const struct Str* from_view, struct Node* parent,
+                           const struct Str* name, const struct Str* to_view) {
   // mburakov: Publish payload with the updated topic.
-  struct Node* from_node = *from_nodep;
   if (!from_node->is_dir) {
-    if (!MqttPublish(context->mqtt, to_view, from_node->data,
-                     from_node->size)) {
+    const struct Payload* payload = from_node->payload;
+    if (!MqttPublish(MqttfsConnection(context, to_view)->mqtt, to_view,
+                     payload ? payload->data : NULL,
+                     payload ? payload->size : 0)) {
       LOG(ERR, "failed to publish topic");
-      result = -EIO;
-      goto rollback_str_copy;
+      return EIO;
     }
     // mburakov: Delivery might not be done yet, try to cancel.
-    MqttCancel(context->mqtt, &from_node->path);
+    MqttCancel(MqttfsConnection(context, from_view)->mqtt, from_view);
   }
 
-  // mburakov: First, remove the node.
-  tdelete(from_node, &context->root_node, NodeCompare);
-
-  // mburakov: Second, update the node path.
-  StrFree(&from_node->path);
-  from_node->path = to_copy;
-
-  // mburakov: Finally, put the node back.
-  *to_nodep = from_node;
+  // mburakov: Children are linked to the node itself, so moving a directory
+  // moves its whole subtree along with it.
+  if (!TreeMove(&context->tree, from_node, parent, name)) {
+    LOG(ERR, "failed to move node");
+    return EIO;
+  }
   return 0;
-
-rollback_str_copy:
-  StrFree(&to_copy);
-rollback_tsearch:
-  tdelete(to_view, &context->root_node, NodeCompare);
-  return result;
 }
 
-static int RenameNormal(struct Context* context, struct Node** from_nodep,
-                        void** to_nodep, struct Str* to_view) {
-  if (!to_nodep) {
-    LOG(ERR, "failed to search node: %s", strerror(errno));
-    return -EIO;
-  }
-
-  if (*to_nodep == to_view)
-    return RenameNoreplace(context, from_nodep, to_nodep, to_view);
+static int RenameNormal(struct Context* context, struct Node* from_node,
+                        const struct Str* from_view, struct Node* to_node,
+                        const struct Str* to_view) {
+  // mburakov: Check below reproduces behavior described in man 2 rename.
+  if (to_node->children) return ENOTEMPTY;
 
-  int result = RenameExchange(context, from_nodep, to_nodep);
+  int result =
+      RenameExchange(context, from_node, from_view, to_node, to_view);
   if (result) return result;
 
   // TODO(mburakov): This cleans up original remains of target node. But what if
   // it is open or polled? I have no idea how is this supposed to work...
 
-  struct Node* from_node = *from_nodep;
-  tdelete(from_node, &context->root_node, NodeCompare);
-  MqttCancel(context->mqtt, &from_node->path);
-  NodeDestroy(from_node);
+  TreeRemove(&context->tree, to_node);
+  MqttCancel(MqttfsConnection(context, from_view)->mqtt, from_view);
   return 0;
 }
 
-int MqttfsRename(const char* from, const char* to, unsigned int flags) {
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
+static _Bool Refill(struct Context* context, fuse_ino_t parent,
+                    const struct Str* name) {
+  // mburakov: Evicted payload has to be fetched again before it is published
+  // under the new topic, and that could not be waited for under the root lock.
+  // Source node is referenced by the kernel for the duration of the rename.
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return 0;
+  }
+  struct Node* node =
+      TreeLookup(&context->tree, MqttfsNode(context, parent), name);
+  _Bool evicted = node && node->evicted;
+  MqttfsUnlock(context);
+  return !evicted || MqttfsRefetch(context, node);
+}
+
+void MqttfsRename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                  fuse_ino_t newparent, const char* newname,
+                  unsigned int flags) {
+  // mburakov: Nodes with the name of a virtual file would be hidden by it.
+  if (!strcmp(newname, MQTTFS_EVENTS_NAME) ||
+      !strcmp(newname, MQTTFS_ALL_NAME) ||
+      (newparent == FUSE_ROOT_ID && !strcmp(newname, MQTTFS_STATS_NAME))) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  struct Context* context = fuse_req_userdata(req);
+  struct Str from_name = StrView(name);
+  if (!Refill(context, parent, &from_name)) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
   }
 
   int result;
-  struct Str from_view = StrView(from + 1);
-  struct Node** from_nodep =
-      tfind(&from_view, &context->root_node, NodeCompare);
-  if (!from_nodep) {
-    result = -ENOENT;
-    goto rollback_mtx_lock;
+  struct Node* from_node =
+      TreeLookup(&context->tree, MqttfsNode(context, parent), &from_name);
+  if (!from_node) {
+    result = ENOENT;
+    goto rollback_rwlock_wrlock;
+  }
+  // mburakov: Payload might have been evicted again in the meantime.
+  if (from_node->evicted) {
+    result = EAGAIN;
+    goto rollback_rwlock_wrlock;
+  }
+
+  // mburakov: Nodes do not store their paths, but those are still needed for
+  // publishing and cancelling messages.
+  struct Str from_view;
+  if (!NodePath(from_node, &from_view)) {
+    LOG(ERR, "failed to get source path");
+    result = EIO;
+    goto rollback_rwlock_wrlock;
+  }
+  struct Node* to_parent = MqttfsNode(context, newparent);
+  struct Str to_name = StrView(newname);
+  struct Str to_view;
+  if (!NodeChildPath(to_parent, &to_name, &to_view)) {
+    LOG(ERR, "failed to get target path");
+    result = EIO;
+    goto rollback_node_path;
   }
 
-  void** to_nodep;
-  struct Str to_view = StrView(to + 1);
+  struct Node* to_node = TreeLookup(&context->tree, to_parent, &to_name);
   switch (flags) {
     case 0:
-      to_nodep = tsearch(&to_view, &context->root_node, NodeCompare);
-      result = RenameNormal(context, from_nodep, to_nodep, &to_view);
+      result = to_node ? RenameNormal(context, from_node, &from_view, to_node,
+                                      &to_view)
+                       : RenameNoreplace(context, from_node, &from_view,
+                                         to_parent, &to_name, &to_view);
       break;
 
     case RENAME_EXCHANGE:
-      to_nodep = tfind(&to_view, &context->root_node, NodeCompare);
-      result = RenameExchange(context, from_nodep, to_nodep);
+      result = to_node ? RenameExchange(context, from_node, &from_view,
+                                        to_node, &to_view)
+                       : ENOENT;
       break;
 
     case RENAME_NOREPLACE:
-      to_nodep = tsearch(&to_view, &context->root_node, NodeCompare);
-      result = RenameNoreplace(context, from_nodep, to_nodep, &to_view);
+      result = to_node ? EEXIST
+                       : RenameNoreplace(context, from_node, &from_view,
+                                         to_parent, &to_name, &to_view);
       break;
 
     default:
-      result = -EINVAL;
+      result = EINVAL;
       break;
   }
 
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+  StrFree(&to_view);
+rollback_node_path:
+  StrFree(&from_view);
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
 }
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "handle.h"
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+
+static int Truncate(struct Context* context, fuse_ino_t ino,
+                    struct Handle* handle, off_t size) {
+  int error = pthread_mutex_lock(&handle->mutex);
+  if (error) {
+    LOG(ERR, "failed to lock handle mutex: %s", strerror(error));
+    return EIO;
+  }
+  int result = 0;
+  if (!handle->loaded && size && !MqttfsLoadHandle(context, ino, handle)) {
+    LOG(ERR, "failed to load handle");
+    result = EIO;
+    goto rollback_mutex_lock;
+  }
+  handle->loaded = 1;
+  if (!HandleTruncate(handle, size)) {
+    result = errno == EFBIG ? EFBIG : EIO;
+    goto rollback_mutex_lock;
+  }
+  handle->dirty = 1;
+
+rollback_mutex_lock:
+  pthread_mutex_unlock(&handle->mutex);
+  return result;
+}
+
+void MqttfsSetattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                   int to_set, struct fuse_file_info* fi) {
+  if (MqttfsIsEvents(ino) || MqttfsIsStats(ino) || MqttfsIsAll(ino)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  // mburakov: Changing mode is unsupported, but required by NGINX. Buffered
+  // writes start from the current payload, so changing size of an open file
+  // resizes its buffer, which is published on flush. Otherwise writes always
+  // replace whole payloads, and changing size is ignored.
+  struct Context* context = fuse_req_userdata(req);
+  _Bool resize =
+      (to_set & FUSE_SET_ATTR_SIZE) && fi && context->options.buffer;
+  if (resize) {
+    struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+    int result = Truncate(context, ino, handle, attr->st_size);
+    if (result) {
+      fuse_reply_err(req, result);
+      return;
+    }
+  }
+  struct timespec now = {
+      .tv_sec = 0,
+      .tv_nsec = 0,
+  };
+  if (to_set & (FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW) &&
+      clock_gettime(CLOCK_REALTIME, &now) == -1) {
+    LOG(ERR, "failed to get clock: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct Node* node = MqttfsNode(context, ino);
+  if (to_set & FUSE_SET_ATTR_ATIME) {
+    NodeSetAtime(node,
+                 to_set & FUSE_SET_ATTR_ATIME_NOW ? &now : &attr->st_atim);
+  }
+  if (to_set & FUSE_SET_ATTR_MTIME) {
+    node->mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtim;
+  }
+
+  struct stat stbuf;
+  MqttfsStat(node, &stbuf);
+  if (resize) stbuf.st_size = attr->st_size;
+  MqttfsUnlock(context);
+  fuse_reply_attr(req, &stbuf, context->options.attr_timeout);
+}
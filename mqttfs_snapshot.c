@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+#include "str.h"
+#include "tree.h"
+
+// mburakov: Snapshot is a magic followed by a sequence of records, each being
+// a fixed header followed by the topic and the payload. Every snapshot is a
+// complete rewrite, with a single record per topic. Loading still lets later
+// records for the same topic override earlier ones, and ignores a truncated
+// record at the end. Numbers are stored in host byte order, as snapshots are
+// not supposed to travel between machines. Evicted payloads are not stored,
+// and their records only keep the size, so that those files are restored as
+// evicted, and fetched from the broker again.
+
+#define MQTTFS_SNAPSHOT_MAGIC "MQTTFS\002\n"
+#define MQTTFS_SNAPSHOT_EVICTED 1
+
+struct __attribute__((__packed__)) SnapshotRecord {
+  uint32_t topic_size;
+  uint32_t payload_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t flags;
+};
+
+struct SnapshotEntry {
+  struct Str topic;
+  struct Payload* payload;
+  size_t size;
+  struct timespec mtime;
+};
+
+struct Snapshot {
+  struct Context* context;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  _Bool running;
+  pthread_t thread;
+};
+
+static struct Node* CreatePath(struct Context* context,
+                               const struct Str* topic) {
+  struct Node* node = context->tree.root;
+  const char* end = topic->data + topic->size;
+  for (const char* ptr = topic->data;; ptr++) {
+    const char* separator = memchr(ptr, '/', (size_t)(end - ptr));
+    struct Str name = {
+        .size = (size_t)((separator ? separator : end) - ptr),
+        .data = ptr,
+    };
+    struct Node* parent = node;
+    node = TreeLookup(&context->tree, parent, &name);
+    if (!node) node = TreeCreate(&context->tree, parent, &name, !!separator);
+    if (!node || node->is_dir != !!separator) return NULL;
+    if (!separator) return node;
+    ptr = separator;
+  }
+}
+
+static _Bool LoadRecords(struct Context* context, const uint8_t* data,
+                         size_t size) {
+  size_t offset = sizeof(MQTTFS_SNAPSHOT_MAGIC) - 1;
+  if (size < offset || memcmp(data, MQTTFS_SNAPSHOT_MAGIC, offset)) {
+    LOG(ERR, "invalid snapshot magic");
+    return 0;
+  }
+  size_t count = 0;
+  while (size - offset >= sizeof(struct SnapshotRecord)) {
+    struct SnapshotRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    _Bool evicted = record.flags & MQTTFS_SNAPSHOT_EVICTED;
+    size_t record_size = sizeof(record) + (size_t)record.topic_size +
+                         (evicted ? 0 : record.payload_size);
+    if (size - offset < record_size) break;
+    struct Str topic = {
+        .size = record.topic_size,
+        .data = (const char*)data + offset + sizeof(record),
+    };
+    offset += record_size;
+    struct Node* node = CreatePath(context, &topic);
+    if (!node) {
+      LOG(WARNING, "failed to restore %.*s", (int)topic.size, topic.data);
+      continue;
+    }
+    if (evicted) {
+      NodeEvict(node);
+      node->evicted_size = record.payload_size;
+    } else if (!NodeUpdate(node, topic.data + topic.size,
+                           record.payload_size)) {
+      LOG(ERR, "failed to update node");
+      return 0;
+    }
+    node->mtime.tv_sec = (time_t)record.mtime_sec;
+    node->mtime.tv_nsec = (long)record.mtime_nsec;
+    MqttfsEvict(context);
+    count++;
+  }
+  if (offset != size) LOG(WARNING, "ignoring truncated snapshot record");
+  LOG(INFO, "restored %zu topics from snapshot", count);
+  return 1;
+}
+
+_Bool MqttfsSnapshotLoad(struct Context* context) {
+  // mburakov: Restored files are reported as stale until refreshed, because
+  // their epoch is older than that of any connection, established or not.
+  const char* path = context->options.snapshot;
+  if (!path) return 1;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return 1;
+    LOG(ERR, "failed to open snapshot: %s", strerror(errno));
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    LOG(ERR, "failed to stat snapshot: %s", strerror(errno));
+    goto rollback_open;
+  }
+  if (!st.st_size) {
+    close(fd);
+    return 1;
+  }
+  void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG(ERR, "failed to map snapshot: %s", strerror(errno));
+    goto rollback_open;
+  }
+  _Bool result = LoadRecords(context, data, (size_t)st.st_size);
+  munmap(data, (size_t)st.st_size);
+  close(fd);
+  return result;
+
+rollback_open:
+  close(fd);
+  return 0;
+}
+
+struct SnapshotCollection {
+  struct SnapshotEntry* entries;
+  size_t count;
+  size_t alloc;
+  // mburakov: Next slot to visit, and the state of the table when started.
+  size_t index;
+  size_t slots;
+  size_t deletions;
+  _Bool failed;
+};
+
+static void ReleaseEntries(struct SnapshotEntry* entries, size_t count) {
+  for (size_t index = 0; index < count; index++) {
+    StrFree(&entries[index].topic);
+    PayloadRelease(entries[index].payload);
+  }
+  free(entries);
+}
+
+static _Bool CollectNode(struct SnapshotCollection* collection,
+                         const struct Node* node) {
+  if (collection->count == collection->alloc) {
+    size_t alloc = collection->alloc ? collection->alloc * 2 : 256;
+    struct SnapshotEntry* entries =
+        realloc(collection->entries, alloc * sizeof(struct SnapshotEntry));
+    if (!entries) {
+      LOG(ERR, "failed to reallocate snapshot entries: %s", strerror(errno));
+      return 0;
+    }
+    collection->entries = entries;
+    collection->alloc = alloc;
+  }
+  struct SnapshotEntry* entry = collection->entries + collection->count;
+  if (!NodePath(node, &entry->topic)) {
+    LOG(ERR, "failed to get node path");
+    return 0;
+  }
+  entry->payload = node->payload ? PayloadAcquire(node->payload) : NULL;
+  entry->size = node->payload ? node->payload->size : node->evicted_size;
+  entry->mtime = node->mtime;
+  collection->count++;
+  return 1;
+}
+
+static int CollectChunk(struct Context* context,
+                        struct SnapshotCollection* collection, size_t chunk) {
+  // mburakov: Returns one when there's more to collect, zero when done, and
+  // minus one when the table changed under the walk, or on failure.
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    collection->failed = 1;
+    return -1;
+  }
+  int result = -1;
+  const struct Hash* nodes = &context->tree.nodes;
+  if (!collection->index) {
+    collection->slots = nodes->alloc;
+    collection->deletions = nodes->deletions;
+  } else if (collection->slots != nodes->alloc ||
+             collection->deletions != nodes->deletions) {
+    goto rollback_rdlock;
+  }
+  size_t end = collection->slots - collection->index > chunk
+                   ? collection->index + chunk
+                   : collection->slots;
+  for (; collection->index < end; collection->index++) {
+    const struct Node* node = nodes->slots[collection->index].item;
+    if (!node || (!node->payload && !node->evicted)) continue;
+    if (!CollectNode(collection, node)) {
+      collection->failed = 1;
+      goto rollback_rdlock;
+    }
+  }
+  result = collection->index < collection->slots;
+
+rollback_rdlock:
+  MqttfsUnlock(context);
+  return result;
+}
+
+static _Bool Collect(struct Context* context, struct SnapshotEntry** entries,
+                     size_t* count) {
+  // mburakov: Only pointers and paths are collected under the root lock, and
+  // only a chunk of slots at a time, so that a writer waiting for the lock, and
+  // the readers queued behind it, are never stalled for long. Deleted or grown
+  // table might have moved the nodes that were not visited yet, and then the
+  // walk starts over, and eventually is done in one go. Nodes created during
+  // the walk might be missed, as if created right after it. Payloads are
+  // pinned, so those are safe to copy out of afterwards.
+  static const size_t kChunkSlots = 4096;
+  static const int kChunkedAttempts = 3;
+  struct SnapshotCollection collection = {.entries = NULL};
+  for (int attempt = 0;; attempt++) {
+    size_t chunk = attempt < kChunkedAttempts ? kChunkSlots : SIZE_MAX;
+    int result;
+    do {
+      result = CollectChunk(context, &collection, chunk);
+    } while (result > 0);
+    if (!result) break;
+    ReleaseEntries(collection.entries, collection.count);
+    if (collection.failed) return 0;
+    collection = (struct SnapshotCollection){.entries = NULL};
+  }
+  *entries = collection.entries;
+  *count = collection.count;
+  return 1;
+}
+
+static _Bool WriteEntries(const char* path,
+                          const struct SnapshotEntry* entries, size_t count) {
+  size_t size = sizeof(MQTTFS_SNAPSHOT_MAGIC) - 1;
+  for (size_t index = 0; index < count; index++) {
+    size += sizeof(struct SnapshotRecord) + entries[index].topic.size;
+    if (entries[index].payload) size += entries[index].size;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    LOG(ERR, "failed to create snapshot: %s", strerror(errno));
+    return 0;
+  }
+  if (ftruncate(fd, (off_t)size)) {
+    LOG(ERR, "failed to size snapshot: %s", strerror(errno));
+    goto rollback_open;
+  }
+  uint8_t* data = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG(ERR, "failed to map snapshot: %s", strerror(errno));
+    goto rollback_open;
+  }
+
+  size_t offset = sizeof(MQTTFS_SNAPSHOT_MAGIC) - 1;
+  memcpy(data, MQTTFS_SNAPSHOT_MAGIC, offset);
+  for (size_t index = 0; index < count; index++) {
+    const struct SnapshotEntry* entry = entries + index;
+    struct SnapshotRecord record = {
+        .topic_size = (uint32_t)entry->topic.size,
+        .payload_size = (uint32_t)entry->size,
+        .mtime_sec = (int64_t)entry->mtime.tv_sec,
+        .mtime_nsec = (int64_t)entry->mtime.tv_nsec,
+        .flags = entry->payload ? 0 : MQTTFS_SNAPSHOT_EVICTED,
+    };
+    memcpy(data + offset, &record, sizeof(record));
+    offset += sizeof(record);
+    memcpy(data + offset, entry->topic.data, entry->topic.size);
+    offset += entry->topic.size;
+    if (!entry->payload) continue;
+    memcpy(data + offset, entry->payload->data, entry->size);
+    offset += entry->size;
+  }
+  _Bool result = !msync(data, size, MS_SYNC);
+  if (!result) LOG(ERR, "failed to sync snapshot: %s", strerror(errno));
+  munmap(data, size);
+  close(fd);
+  return result;
+
+rollback_open:
+  close(fd);
+  return 0;
+}
+
+static _Bool WriteSnapshot(struct Context* context) {
+  // mburakov: Snapshot is written next to the previous one, and replaces it
+  // only when complete, so a crash never leaves a broken one behind.
+  const char* path = context->options.snapshot;
+  size_t path_size = strlen(path);
+  char* temp = malloc(path_size + sizeof(".tmp"));
+  if (!temp) {
+    LOG(ERR, "failed to allocate snapshot path: %s", strerror(errno));
+    return 0;
+  }
+  memcpy(temp, path, path_size);
+  memcpy(temp + path_size, ".tmp", sizeof(".tmp"));
+
+  _Bool result = 0;
+  struct SnapshotEntry* entries;
+  size_t count;
+  if (!Collect(context, &entries, &count)) {
+    LOG(ERR, "failed to collect snapshot entries");
+    goto rollback_malloc;
+  }
+  if (!WriteEntries(temp, entries, count)) {
+    LOG(ERR, "failed to write snapshot entries");
+    unlink(temp);
+  } else if (rename(temp, path)) {
+    LOG(ERR, "failed to replace snapshot: %s", strerror(errno));
+    unlink(temp);
+  } else {
+    result = 1;
+  }
+  ReleaseEntries(entries, count);
+
+rollback_malloc:
+  free(temp);
+  return result;
+}
+
+static void* SnapshotThread(void* user) {
+  struct Snapshot* snapshot = user;
+  pthread_mutex_lock(&snapshot->mutex);
+  while (snapshot->running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += snapshot->context->options.snapshot_interval;
+    int error =
+        pthread_cond_timedwait(&snapshot->cond, &snapshot->mutex, &deadline);
+    if (!snapshot->running) break;
+    if (error != ETIMEDOUT) continue;
+    pthread_mutex_unlock(&snapshot->mutex);
+    if (!WriteSnapshot(snapshot->context))
+      LOG(WARNING, "failed to write snapshot");
+    pthread_mutex_lock(&snapshot->mutex);
+  }
+  pthread_mutex_unlock(&snapshot->mutex);
+  return NULL;
+}
+
+_Bool MqttfsSnapshotStart(struct Context* context) {
+  if (!context->options.snapshot) return 1;
+  struct Snapshot* snapshot = malloc(sizeof(struct Snapshot));
+  if (!snapshot) {
+    LOG(ERR, "failed to allocate snapshot: %s", strerror(errno));
+    return 0;
+  }
+  snapshot->context = context;
+  int error = pthread_mutex_init(&snapshot->mutex, NULL);
+  if (error) {
+    LOG(ERR, "failed to initialize snapshot mutex: %s", strerror(error));
+    goto rollback_malloc;
+  }
+  error = pthread_cond_init(&snapshot->cond, NULL);
+  if (error) {
+    LOG(ERR, "failed to initialize snapshot cond: %s", strerror(error));
+    goto rollback_mutex_init;
+  }
+  snapshot->running = 1;
+  error = pthread_create(&snapshot->thread, NULL, SnapshotThread, snapshot);
+  if (error) {
+    LOG(ERR, "failed to create snapshot thread: %s", strerror(error));
+    goto rollback_cond_init;
+  }
+  context->snapshot = snapshot;
+  return 1;
+
+rollback_cond_init:
+  pthread_cond_destroy(&snapshot->cond);
+rollback_mutex_init:
+  pthread_mutex_destroy(&snapshot->mutex);
+rollback_malloc:
+  free(snapshot);
+  return 0;
+}
+
+void MqttfsSnapshotStop(struct Context* context) {
+  // mburakov: Final snapshot is written after nothing could update the tree
+  // anymore, so it is up to date.
+  struct Snapshot* snapshot = context->snapshot;
+  if (!snapshot) return;
+  pthread_mutex_lock(&snapshot->mutex);
+  snapshot->running = 0;
+  pthread_cond_signal(&snapshot->cond);
+  pthread_mutex_unlock(&snapshot->mutex);
+  pthread_join(snapshot->thread, NULL);
+  pthread_cond_destroy(&snapshot->cond);
+  pthread_mutex_destroy(&snapshot->mutex);
+  free(snapshot);
+  context->snapshot = NULL;
+  if (!WriteSnapshot(context)) LOG(ERR, "failed to write final snapshot");
+}
@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
+
+#include "log.h"
+#include "mqtt.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+#include "pool.h"
+
+#ifndef LENGTH
+#define LENGTH(op) (sizeof(op) / sizeof *(op))
+#endif  // LENGTH
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// mburakov: Stats file is rendered when opened, so that subsequent reads see
+// consistent numbers. Every thread counts into its own slot, which is only
+// ever written by that thread, so counting is a plain increment on a cache
+// line nobody else writes to. Slots are summed when rendered. Slots are never
+// freed, and those of exited threads are taken over by new ones, which keep
+// adding to the same counters.
+
+struct Stats {
+  char* data;
+  size_t size;
+};
+
+struct StatsSlot {
+  struct StatsSlot* next;
+  _Bool owned;
+  atomic_size_t ops[kMqttfsOpCount][MQTT_HISTOGRAM_SIZE];
+  atomic_size_t lock_wait[MQTT_HISTOGRAM_SIZE];
+  atomic_size_t lock_hold[MQTT_HISTOGRAM_SIZE];
+};
+
+static const char* const kOpNames[kMqttfsOpCount] = {
+    [kMqttfsOpLookup] = "lookup",   [kMqttfsOpForget] = "forget",
+    [kMqttfsOpGetattr] = "getattr", [kMqttfsOpSetattr] = "setattr",
+    [kMqttfsOpMkdir] = "mkdir",     [kMqttfsOpUnlink] = "unlink",
+    [kMqttfsOpRmdir] = "rmdir",     [kMqttfsOpRename] = "rename",
+    [kMqttfsOpOpen] = "open",       [kMqttfsOpRead] = "read",
+    [kMqttfsOpWrite] = "write",     [kMqttfsOpFlush] = "flush",
+    [kMqttfsOpFsync] = "fsync",     [kMqttfsOpRelease] = "release",
+    [kMqttfsOpOpendir] = "opendir", [kMqttfsOpReaddir] = "readdir",
+    [kMqttfsOpCreate] = "create",   [kMqttfsOpPoll] = "poll",
+    [kMqttfsOpGetxattr] = "getxattr",
+    [kMqttfsOpForgetMulti] = "forget_multi",
+};
+
+// mburakov: Ownership is protected by the mutex. List is only ever prepended
+// to, so it could be walked without the mutex.
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_stats_key;
+static _Atomic(struct StatsSlot*) g_stats_slots;
+static thread_local struct StatsSlot* g_stats_slot;
+// mburakov: Root lock is never taken recursively, so a single timestamp per
+// thread is enough to tell how long it was held.
+static thread_local int64_t g_stats_locked;
+
+static size_t Bucket(int64_t value) {
+  if (value <= 0) return 0;
+  size_t bucket = (size_t)(64 - __builtin_clzll((unsigned long long)value));
+  return MIN(bucket, (size_t)MQTT_HISTOGRAM_SIZE - 1);
+}
+
+static void Count(atomic_size_t* histogram, int64_t value) {
+  // mburakov: Only the owning thread writes, so there's no need for an atomic
+  // read-modify-write, and atomics are only there for the renderer.
+  atomic_size_t* bucket = histogram + Bucket(value);
+  atomic_store_explicit(
+      bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+static void DisownSlot(void* user) {
+  struct StatsSlot* slot = user;
+  pthread_mutex_lock(&g_stats_mutex);
+  slot->owned = 0;
+  pthread_mutex_unlock(&g_stats_mutex);
+}
+
+static void CreateKey(void) {
+  int error = pthread_key_create(&g_stats_key, DisownSlot);
+  if (error) LOG(ERR, "failed to create stats key: %s", strerror(error));
+}
+
+static struct StatsSlot* OwnSlot(void) {
+  if (g_stats_slot) return g_stats_slot;
+  pthread_once(&g_stats_once, CreateKey);
+  pthread_mutex_lock(&g_stats_mutex);
+  struct StatsSlot* slot = atomic_load(&g_stats_slots);
+  while (slot && slot->owned) slot = slot->next;
+  if (!slot) {
+    slot = calloc(1, sizeof(struct StatsSlot));
+    if (!slot) {
+      LOG(ERR, "failed to allocate stats slot: %s", strerror(errno));
+      pthread_mutex_unlock(&g_stats_mutex);
+      return NULL;
+    }
+    slot->next = atomic_load(&g_stats_slots);
+    atomic_store(&g_stats_slots, slot);
+  }
+  slot->owned = 1;
+  pthread_mutex_unlock(&g_stats_mutex);
+  // mburakov: Slot is given back when the thread exits. Without the key it is
+  // kept by this thread forever, which is still correct.
+  pthread_setspecific(g_stats_key, slot);
+  g_stats_slot = slot;
+  return slot;
+}
+
+int64_t MqttfsStatsClock(void) {
+  struct timespec result = {.tv_sec = 0, .tv_nsec = 0};
+  clock_gettime(CLOCK_MONOTONIC, &result);
+  return result.tv_sec * 1000000 + result.tv_nsec / 1000;
+}
+
+void MqttfsStatsOp(enum MqttfsOp op, int64_t start) {
+  struct StatsSlot* slot = OwnSlot();
+  if (slot) Count(slot->ops[op], MqttfsStatsClock() - start);
+}
+
+int MqttfsLockShared(struct Context* context) {
+  int64_t start = MqttfsStatsClock();
+  int result = pthread_rwlock_rdlock(&context->root_lock);
+  g_stats_locked = MqttfsStatsClock();
+  struct StatsSlot* slot = OwnSlot();
+  if (!result && slot) Count(slot->lock_wait, g_stats_locked - start);
+  return result;
+}
+
+int MqttfsLockExclusive(struct Context* context) {
+  int64_t start = MqttfsStatsClock();
+  int result = pthread_rwlock_wrlock(&context->root_lock);
+  g_stats_locked = MqttfsStatsClock();
+  struct StatsSlot* slot = OwnSlot();
+  if (!result && slot) Count(slot->lock_wait, g_stats_locked - start);
+  return result;
+}
+
+void MqttfsUnlock(struct Context* context) {
+  struct StatsSlot* slot = OwnSlot();
+  if (slot) Count(slot->lock_hold, MqttfsStatsClock() - g_stats_locked);
+  pthread_rwlock_unlock(&context->root_lock);
+}
+
+_Bool MqttfsIsStats(fuse_ino_t ino) {
+  return ino == (FUSE_ROOT_ID | MQTTFS_STATS_TAG);
+}
+
+void MqttfsStatsStat(const struct Node* root, struct stat* stbuf) {
+  // mburakov: Size is unknown until rendered, so it is read with direct io.
+  MqttfsStat(root, stbuf);
+  stbuf->st_ino = root->ino | (UINT64_C(1) << 62);
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = 0;
+}
+
+void MqttfsStatsEntry(struct Context* context,
+                      struct fuse_entry_param* entry) {
+  // mburakov: Kernel references to the stats file are held on the root.
+  memset(entry, 0, sizeof(struct fuse_entry_param));
+  entry->ino = FUSE_ROOT_ID | MQTTFS_STATS_TAG;
+  entry->attr_timeout = context->options.attr_timeout;
+  entry->entry_timeout = context->options.entry_timeout;
+  MqttfsStatsStat(context->tree.root, &entry->attr);
+  atomic_fetch_add(&context->tree.root->nlookup, 1);
+}
+
+static void PrintHistogram(FILE* stream, const char* name,
+                           const size_t* buckets, size_t count,
+                           _Bool from_zero) {
+  // mburakov: Only non-empty buckets are printed, each one labelled with its
+  // lower bound. The last bucket has no upper bound.
+  fprintf(stream, "%s", name);
+  for (size_t index = 0; index < count; index++) {
+    if (!buckets[index]) continue;
+    size_t label = from_zero ? (size_t)1 << index >> 1 : (size_t)1 << index;
+    fprintf(stream, " %zu:%zu", label, buckets[index]);
+  }
+  fputc('\n', stream);
+}
+
+static void PrintSlotsHistogram(FILE* stream, const char* name,
+                                size_t offset) {
+  // mburakov: Histogram is picked by its offset within the slot.
+  size_t buckets[MQTT_HISTOGRAM_SIZE] = {0};
+  for (struct StatsSlot* slot = atomic_load(&g_stats_slots); slot;
+       slot = slot->next) {
+    const atomic_size_t* histogram =
+        (const atomic_size_t*)((const char*)slot + offset);
+    for (size_t index = 0; index < LENGTH(buckets); index++) {
+      buckets[index] += atomic_load_explicit(histogram + index,
+                                             memory_order_relaxed);
+    }
+  }
+  PrintHistogram(stream, name, buckets, LENGTH(buckets), 1);
+}
+
+static _Bool Render(struct Context* context, struct Stats* stats) {
+  struct MqttStats total = {.batches = {0}};
+  for (size_t index = 0; index < context->options.connections; index++) {
+    struct Mqtt* mqtt = context->connections[index].mqtt;
+    if (!mqtt) continue;
+    struct MqttStats part;
+    MqttGetStats(mqtt, &part);
+    for (size_t bucket = 0; bucket < LENGTH(part.batches); bucket++)
+      total.batches[bucket] += part.batches[bucket];
+    total.messages_out += part.messages_out;
+    total.bytes_out += part.bytes_out;
+    total.messages_in += part.messages_in;
+    total.bytes_in += part.bytes_in;
+    total.parse_errors += part.parse_errors;
+    total.queued += part.queued;
+    total.inflight += part.inflight;
+    total.outbound += part.outbound;
+    for (size_t bucket = 0; bucket < MQTT_HISTOGRAM_SIZE; bucket++) {
+      total.queue_delay[bucket] += part.queue_delay[bucket];
+      total.loop_latency[bucket] += part.loop_latency[bucket];
+    }
+  }
+
+  int error = MqttfsLockShared(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return 0;
+  }
+  size_t nodes = context->tree.nodes.size;
+  size_t messages = context->messages;
+  MqttfsUnlock(context);
+
+  FILE* stream = open_memstream(&stats->data, &stats->size);
+  if (!stream) {
+    LOG(ERR, "failed to open stats stream: %s", strerror(errno));
+    return 0;
+  }
+  size_t allocations = PoolAllocations();
+  fprintf(stream, "messages_in %zu\n", total.messages_in);
+  fprintf(stream, "bytes_in %zu\n", total.bytes_in);
+  fprintf(stream, "messages_out %zu\n", total.messages_out);
+  fprintf(stream, "bytes_out %zu\n", total.bytes_out);
+  fprintf(stream, "parse_errors %zu\n", total.parse_errors);
+  fprintf(stream, "queued %zu\n", total.queued);
+  fprintf(stream, "inflight %zu\n", total.inflight);
+  fprintf(stream, "outbound %zu\n", total.outbound);
+  fprintf(stream, "stream_dropped %zu\n", MqttfsStreamDropped());
+  fprintf(stream, "duplicates %zu\n", MqttfsApplyDuplicates());
+  fprintf(stream, "nodes %zu\n", nodes);
+  fprintf(stream, "payload_bytes %zu\n", PayloadResident());
+  fprintf(stream, "allocations %zu\n", allocations);
+  fprintf(stream, "allocations_per_message %.3f\n",
+          messages ? (double)allocations / (double)messages : 0.0);
+  PrintHistogram(stream, "batches", total.batches, LENGTH(total.batches), 0);
+  PrintHistogram(stream, "queue_delay_ms", total.queue_delay,
+                 MQTT_HISTOGRAM_SIZE, 1);
+  PrintHistogram(stream, "io_loop_us", total.loop_latency,
+                 MQTT_HISTOGRAM_SIZE, 1);
+  PrintSlotsHistogram(stream, "root_lock_wait_us",
+                      offsetof(struct StatsSlot, lock_wait));
+  PrintSlotsHistogram(stream, "root_lock_hold_us",
+                      offsetof(struct StatsSlot, lock_hold));
+  for (size_t op = 0; op < kMqttfsOpCount; op++) {
+    char name[32];
+    snprintf(name, sizeof(name), "op_%s_us", kOpNames[op]);
+    PrintSlotsHistogram(stream, name,
+                        offsetof(struct StatsSlot, ops) +
+                            op * sizeof(((struct StatsSlot*)0)->ops[0]));
+  }
+  if (fclose(stream)) {
+    LOG(ERR, "failed to render stats: %s", strerror(errno));
+    free(stats->data);
+    return 0;
+  }
+  return 1;
+}
+
+void MqttfsStatsOpen(fuse_req_t req, struct fuse_file_info* fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  struct Context* context = fuse_req_userdata(req);
+  struct Stats* stats = malloc(sizeof(struct Stats));
+  if (!stats) {
+    LOG(ERR, "failed to allocate stats: %s", strerror(errno));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  if (!Render(context, stats)) {
+    LOG(ERR, "failed to render stats");
+    free(stats);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  fi->fh = (uint64_t)(uintptr_t)stats;
+  fi->direct_io = 1;
+  fuse_reply_open(req, fi);
+}
+
+void MqttfsStatsRead(fuse_req_t req, size_t size, off_t off,
+                     struct fuse_file_info* fi) {
+  const struct Stats* stats = (const struct Stats*)(uintptr_t)fi->fh;
+  size_t offset = MIN((size_t)off, stats->size);
+  fuse_reply_buf(req, stats->data + offset, MIN(size, stats->size - offset));
+}
+
+void MqttfsStatsPoll(fuse_req_t req, struct fuse_pollhandle* ph) {
+  // mburakov: Stats never change after being rendered.
+  if (ph) fuse_pollhandle_destroy(ph);
+  fuse_reply_poll(req, POLLIN);
+}
+
+void MqttfsStatsRelease(fuse_req_t req, struct fuse_file_info* fi) {
+  struct Stats* stats = (struct Stats*)(uintptr_t)fi->fh;
+  free(stats->data);
+  free(stats);
+  fuse_reply_err(req, 0);
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "handle.h"
+#include "log.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "payload.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// mburakov: Files opened read-only with O_APPEND are streams. Every open stream
+// queues every update of its node in a bounded ring of pinned payloads, and
+// reads return queued messages one after another, each framed by a line with
+// its size and the number of messages dropped right before it. Full ring drops
+// the oldest message instead of stalling ingest. Blocked reads are parked just
+// like those of events files. Streams are linked both into their node and into
+// the context, and are protected by the root lock.
+
+struct StreamFrame {
+  struct Payload* payload;
+  size_t dropped;
+};
+
+struct Stream {
+  struct Node* node;
+  struct Stream* prev;
+  struct Stream* next;
+  struct Stream* node_prev;
+  struct Stream* node_next;
+  // mburakov: Bytes of the oldest frame that were already read.
+  size_t offset;
+  fuse_req_t req;
+  size_t req_size;
+  struct fuse_pollhandle* ph;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  struct StreamFrame frames[];
+};
+
+static atomic_size_t g_stream_dropped;
+
+static void Push(struct Stream* stream, struct Payload* payload) {
+  size_t dropped = 0;
+  if (stream->count == stream->capacity) {
+    // mburakov: Partially read frame has to be completed, so the next one is
+    // dropped instead, and the partial frame takes its place. The number of
+    // dropped messages is carried over to whichever frame comes next.
+    size_t victim = (stream->head + !!stream->offset) % stream->capacity;
+    dropped = stream->frames[victim].dropped + 1;
+    PayloadRelease(stream->frames[victim].payload);
+    if (stream->offset) stream->frames[victim] = stream->frames[stream->head];
+    stream->head = (stream->head + 1) % stream->capacity;
+    stream->count--;
+    atomic_fetch_add_explicit(&g_stream_dropped, 1, memory_order_relaxed);
+    size_t next = !!stream->offset;
+    if (next < stream->count) {
+      stream->frames[(stream->head + next) % stream->capacity].dropped +=
+          dropped;
+      dropped = 0;
+    }
+  }
+  struct StreamFrame* frame =
+      stream->frames + (stream->head + stream->count) % stream->capacity;
+  frame->payload = PayloadAcquire(payload);
+  frame->dropped = dropped;
+  stream->count++;
+}
+
+static void Reply(struct Stream* stream, fuse_req_t req, size_t size) {
+  // mburakov: Reply points right into the pinned payloads, and takes as many
+  // frames as fit. Frame that does not fit is continued by the next read.
+  enum { kMaxFrames = 32 };
+  char headers[kMaxFrames][48];
+  struct iovec iov[kMaxFrames * 2] = {{.iov_base = NULL}};
+  size_t iovcnt = 0;
+  size_t total = 0;
+  size_t done = 0;
+  size_t offset = 0;
+  for (size_t index = 0;
+       index < stream->count && index < kMaxFrames && total < size; index++) {
+    const struct StreamFrame* frame =
+        stream->frames + (stream->head + index) % stream->capacity;
+    size_t header =
+        (size_t)snprintf(headers[index], sizeof(headers[index]), "%zu %zu\n",
+                         frame->payload->size, frame->dropped);
+    size_t skip = index ? 0 : stream->offset;
+    size_t take = MIN(header + frame->payload->size - skip, size - total);
+    if (skip < header) {
+      iov[iovcnt++] = (struct iovec){
+          .iov_base = headers[index] + skip,
+          .iov_len = MIN(header - skip, take),
+      };
+    }
+    if (skip + take > header) {
+      size_t from = skip > header ? skip - header : 0;
+      iov[iovcnt++] = (struct iovec){
+          .iov_base = frame->payload->data + from,
+          .iov_len = skip + take - header - from,
+      };
+    }
+    total += take;
+    if (skip + take == header + frame->payload->size)
+      done++;
+    else
+      offset = skip + take;
+  }
+
+  fuse_reply_iov(req, iov, (int)iovcnt);
+  for (; done; done--) {
+    PayloadRelease(stream->frames[stream->head].payload);
+    stream->head = (stream->head + 1) % stream->capacity;
+    stream->count--;
+  }
+  stream->offset = offset;
+}
+
+_Bool MqttfsStreamOpen(struct Context* context, struct Node* node,
+                       struct Handle* handle) {
+  size_t capacity = context->options.stream;
+  struct Stream* stream =
+      calloc(1, sizeof(struct Stream) + capacity * sizeof(struct StreamFrame));
+  if (!stream) {
+    LOG(ERR, "failed to allocate stream: %s", strerror(errno));
+    return 0;
+  }
+  stream->capacity = capacity;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    free(stream);
+    return 0;
+  }
+
+  // mburakov: Stream starts with the current payload, if there is one.
+  stream->node = node;
+  if (node->payload) Push(stream, node->payload);
+  stream->next = context->streams;
+  if (context->streams) context->streams->prev = stream;
+  context->streams = stream;
+  stream->node_next = node->streams;
+  if (node->streams) node->streams->node_prev = stream;
+  node->streams = stream;
+  MqttfsUnlock(context);
+  handle->stream = stream;
+  return 1;
+}
+
+void MqttfsStreamPublish(struct Node* node) {
+  for (struct Stream* stream = node->streams; stream;
+       stream = stream->node_next) {
+    Push(stream, node->payload);
+    if (stream->req) {
+      Reply(stream, stream->req, stream->req_size);
+      stream->req = NULL;
+    } else if (stream->ph) {
+      int result = fuse_lowlevel_notify_poll(stream->ph);
+      if (result) LOG(WARNING, "failed to notify poll: %s", strerror(-result));
+      fuse_pollhandle_destroy(stream->ph);
+      stream->ph = NULL;
+    }
+  }
+}
+
+static void OnInterrupt(fuse_req_t req, void* data) {
+  // mburakov: Same as for events files, interrupted request is looked up among
+  // the parked ones, since its stream might be gone meanwhile.
+  struct Context* context = data;
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    return;
+  }
+  for (struct Stream* stream = context->streams; stream;
+       stream = stream->next) {
+    if (stream->req != req) continue;
+    stream->req = NULL;
+    fuse_reply_err(req, EINTR);
+    break;
+  }
+  MqttfsUnlock(context);
+}
+
+void MqttfsStreamRead(fuse_req_t req, size_t size, struct fuse_file_info* fi) {
+  struct Context* context = fuse_req_userdata(req);
+  fuse_req_interrupt_func(req, OnInterrupt, context);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  int result;
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  struct Stream* stream = handle->stream;
+  if (stream->count) {
+    Reply(stream, req, size);
+    MqttfsUnlock(context);
+    return;
+  }
+  if (fi->flags & O_NONBLOCK) {
+    result = EAGAIN;
+    goto rollback_rwlock_wrlock;
+  }
+  if (stream->req) {
+    result = EBUSY;
+    goto rollback_rwlock_wrlock;
+  }
+  if (fuse_req_interrupted(req)) {
+    result = EINTR;
+    goto rollback_rwlock_wrlock;
+  }
+  stream->req = req;
+  stream->req_size = size;
+  MqttfsUnlock(context);
+  return;
+
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
+}
+
+void MqttfsStreamPoll(fuse_req_t req, struct fuse_file_info* fi,
+                      struct fuse_pollhandle* ph) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    if (ph) fuse_pollhandle_destroy(ph);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct Handle* handle = (struct Handle*)(uintptr_t)fi->fh;
+  struct Stream* stream = handle->stream;
+  unsigned revents = stream->count ? POLLIN : 0;
+  if (ph) {
+    if (stream->ph) fuse_pollhandle_destroy(stream->ph);
+    stream->ph = ph;
+  }
+  MqttfsUnlock(context);
+  fuse_reply_poll(req, revents);
+}
+
+void MqttfsStreamRelease(struct Context* context, struct Handle* handle) {
+  // mburakov: Caller holds the root lock exclusively.
+  struct Stream* stream = handle->stream;
+  if (stream->prev)
+    stream->prev->next = stream->next;
+  else
+    context->streams = stream->next;
+  if (stream->next) stream->next->prev = stream->prev;
+  if (stream->node_prev)
+    stream->node_prev->node_next = stream->node_next;
+  else
+    stream->node->streams = stream->node_next;
+  if (stream->node_next) stream->node_next->node_prev = stream->node_prev;
+
+  for (size_t index = 0; index < stream->count; index++)
+    PayloadRelease(stream->frames[(stream->head + index) % stream->capacity]
+                       .payload);
+  if (stream->ph) fuse_pollhandle_destroy(stream->ph);
+  free(stream);
+  handle->stream = NULL;
+}
+
+size_t MqttfsStreamDropped(void) {
+  return atomic_load_explicit(&g_stream_dropped, memory_order_relaxed);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "mqtt.h"
+#include "mqttfs.h"
+#include "node.h"
+#include "str.h"
+
+// mburakov: In lazy mode directories are subscribed to when those are used.
+// Subscriptions that were not renewed for the idle period are expired by the
+// IO thread, which unsubscribes from those, as the broker never does that.
+// Nodes remember when their subtrees were last subscribed to, so that lookups
+// only renew a subscription once in a while, and never subscribe to subtrees
+// of an already subscribed directory.
+
+static long long MillisNow() {
+  struct timespec now = {.tv_sec = 0, .tv_nsec = 0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static _Bool Subscribe(struct Context* context, const struct Str* path) {
+  char* data = malloc(path->size + 2);
+  if (!data) {
+    LOG(ERR, "failed to allocate filter: %s", strerror(errno));
+    return 0;
+  }
+  memcpy(data, path->data, path->size);
+  memcpy(data + path->size, "/#", 2);
+  struct Str filter = {.size = path->size + 2, .data = data};
+  struct Mqtt* mqtt = MqttfsConnection(context, &filter)->mqtt;
+  _Bool result = !mqtt || MqttSubscribe(mqtt, &filter, context->options.lazy);
+  free(data);
+  return result;
+}
+
+void MqttfsSubscribe(struct Context* context, struct Node* dir,
+                     const char* name) {
+  // mburakov: Removed directories have no path to subscribe to anymore.
+  if (!context->options.lazy) return;
+  if (dir != context->tree.root && !dir->parent) return;
+  long long now = MillisNow();
+  if (!now) {
+    LOG(ERR, "failed to get monotonic clock: %s", strerror(errno));
+    return;
+  }
+
+  struct Node* node = dir;
+  while (node && !atomic_load(&node->subscribed)) node = node->parent;
+  if (node && now - atomic_load(&node->subscribed) < context->options.lazy / 2)
+    return;
+  if (!node && name) {
+    // mburakov: Missing names are subscribed to, so that those could appear
+    // later on, but there's no node to remember that.
+    struct Str name_view = StrView(name);
+    struct Str path;
+    if (!NodeChildPath(dir, &name_view, &path)) {
+      LOG(ERR, "failed to get child path");
+      return;
+    }
+    if (!Subscribe(context, &path)) LOG(ERR, "failed to subscribe");
+    StrFree(&path);
+    return;
+  }
+  if (!node) node = dir;
+  if (node == context->tree.root) return;
+
+  struct Str path;
+  if (!NodePath(node, &path)) {
+    LOG(ERR, "failed to get node path");
+    return;
+  }
+  if (Subscribe(context, &path))
+    atomic_store(&node->subscribed, now);
+  else
+    LOG(ERR, "failed to subscribe");
+  StrFree(&path);
+}
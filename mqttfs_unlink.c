@@ -16,43 +16,55 @@
  */
 
 #include <errno.h>
-#include <fuse.h>
-#include <search.h>
-#include <stdlib.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <string.h>
-#include <threads.h>
 
 #include "log.h"
 #include "mqtt.h"
 #include "mqttfs.h"
 #include "node.h"
 #include "str.h"
+#include "tree.h"
 
-int MqttfsUnlink(const char* path) {
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock nodes mutex: %s", strerror(errno));
-    return -EIO;
+void MqttfsUnlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
   }
 
   int result;
-  struct Str path_view = StrView(path + 1);
-  struct Node** nodep = tfind(&path_view, &context->root_node, NodeCompare);
-  if (!nodep) {
-    result = -ENOENT;
-    goto rollback_mtx_lock;
+  struct Str name_view = StrView(name);
+  struct Node* node =
+      TreeLookup(&context->tree, MqttfsNode(context, parent), &name_view);
+  if (!node) {
+    result = ENOENT;
+    goto rollback_rwlock_wrlock;
   }
 
   // TODO(mburakov): Should recursive deletion be allowed?
 
-  struct Node* node = *nodep;
-  tdelete(&path_view, &context->root_node, NodeCompare);
-  MqttCancel(context->mqtt, &node->path);
-  NodeDestroy(node);
-  mtx_unlock(&context->root_mutex);
-  return 0;
+  if (node->children) {
+    result = ENOTEMPTY;
+    goto rollback_rwlock_wrlock;
+  }
+  struct Str path;
+  if (!NodePath(node, &path)) {
+    LOG(ERR, "failed to get node path");
+    result = EIO;
+    goto rollback_rwlock_wrlock;
+  }
+  MqttCancel(MqttfsConnection(context, &path)->mqtt, &path);
+  StrFree(&path);
+  TreeRemove(&context->tree, node);
+  MqttfsUnlock(context);
+  fuse_reply_err(req, 0);
+  return;
 
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+rollback_rwlock_wrlock:
+  MqttfsUnlock(context);
+  fuse_reply_err(req, result);
 }
@@ -16,61 +16,154 @@
  */
 
 #include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
 #include <stddef.h>
-#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
-#include <threads.h>
 #include <time.h>
 
+#include "handle.h"
 #include "log.h"
 #include "mqtt.h"
 #include "mqttfs.h"
 #include "node.h"
+#include "payload.h"
+#include "str.h"
 
-int MqttfsWrite(const char* path, const char* buf, size_t size, off_t offset,
-                struct fuse_file_info* fi) {
-  (void)path;
-  (void)offset;
-
+int MqttfsCommit(struct Context* context, struct Node* node, const void* data,
+                 size_t size) {
   struct timespec now;
   if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
     LOG(ERR, "failed to get clock: %s", strerror(errno));
-    return -EIO;
+    return EIO;
+  }
+
+  // mburakov: Node might have been removed while still open, and then there
+  // is no topic to publish to anymore. Otherwise it is fresh as of the
+  // connection it is published over, until the broker echoes it back.
+  uint64_t epoch = node->epoch;
+  uint8_t index = node->connection;
+  if (node->parent) {
+    struct Str topic;
+    if (!NodePath(node, &topic)) {
+      LOG(ERR, "failed to get node path");
+      return EIO;
+    }
+    struct Connection* connection = MqttfsConnection(context, &topic);
+    _Bool published = MqttPublish(connection->mqtt, &topic, data, size);
+    epoch = connection->epoch;
+    index = (uint8_t)(connection - context->connections);
+    StrFree(&topic);
+    if (!published) {
+      LOG(ERR, "failed to publish topic");
+      return EIO;
+    }
+  }
+
+  struct Payload* payload = PayloadReplace(node->payload, data, size);
+  if (!payload) {
+    LOG(ERR, "failed to replace payload");
+    return EIO;
   }
-  struct Context* context = fuse_get_context()->private_data;
-  if (mtx_lock(&context->root_mutex) != thrd_success) {
-    LOG(ERR, "failed to lock root mutex: %s", strerror(errno));
-    return -EIO;
+  if (payload != node->payload) {
+    PayloadRelease(node->payload);
+    node->payload = payload;
   }
+  node->mtime = now;
+  node->epoch = epoch;
+  node->connection = index;
+  if (node->evicted) MqttfsRefilled(context);
+  node->evicted = 0;
+  node->committed = 1;
+  MqttfsEvict(context);
+  return 0;
+}
 
+_Bool MqttfsLoadHandle(struct Context* context, fuse_ino_t ino,
+                      struct Handle* handle) {
+  // mburakov: Evicted payload is fetched again, as otherwise writes would be
+  // applied to an empty buffer, and the rest of the payload would be lost.
+  struct Node* node = MqttfsNode(context, ino);
+  for (;;) {
+    int error = MqttfsLockShared(context);
+    if (error) {
+      LOG(ERR, "failed to lock root lock: %s", strerror(error));
+      return 0;
+    }
+    if (!node->evicted) break;
+    MqttfsUnlock(context);
+    if (!MqttfsRefetch(context, node)) return 0;
+  }
+  const struct Payload* payload = node->payload;
+  _Bool result =
+      !payload || HandleWrite(handle, payload->data, payload->size, 0);
+  MqttfsUnlock(context);
+  return result;
+}
+
+static void BufferedWrite(fuse_req_t req, fuse_ino_t ino, const char* buf,
+                          size_t size, off_t off, struct Handle* handle) {
+  struct Context* context = fuse_req_userdata(req);
+  int error = pthread_mutex_lock(&handle->mutex);
+  if (error) {
+    LOG(ERR, "failed to lock handle mutex: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  // mburakov: Files opened without truncation start with the current payload,
+  // so that writes at an offset modify it instead of zero-filling the rest.
   int result;
-  void* data = malloc(size);
-  if (!data) {
-    LOG(ERR, "failed to allocate file contents");
-    result = -EIO;
-    goto rollback_mtx_lock;
+  if (!handle->loaded) {
+    if (!MqttfsLoadHandle(context, ino, handle)) {
+      LOG(ERR, "failed to load handle");
+      result = EIO;
+      goto rollback_mutex_lock;
+    }
+    handle->loaded = 1;
   }
+  if (!HandleWrite(handle, buf, size, off)) {
+    result = errno == EFBIG ? EFBIG : EIO;
+    goto rollback_mutex_lock;
+  }
+  handle->dirty = 1;
+  pthread_mutex_unlock(&handle->mutex);
+  fuse_reply_write(req, size);
+  return;
 
-  struct Node* node = (struct Node*)fi->fh;
-  if (!MqttPublish(context->mqtt, &node->path, buf, size)) {
-    LOG(ERR, "failed to publish topic");
-    result = -EIO;
-    goto rollback_malloc;
+rollback_mutex_lock:
+  pthread_mutex_unlock(&handle->mutex);
+  fuse_reply_err(req, result);
+}
+
+void MqttfsWrite(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+                 off_t off, struct fuse_file_info* fi) {
+  struct Context* context = fuse_req_userdata(req);
+  if (context->options.buffer) {
+    BufferedWrite(req, ino, buf, size, off, (struct Handle*)(uintptr_t)fi->fh);
+    return;
   }
 
-  // mburakov: Write shall return a number of bytes.
-  memcpy(data, buf, size);
-  free(node->data);
-  node->mtime = now;
-  node->data = data;
-  node->size = size;
-  mtx_unlock(&context->root_mutex);
-  return (int)size;
+  // mburakov: Without buffering every write replaces the whole payload.
+  int error = MqttfsLockExclusive(context);
+  if (error) {
+    LOG(ERR, "failed to lock root lock: %s", strerror(error));
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  struct Node* node = MqttfsNode(context, ino);
+  int result = MqttfsCommit(context, node, buf, size);
+  struct Mqtt* mqtt = MqttfsNodeConnection(context, node)->mqtt;
+  MqttfsUnlock(context);
 
-rollback_malloc:
-  free(data);
-rollback_mtx_lock:
-  mtx_unlock(&context->root_mutex);
-  return result;
+  // mburakov: Broker is waited for without holding the lock, so that incoming
+  // messages could still be applied meanwhile.
+  if (!result) MqttThrottle(mqtt);
+  if (!result && context->options.sync && !MqttFlush(mqtt)) result = EIO;
+  if (result)
+    fuse_reply_err(req, result);
+  else
+    fuse_reply_write(req, size);
 }
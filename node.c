@@ -18,39 +18,38 @@
 #include "node.h"
 
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <search.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "atom.h"
+#include "handle.h"
 #include "log.h"
+#include "payload.h"
+#include "pool.h"
 #include "str.h"
 
-struct Node* NodeCreate(const struct Str* path, _Bool is_dir) {
+struct Node* NodeCreate(const struct Atom* name, _Bool is_dir) {
   struct timespec now;
   if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
     LOG(ERR, "failed to get clock: %s", strerror(errno));
     return NULL;
   }
-  struct Node* result = calloc(1, sizeof(struct Node));
+  struct Node* result = PoolAlloc(sizeof(struct Node), NULL);
   if (!result) {
     LOG(ERR, "failed to allocate node: %s", strerror(errno));
     return NULL;
   }
+  memset(result, 0, sizeof(struct Node));
 
-  if (!StrCopy(&result->path, path)) {
-    LOG(ERR, "failed to copy path: %s", strerror(errno));
-    goto rollback_calloc;
-  }
-
-  result->atime = now;
+  result->name = name;
+  NodeSetAtime(result, &now);
   result->mtime = now;
   result->is_dir = is_dir;
   return result;
-
-rollback_calloc:
-  free(result);
-  return NULL;
 }
 
 _Bool NodeUpdate(struct Node* node, const void* data, size_t size) {
@@ -59,44 +58,175 @@ _Bool NodeUpdate(struct Node* node, const void* data, size_t size) {
     LOG(ERR, "failed to get clock: %s", strerror(errno));
     return 0;
   }
-  void* data_copy = malloc(size);
-  if (!data_copy) {
-    LOG(ERR, "failed to copy data: %s", strerror(errno));
+  struct Payload* payload = PayloadReplace(node->payload, data, size);
+  if (!payload) {
+    LOG(ERR, "failed to replace payload");
     return 0;
   }
 
-  if (node->ph) {
-    // mburakov: There's a blocked poll call on this entry.
-    int result = fuse_notify_poll(node->ph);
-    if (result) {
-      LOG(ERR, "failed to notify poll: %s", strerror(-result));
-      goto rollback_malloc;
-    }
-    fuse_pollhandle_destroy(node->ph);
-    node->was_updated = 1;
-    node->ph = NULL;
+  // mburakov: Readers might still be copying out of the previous payload, so
+  // it is only released here, and freed when the last reader is done.
+  if (payload != node->payload) {
+    PayloadRelease(node->payload);
+    node->payload = payload;
   }
-
-  memcpy(data_copy, data, size);
-  free(node->data);
   node->mtime = now;
-  node->data = data_copy;
-  node->size = size;
+  node->version++;
+  node->evicted = 0;
+  node->committed = 0;
   return 1;
+}
+
+void NodeNotify(struct Node* node) {
+  // mburakov: Wake up every blocked poll call on this entry. Pollers would see
+  // the new version regardless of whether the notification went through.
+  for (struct Handle* handle = node->pollers; handle;) {
+    struct Handle* next = handle->next;
+    int result = fuse_lowlevel_notify_poll(handle->ph);
+    if (result) LOG(WARNING, "failed to notify poll: %s", strerror(-result));
+    fuse_pollhandle_destroy(handle->ph);
+    handle->ph = NULL;
+    handle->prev = NULL;
+    handle->next = NULL;
+    handle = next;
+  }
+  node->pollers = NULL;
+}
+
+void NodeEvict(struct Node* node) {
+  if (node->payload) node->evicted_size = node->payload->size;
+  PayloadRelease(node->payload);
+  node->payload = NULL;
+  node->evicted = 1;
+}
+
+void NodeSetAtime(struct Node* node, const struct timespec* atime) {
+  long long value = (long long)atime->tv_sec * 1000000000ll + atime->tv_nsec;
+  atomic_store_explicit(&node->atime, value, memory_order_relaxed);
+}
+
+struct timespec NodeGetAtime(const struct Node* node) {
+  long long value = atomic_load_explicit(&node->atime, memory_order_relaxed);
+  struct timespec result = {
+      .tv_sec = (time_t)(value / 1000000000ll),
+      .tv_nsec = (long)(value % 1000000000ll),
+  };
+  return result;
+}
+
+_Bool NodePath(const struct Node* node, struct Str* path) {
+  // mburakov: Nodes do not store their full paths, so those have to be
+  // assembled from the names of all the parents. Root node has no name.
+  size_t size = 0;
+  for (const struct Node* iter = node; iter->name; iter = iter->parent)
+    size += iter->name->str.size + 1;
+  size -= !!size;
+
+  char* data = malloc(size + 1);
+  if (!data) {
+    LOG(ERR, "failed to allocate path: %s", strerror(errno));
+    return 0;
+  }
+  data[size] = 0;
+  size_t offset = size;
+  for (const struct Node* iter = node; iter->name; iter = iter->parent) {
+    offset -= iter->name->str.size;
+    memcpy(data + offset, iter->name->str.data, iter->name->str.size);
+    if (offset) data[--offset] = '/';
+  }
+
+  path->size = size;
+  path->data = data;
+  return 1;
+}
 
-rollback_malloc:
-  free(data_copy);
-  return 0;
+_Bool NodeChildPath(const struct Node* parent, const struct Str* name,
+                    struct Str* path) {
+  struct Str parent_path;
+  if (!NodePath(parent, &parent_path)) {
+    LOG(ERR, "failed to get parent path");
+    return 0;
+  }
+  size_t size = parent_path.size + !!parent_path.size + name->size;
+  char* data = malloc(size + 1);
+  if (!data) {
+    LOG(ERR, "failed to allocate path: %s", strerror(errno));
+    StrFree(&parent_path);
+    return 0;
+  }
+  memcpy(data, parent_path.data, parent_path.size);
+  if (parent_path.size) data[parent_path.size] = '/';
+  memcpy(data + size - name->size, name->data, name->size);
+  data[size] = 0;
+  StrFree(&parent_path);
+
+  path->size = size;
+  path->data = data;
+  return 1;
 }
 
 int NodeCompare(const void* a, const void* b) {
-  _Static_assert(!offsetof(struct Node, path),
-                 "Something is wrong with your compiler");
-  return StrCompare(a, b);
+  const struct Node* node_a = a;
+  const struct Node* node_b = b;
+  return StrCompare(&node_a->name->str, &node_b->name->str);
+}
+
+_Bool NodeLink(struct Node* parent, struct Node* node) {
+  if (!tsearch(node, &parent->children, NodeCompare)) {
+    LOG(ERR, "failed to search child node: %s", strerror(errno));
+    return 0;
+  }
+  node->parent = parent;
+  return 1;
+}
+
+void NodeUnlink(struct Node* node) {
+  if (!node->parent) return;
+  tdelete(node, &node->parent->children, NodeCompare);
+  node->parent = NULL;
+}
+
+void NodeAddPoller(struct Node* node, struct Handle* handle) {
+  handle->prev = NULL;
+  handle->next = node->pollers;
+  if (node->pollers) node->pollers->prev = handle;
+  node->pollers = handle;
+}
+
+void NodeRemovePoller(struct Node* node, struct Handle* handle) {
+  if (handle->prev)
+    handle->prev->next = handle->next;
+  else
+    node->pollers = handle->next;
+  if (handle->next) handle->next->prev = handle->prev;
+  handle->prev = NULL;
+  handle->next = NULL;
+}
+
+void NodeDefer(struct Node** deferred, struct Node* node) {
+  if (node->deferred_prev) return;
+  node->deferred = *deferred;
+  if (*deferred) (*deferred)->deferred_prev = &node->deferred;
+  node->deferred_prev = deferred;
+  *deferred = node;
+}
+
+void NodeUndefer(struct Node* node) {
+  if (!node->deferred_prev) return;
+  *node->deferred_prev = node->deferred;
+  if (node->deferred) node->deferred->deferred_prev = node->deferred_prev;
+  node->deferred = NULL;
+  node->deferred_prev = NULL;
+}
+
+static void NodeDestroyNothing(void* node) {
+  // mburakov: Children are owned by the root tree, not by their parent.
+  (void)node;
 }
 
 void NodeDestroy(struct Node* node) {
-  StrFree(&node->path);
-  free(node->data);
-  free(node);
+  NodeUndefer(node);
+  tdestroy(node->children, NodeDestroyNothing);
+  PayloadRelease(node->payload);
+  PoolFree(node, sizeof(struct Node));
 }
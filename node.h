@@ -18,27 +18,76 @@
 #ifndef MQTTFS_NODE_H_
 #define MQTTFS_NODE_H_
 
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
-#include "str.h"
-
-struct fuse_pollhandle;
+struct Atom;
+struct Handle;
+struct Payload;
+struct Stream;
+struct Str;
 
 struct Node {
-  struct Str path;
-  struct timespec atime;
+  const struct Atom* name;
+  struct Node* parent;
+  void* children;
+  uint64_t ino;
+  // mburakov: Number of kernel references, which are added by lookups that
+  // only hold the root lock shared. Node is not destroyed while referenced.
+  atomic_ullong nlookup;
+  // mburakov: Access time is updated by readers, which only hold the root lock
+  // shared, so it is stored atomically as nanoseconds since the epoch.
+  atomic_llong atime;
+  // mburakov: Monotonic milliseconds of the last lazy subscription to the
+  // subtree of this node, or zero. Also updated with the root lock shared.
+  atomic_llong subscribed;
   struct timespec mtime;
-  void* data;
-  size_t size;
+  struct Payload* payload;
   _Bool is_dir;
-  _Bool was_updated;
-  struct fuse_pollhandle* ph;
+  // mburakov: Every update bumps the version, so that each open handle could
+  // tell whether it has seen the current payload. Handles with a blocked poll
+  // call are linked into the pollers list.
+  uint64_t version;
+  struct Handle* pollers;
+  // mburakov: Files opened as streams, which queue every update.
+  struct Stream* streams;
+  // mburakov: Monotonic microseconds of the last time pollers were woken up.
+  // Updates arriving sooner than the notify interval after that leave pollers
+  // waiting, and the node is linked into the deferred list of its connection.
+  int64_t notified;
+  struct Node* deferred;
+  struct Node** deferred_prev;
+  // mburakov: Epoch of the connection that did the last update, and its index.
+  uint64_t epoch;
+  // mburakov: Payload was dropped to stay within the memory budget. Its size
+  // is still reported, and it has to be fetched again before being used.
+  _Bool evicted;
+  size_t evicted_size;
+  // mburakov: Payload was written through the mount, and not yet updated by
+  // the broker. Writes only notify anybody once echoed back by the broker, so
+  // the echo must not be taken for a duplicate.
+  _Bool committed;
+  uint8_t connection;
 };
 
-struct Node* NodeCreate(const struct Str* path, _Bool is_dir);
+struct Node* NodeCreate(const struct Atom* name, _Bool is_dir);
 _Bool NodeUpdate(struct Node* node, const void* data, size_t size);
+void NodeEvict(struct Node* node);
+void NodeSetAtime(struct Node* node, const struct timespec* atime);
+struct timespec NodeGetAtime(const struct Node* node);
+_Bool NodePath(const struct Node* node, struct Str* path);
+_Bool NodeChildPath(const struct Node* parent, const struct Str* name,
+                    struct Str* path);
 int NodeCompare(const void* a, const void* b);
+_Bool NodeLink(struct Node* parent, struct Node* node);
+void NodeUnlink(struct Node* node);
+void NodeAddPoller(struct Node* node, struct Handle* handle);
+void NodeRemovePoller(struct Node* node, struct Handle* handle);
+void NodeNotify(struct Node* node);
+void NodeDefer(struct Node** deferred, struct Node* node);
+void NodeUndefer(struct Node* node);
 void NodeDestroy(struct Node* node);
 
 #endif  // MQTTFS_NODE_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "payload.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "log.h"
+#include "pool.h"
+
+// mburakov: Payloads are never modified while pinned. Updating a node either
+// overwrites a payload nobody else references, or swaps the payload pointer.
+// Readers can pin the current payload while holding the root lock, and copy
+// out of it after releasing the lock.
+
+// mburakov: Total size of all the live payloads, including pinned ones.
+static atomic_size_t g_payload_resident;
+
+struct Payload* PayloadCreate(const void* data, size_t size) {
+  size_t capacity;
+  struct Payload* result = PoolAlloc(sizeof(struct Payload) + size, &capacity);
+  if (!result) {
+    LOG(ERR, "failed to allocate payload: %s", strerror(errno));
+    return NULL;
+  }
+  atomic_init(&result->refs, 1);
+  result->size = size;
+  result->capacity = capacity - sizeof(struct Payload);
+  atomic_fetch_add_explicit(&g_payload_resident, capacity,
+                            memory_order_relaxed);
+  if (size) memcpy(result->data, data, size);
+  return result;
+}
+
+struct Payload* PayloadReplace(struct Payload* payload, const void* data,
+                               size_t size) {
+  // mburakov: Caller holds the root lock exclusively, so nobody could pin the
+  // payload concurrently. Without other references it is safe to overwrite,
+  // which is almost always the case for periodic sensor readings.
+  if (payload && payload->capacity >= size &&
+      atomic_load_explicit(&payload->refs, memory_order_acquire) == 1) {
+    if (size) memcpy(payload->data, data, size);
+    payload->size = size;
+    return payload;
+  }
+  return PayloadCreate(data, size);
+}
+
+struct Payload* PayloadAcquire(struct Payload* payload) {
+  atomic_fetch_add_explicit(&payload->refs, 1, memory_order_relaxed);
+  return payload;
+}
+
+void PayloadRelease(struct Payload* payload) {
+  if (!payload) return;
+  if (atomic_fetch_sub_explicit(&payload->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  size_t capacity = sizeof(struct Payload) + payload->capacity;
+  atomic_fetch_sub_explicit(&g_payload_resident, capacity,
+                            memory_order_relaxed);
+  PoolFree(payload, capacity);
+}
+
+size_t PayloadResident(void) {
+  return atomic_load_explicit(&g_payload_resident, memory_order_relaxed);
+}
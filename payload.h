@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_PAYLOAD_H_
+#define MQTTFS_PAYLOAD_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+struct Payload {
+  atomic_size_t refs;
+  size_t size;
+  size_t capacity;
+  char data[];
+};
+
+struct Payload* PayloadCreate(const void* data, size_t size);
+struct Payload* PayloadReplace(struct Payload* payload, const void* data,
+                               size_t size);
+struct Payload* PayloadAcquire(struct Payload* payload);
+void PayloadRelease(struct Payload* payload);
+size_t PayloadResident(void);
+
+#endif  // MQTTFS_PAYLOAD_H_
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifndef LENGTH
+#define LENGTH(op) (sizeof(op) / sizeof *(op))
+#endif  // LENGTH
+
+// mburakov: Nodes, atoms and payloads are allocated and freed all the time,
+// mostly with just a handful of distinct sizes. Small allocations are served
+// from per-class free lists, that are refilled with whole slabs, so the system
+// allocator is only called once per slab. Slabs are never given back.
+
+struct PoolClass {
+  atomic_flag lock;
+  void* free_list;
+};
+
+static const size_t kPoolSizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096,
+};
+static const size_t kPoolSlabSize = 65536;
+static struct PoolClass g_pool_classes[LENGTH(kPoolSizes)];
+static atomic_size_t g_pool_allocations;
+
+static size_t PoolClassIndex(size_t size) {
+  size_t index = 0;
+  while (index < LENGTH(kPoolSizes) && kPoolSizes[index] < size) index++;
+  return index;
+}
+
+static void PoolLock(struct PoolClass* pool_class) {
+  while (atomic_flag_test_and_set_explicit(&pool_class->lock,
+                                           memory_order_acquire)) {
+  }
+}
+
+static void PoolUnlock(struct PoolClass* pool_class) {
+  atomic_flag_clear_explicit(&pool_class->lock, memory_order_release);
+}
+
+void* PoolAlloc(size_t size, size_t* capacity) {
+  size_t index = PoolClassIndex(size);
+  if (index == LENGTH(kPoolSizes)) {
+    atomic_fetch_add_explicit(&g_pool_allocations, 1, memory_order_relaxed);
+    if (capacity) *capacity = size;
+    return malloc(size);
+  }
+
+  struct PoolClass* pool_class = g_pool_classes + index;
+  if (capacity) *capacity = kPoolSizes[index];
+  PoolLock(pool_class);
+  if (!pool_class->free_list) {
+    // mburakov: Carve a new slab into a list of free objects.
+    size_t count = kPoolSlabSize / kPoolSizes[index];
+    char* slab = malloc(count * kPoolSizes[index]);
+    if (!slab) {
+      PoolUnlock(pool_class);
+      return NULL;
+    }
+    atomic_fetch_add_explicit(&g_pool_allocations, 1, memory_order_relaxed);
+    for (size_t counter = count; counter--;) {
+      void** object = (void**)(slab + counter * kPoolSizes[index]);
+      *object = pool_class->free_list;
+      pool_class->free_list = object;
+    }
+  }
+  void** result = pool_class->free_list;
+  pool_class->free_list = *result;
+  PoolUnlock(pool_class);
+  return result;
+}
+
+void PoolFree(void* ptr, size_t size) {
+  if (!ptr) return;
+  size_t index = PoolClassIndex(size);
+  if (index == LENGTH(kPoolSizes)) {
+    free(ptr);
+    return;
+  }
+
+  struct PoolClass* pool_class = g_pool_classes + index;
+  PoolLock(pool_class);
+  *(void**)ptr = pool_class->free_list;
+  pool_class->free_list = ptr;
+  PoolUnlock(pool_class);
+}
+
+size_t PoolAllocations(void) {
+  return atomic_load_explicit(&g_pool_allocations, memory_order_relaxed);
+}
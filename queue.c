@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "ring.h"
+
+// mburakov: Queue passes records from a single producer thread to a single
+// consumer thread through a ring, which is mapped twice in a row so that every
+// record is contiguous. Neither side takes a lock as long as there is room, or
+// something to read, respectively. Otherwise the waiting side registers itself
+// as a waiter before checking once more and going to sleep, and the other side
+// only wakes it up if there are any waiters. Both steps are sequentially
+// consistent, so at least one of those sees the other. Consumer might also
+// wait with a deadline, which is in monotonic microseconds.
+
+typedef _Bool (*QueueReady)(const struct Queue* queue, size_t size);
+
+static _Bool CanWrite(const struct Queue* queue, size_t size) {
+  size_t used = atomic_load(&queue->tail) - atomic_load(&queue->head);
+  return queue->ring.size - used >= size || atomic_load(&queue->closed);
+}
+
+static _Bool CanRead(const struct Queue* queue, size_t size) {
+  (void)size;
+  return atomic_load(&queue->tail) != atomic_load(&queue->head) ||
+         atomic_load(&queue->closed);
+}
+
+static _Bool Wait(struct Queue* queue, QueueReady ready, size_t size,
+                  int64_t deadline) {
+  struct timespec abstime = {
+      .tv_sec = (time_t)(deadline / 1000000),
+      .tv_nsec = (long)(deadline % 1000000 * 1000),
+  };
+  int error = pthread_mutex_lock(&queue->mutex);
+  if (error) {
+    LOG(ERR, "failed to lock queue mutex: %s", strerror(error));
+    return 0;
+  }
+  atomic_fetch_add(&queue->waiters, 1);
+  while (!ready(queue, size)) {
+    error = deadline
+                ? pthread_cond_timedwait(&queue->cond, &queue->mutex, &abstime)
+                : pthread_cond_wait(&queue->cond, &queue->mutex);
+    if (error) {
+      if (error != ETIMEDOUT)
+        LOG(ERR, "failed to wait for queue: %s", strerror(error));
+      break;
+    }
+  }
+  atomic_fetch_sub(&queue->waiters, 1);
+  pthread_mutex_unlock(&queue->mutex);
+  return !error;
+}
+
+static void Wake(struct Queue* queue) {
+  if (!atomic_load(&queue->waiters)) return;
+  int error = pthread_mutex_lock(&queue->mutex);
+  if (error) {
+    LOG(ERR, "failed to lock queue mutex: %s", strerror(error));
+    return;
+  }
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+_Bool QueueInit(struct Queue* queue, size_t size) {
+  if (!RingInit(&queue->ring, size)) {
+    LOG(ERR, "failed to initialize ring");
+    return 0;
+  }
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->closed, 0);
+  atomic_init(&queue->waiters, 0);
+  int error = pthread_mutex_init(&queue->mutex, NULL);
+  if (error) {
+    LOG(ERR, "failed to initialize queue mutex: %s", strerror(error));
+    goto rollback_ring_init;
+  }
+  pthread_condattr_t attr;
+  error = pthread_condattr_init(&attr);
+  if (error) {
+    LOG(ERR, "failed to initialize queue cond attr: %s", strerror(error));
+    goto rollback_mutex_init;
+  }
+  error = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if (error) {
+    LOG(ERR, "failed to set queue cond clock: %s", strerror(error));
+    goto rollback_condattr_init;
+  }
+  error = pthread_cond_init(&queue->cond, &attr);
+  if (error) {
+    LOG(ERR, "failed to initialize queue cond: %s", strerror(error));
+    goto rollback_condattr_init;
+  }
+  pthread_condattr_destroy(&attr);
+  return 1;
+
+rollback_condattr_init:
+  pthread_condattr_destroy(&attr);
+rollback_mutex_init:
+  pthread_mutex_destroy(&queue->mutex);
+rollback_ring_init:
+  RingDestroy(&queue->ring);
+  return 0;
+}
+
+void* QueueWritable(struct Queue* queue, size_t size) {
+  // mburakov: Blocks until there is room for the record, which has to fit into
+  // the ring. Closed queue takes nothing anymore.
+  while (!CanWrite(queue, size)) Wait(queue, CanWrite, size, 0);
+  if (atomic_load(&queue->closed)) return NULL;
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  return queue->ring.data + (tail & (queue->ring.size - 1));
+}
+
+void QueueCommit(struct Queue* queue, size_t size) {
+  atomic_fetch_add(&queue->tail, size);
+  Wake(queue);
+}
+
+void* QueueReadable(struct Queue* queue, size_t* size, int64_t deadline) {
+  // mburakov: Blocks until there is something to read, or until the deadline,
+  // unless it is zero. Closed queue is still read until empty.
+  while (!CanRead(queue, 0)) {
+    if (!Wait(queue, CanRead, 0, deadline)) break;
+  }
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  *size = atomic_load(&queue->tail) - head;
+  if (!*size) return NULL;
+  return queue->ring.data + (head & (queue->ring.size - 1));
+}
+
+void QueueConsume(struct Queue* queue, size_t size) {
+  atomic_fetch_add(&queue->head, size);
+  Wake(queue);
+}
+
+void QueueClose(struct Queue* queue) {
+  atomic_store(&queue->closed, 1);
+  Wake(queue);
+}
+
+_Bool QueueClosed(const struct Queue* queue) {
+  return atomic_load(&queue->closed);
+}
+
+void QueueDestroy(struct Queue* queue) {
+  pthread_cond_destroy(&queue->cond);
+  pthread_mutex_destroy(&queue->mutex);
+  RingDestroy(&queue->ring);
+}
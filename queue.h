@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_QUEUE_H_
+#define MQTTFS_QUEUE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+struct Queue {
+  // mburakov: Only data and size of the ring are used, indices are atomic.
+  struct Ring ring;
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool closed;
+  atomic_size_t waiters;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+_Bool QueueInit(struct Queue* queue, size_t size);
+void* QueueWritable(struct Queue* queue, size_t size);
+void QueueCommit(struct Queue* queue, size_t size);
+void* QueueReadable(struct Queue* queue, size_t* size, int64_t deadline);
+void QueueConsume(struct Queue* queue, size_t size);
+void QueueClose(struct Queue* queue);
+_Bool QueueClosed(const struct Queue* queue);
+void QueueDestroy(struct Queue* queue);
+
+#endif  // MQTTFS_QUEUE_H_
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// mburakov: The ring buffer memory is mapped twice in a row. This way both
+// readable and writable regions are always contiguous, even when those wrap
+// around the end of the buffer, and parsing never has to copy anything. Size
+// has to be a power of two, and a multiple of the page size.
+
+_Bool RingInit(struct Ring* ring, size_t size) {
+  int fd = memfd_create("mqttfs_ring", MFD_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERR, "failed to create memfd: %s", strerror(errno));
+    return 0;
+  }
+  if (ftruncate(fd, (off_t)size) == -1) {
+    LOG(ERR, "failed to truncate memfd: %s", strerror(errno));
+    goto rollback_memfd_create;
+  }
+
+  // mburakov: Reserve address space for both mappings first.
+  uint8_t* data =
+      mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    LOG(ERR, "failed to reserve ring: %s", strerror(errno));
+    goto rollback_memfd_create;
+  }
+  for (size_t offset = 0; offset < size * 2; offset += size) {
+    if (mmap(data + offset, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      LOG(ERR, "failed to map ring: %s", strerror(errno));
+      goto rollback_mmap;
+    }
+  }
+
+  close(fd);
+  ring->data = data;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+  return 1;
+
+rollback_mmap:
+  munmap(data, size * 2);
+rollback_memfd_create:
+  close(fd);
+  return 0;
+}
+
+void* RingReadable(const struct Ring* ring, size_t* size) {
+  *size = ring->tail - ring->head;
+  return ring->data + (ring->head & (ring->size - 1));
+}
+
+void* RingWritable(const struct Ring* ring, size_t* size) {
+  *size = ring->size - (ring->tail - ring->head);
+  return ring->data + (ring->tail & (ring->size - 1));
+}
+
+void RingConsume(struct Ring* ring, size_t size) { ring->head += size; }
+
+void RingCommit(struct Ring* ring, size_t size) { ring->tail += size; }
+
+void RingDestroy(struct Ring* ring) { munmap(ring->data, ring->size * 2); }
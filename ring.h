@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_RING_H_
+#define MQTTFS_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Ring {
+  uint8_t* data;
+  size_t size;
+  size_t head;
+  size_t tail;
+};
+
+_Bool RingInit(struct Ring* ring, size_t size);
+void* RingReadable(const struct Ring* ring, size_t* size);
+void* RingWritable(const struct Ring* ring, size_t* size);
+void RingConsume(struct Ring* ring, size_t size);
+void RingCommit(struct Ring* ring, size_t size);
+void RingDestroy(struct Ring* ring);
+
+#endif  // MQTTFS_RING_H_
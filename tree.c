@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tree.h"
+
+#include <errno.h>
+#include <search.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "atom.h"
+#include "hash.h"
+#include "log.h"
+#include "node.h"
+#include "pool.h"
+#include "str.h"
+
+// mburakov: Nodes are hashed by their parent and name, so looking up a single
+// path segment takes constant time regardless of the amount of topics. Names
+// are interned, so comparing those is just comparing pointers.
+
+static size_t NodeHash(const struct Node* node) {
+  return HashCombine((size_t)(uintptr_t)node->parent, node->name->hash);
+}
+
+static int NodeMatch(const void* key, const void* item) {
+  const struct Node* key_node = key;
+  const struct Node* item_node = item;
+  return key_node->parent != item_node->parent ||
+         key_node->name != item_node->name;
+}
+
+static size_t OrphanHash(const struct Node* node) {
+  return HashBytes(&node, sizeof(node));
+}
+
+static int OrphanMatch(const void* key, const void* item) {
+  return key != item;
+}
+
+_Bool TreeInit(struct Tree* tree) {
+  // mburakov: Root inode number is fixed by FUSE.
+  struct Tree result = {
+      .root = NodeCreate(NULL, 1),
+      .inodes = 1,
+  };
+  if (!result.root) {
+    LOG(ERR, "failed to create root node");
+    return 0;
+  }
+  result.root->ino = result.inodes;
+  *tree = result;
+  return 1;
+}
+
+struct Node* TreeLookup(const struct Tree* tree, const struct Node* parent,
+                        const struct Str* name) {
+  const struct Atom* atom = AtomFind(&tree->atoms, name);
+  if (!atom) return NULL;
+  struct Node key = {
+      .name = atom,
+      .parent = (struct Node*)(uintptr_t)parent,
+  };
+  void** nodep = HashFind(&tree->nodes, &key, NodeHash(&key), NodeMatch);
+  return nodep ? *nodep : NULL;
+}
+
+struct Node* TreeFind(const struct Tree* tree, const struct Str* path) {
+  struct Node* node = tree->root;
+  if (!path->size) return node;
+  for (const char* ptr = path->data; node;) {
+    const char* end = path->data + path->size;
+    const char* separator = memchr(ptr, '/', (size_t)(end - ptr));
+    struct Str name = {
+        .size = (size_t)((separator ? separator : end) - ptr),
+        .data = ptr,
+    };
+    node = TreeLookup(tree, node, &name);
+    if (!separator) break;
+    ptr = separator + 1;
+  }
+  return node;
+}
+
+struct Node* TreeCreate(struct Tree* tree, struct Node* parent,
+                        const struct Str* name, _Bool is_dir) {
+  if (!name->size || memchr(name->data, '/', name->size)) {
+    LOG(ERR, "invalid node name");
+    return NULL;
+  }
+
+  const struct Atom* atom = AtomAcquire(&tree->atoms, name);
+  if (!atom) {
+    LOG(ERR, "failed to acquire atom");
+    return NULL;
+  }
+  struct Node* node = NodeCreate(atom, is_dir);
+  if (!node) {
+    LOG(ERR, "failed to create node");
+    goto rollback_atom_acquire;
+  }
+  node->ino = ++tree->inodes;
+
+  node->parent = parent;
+  size_t hash = NodeHash(node);
+  void** nodep = HashSearch(&tree->nodes, node, hash, NodeMatch);
+  if (!nodep) {
+    LOG(ERR, "failed to search node: %s", strerror(errno));
+    goto rollback_node_create;
+  }
+  if (*nodep != node) {
+    LOG(ERR, "node already exists");
+    goto rollback_node_create;
+  }
+  if (!NodeLink(parent, node)) {
+    LOG(ERR, "failed to link node");
+    goto rollback_hash_search;
+  }
+  return node;
+
+rollback_hash_search:
+  HashDelete(&tree->nodes, node, hash);
+rollback_node_create:
+  NodeDestroy(node);
+rollback_atom_acquire:
+  AtomRelease(&tree->atoms, atom);
+  return NULL;
+}
+
+_Bool TreeMove(struct Tree* tree, struct Node* node, struct Node* parent,
+               const struct Str* name) {
+  if (!name->size || memchr(name->data, '/', name->size)) {
+    LOG(ERR, "invalid node name");
+    return 0;
+  }
+
+  const struct Atom* atom = AtomAcquire(&tree->atoms, name);
+  if (!atom) {
+    LOG(ERR, "failed to acquire atom");
+    return 0;
+  }
+
+  // mburakov: Reserve slots for the node first, so that nothing could fail
+  // after the node is taken out of its current place.
+  struct Node key = {
+      .name = atom,
+      .parent = parent,
+  };
+  size_t hash = NodeHash(&key);
+  void** nodep = HashSearch(&tree->nodes, &key, hash, NodeMatch);
+  if (!nodep) {
+    LOG(ERR, "failed to search node: %s", strerror(errno));
+    goto rollback_atom_acquire;
+  }
+  if (*nodep != &key) {
+    LOG(ERR, "node already exists");
+    goto rollback_atom_acquire;
+  }
+  if (!tsearch(&key, &parent->children, NodeCompare)) {
+    LOG(ERR, "failed to search child node: %s", strerror(errno));
+    goto rollback_hash_search;
+  }
+
+  // mburakov: Deleting might move things around in both the hash and the
+  // tree, so reserved slots have to be looked up again afterwards.
+  HashDelete(&tree->nodes, node, NodeHash(node));
+  NodeUnlink(node);
+  AtomRelease(&tree->atoms, node->name);
+  node->name = atom;
+  node->parent = parent;
+  *HashFind(&tree->nodes, &key, hash, NodeMatch) = node;
+  *(struct Node**)tfind(&key, &parent->children, NodeCompare) = node;
+  return 1;
+
+rollback_hash_search:
+  HashDelete(&tree->nodes, &key, hash);
+rollback_atom_acquire:
+  AtomRelease(&tree->atoms, atom);
+  return 0;
+}
+
+void TreeExchange(struct Tree* tree, struct Node* a, struct Node* b) {
+  // mburakov: Parents order children by name, so their slots have to be
+  // looked up before the names are exchanged.
+  struct Node** a_childp = tfind(a, &a->parent->children, NodeCompare);
+  struct Node** b_childp = tfind(b, &b->parent->children, NodeCompare);
+  HashDelete(&tree->nodes, a, NodeHash(a));
+  HashDelete(&tree->nodes, b, NodeHash(b));
+
+  const struct Atom* temp_name = a->name;
+  struct Node* temp_parent = a->parent;
+  a->name = b->name;
+  a->parent = b->parent;
+  b->name = temp_name;
+  b->parent = temp_parent;
+
+  // mburakov: Hash never shrinks, so putting nodes back can not fail.
+  *HashSearch(&tree->nodes, a, NodeHash(a), NodeMatch) = a;
+  *HashSearch(&tree->nodes, b, NodeHash(b), NodeMatch) = b;
+  *a_childp = b;
+  *b_childp = a;
+}
+
+void TreeRemove(struct Tree* tree, struct Node* node) {
+  HashDelete(&tree->nodes, node, NodeHash(node));
+  NodeUnlink(node);
+  AtomRelease(&tree->atoms, node->name);
+  node->name = NULL;
+  if (!atomic_load(&node->nlookup)) {
+    NodeDestroy(node);
+    return;
+  }
+
+  // mburakov: Kernel still references the node, so it is kept around without
+  // a name and a parent until the kernel forgets it.
+  void** nodep =
+      HashSearch(&tree->orphans, node, OrphanHash(node), OrphanMatch);
+  if (!nodep) {
+    // mburakov: Node is leaked, but at least nothing is left dangling.
+    LOG(ERR, "failed to search orphan node: %s", strerror(errno));
+  }
+}
+
+void TreeForget(struct Tree* tree, struct Node* node, uint64_t nlookup) {
+  if (atomic_fetch_sub(&node->nlookup, nlookup) != nlookup) return;
+  if (node == tree->root || node->parent) return;
+  HashDelete(&tree->orphans, node, OrphanHash(node));
+  NodeDestroy(node);
+}
+
+void TreeDestroy(struct Tree* tree) {
+  for (size_t index = 0; index < tree->nodes.alloc; index++) {
+    struct Node* node = tree->nodes.slots[index].item;
+    if (node) NodeDestroy(node);
+  }
+  for (size_t index = 0; index < tree->atoms.alloc; index++) {
+    struct Atom* atom = tree->atoms.slots[index].item;
+    if (atom) PoolFree(atom, sizeof(struct Atom) + atom->str.size + 1);
+  }
+  for (size_t index = 0; index < tree->orphans.alloc; index++) {
+    struct Node* node = tree->orphans.slots[index].item;
+    if (node) NodeDestroy(node);
+  }
+  NodeDestroy(tree->root);
+  HashDestroy(&tree->orphans);
+  HashDestroy(&tree->nodes);
+  HashDestroy(&tree->atoms);
+}
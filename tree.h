@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Mikhail Burakov. This file is part of mqttfs.
+ *
+ * mqttfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mqttfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mqttfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MQTTFS_TREE_H_
+#define MQTTFS_TREE_H_
+
+#include <stdint.h>
+
+#include "hash.h"
+
+struct Node;
+struct Str;
+
+struct Tree {
+  struct Hash atoms;
+  struct Hash nodes;
+  struct Hash orphans;
+  struct Node* root;
+  uint64_t inodes;
+};
+
+_Bool TreeInit(struct Tree* tree);
+struct Node* TreeLookup(const struct Tree* tree, const struct Node* parent,
+                        const struct Str* name);
+struct Node* TreeFind(const struct Tree* tree, const struct Str* path);
+struct Node* TreeCreate(struct Tree* tree, struct Node* parent,
+                        const struct Str* name, _Bool is_dir);
+_Bool TreeMove(struct Tree* tree, struct Node* node, struct Node* parent,
+               const struct Str* name);
+void TreeExchange(struct Tree* tree, struct Node* a, struct Node* b);
+void TreeRemove(struct Tree* tree, struct Node* node);
+void TreeForget(struct Tree* tree, struct Node* node, uint64_t nlookup);
+void TreeDestroy(struct Tree* tree);
+
+#endif  // MQTTFS_TREE_H_